@@ -0,0 +1,323 @@
+// async_out.h
+// Asynchronous, ordered output for the servers' receive loops.
+
+// A statistics dump is a thousand lines or more, and printing it with printf
+// from the receive loop means the loop stops receiving until every byte has
+// gone out to wherever stdout leads. To a file that is quick, but to a
+// terminal, an ssh session, or a pipe whose reader has fallen behind, write()
+// blocks, and reports pile up in the queue behind the dump.
+//
+// Instead, the servers format their output into a small pool of buffers
+// (OUT_BUFFERS of OUT_BUFFER_SIZE bytes each) with out_printf, and out_flush
+// queues the filled buffers to be written through io_uring (see uring.h).
+// Neither waits for the write. Buffers are written one at a time, in the
+// order they were queued: a terminal or pipe may take only part of a write,
+// and the rest has to go out before anything queued after it. When a write
+// completes, a small completion thread (which spends its life asleep in
+// io_uring_enter) queues the rest of a short write, or the next buffer, and
+// recycles finished buffers. Only if every buffer is still waiting to be
+// written does out_printf wait for one, which is counted in the "waits"
+// printed at exit.
+//
+// IPC_OUTPUT=sync makes out_flush write() the buffers itself, which is how
+// all output used to work, for comparison (see bench_dump.sh). The same
+// happens if the kernel has no io_uring, or does not support IORING_OP_WRITE.
+//
+// All output after out_open should go through here, or it may come out ahead
+// of buffers that are still queued. out_close, which is safe to call from
+// the SIGINT handler, waits for what is queued and then turns out_printf
+// back into plain printf for the final messages. Before out_open, out_printf
+// is plain printf too.
+//
+// NOTE: the servers must be rebuilt if this file changes.
+
+#ifndef ASYNC_OUT_H
+#define ASYNC_OUT_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "uring.h"
+
+#define OUT_BUFFERS 16
+#define OUT_BUFFER_SIZE (64 * 1024)
+
+#define OUT_URING 0
+#define OUT_SYNC 1
+
+struct out_buffer {
+    char *data;
+    size_t len;  // bytes formatted into it
+    size_t done; // bytes already written (after a short write)
+};
+
+struct async_out {
+    int fd;
+    int mode;                  // OUT_URING or OUT_SYNC
+    pthread_mutex_t lock;      // guards everything below but pending and running
+    pthread_cond_t space;      // out_printf waits here for a free buffer
+    struct uring ring;
+    struct out_buffer bufs[OUT_BUFFERS];
+    int free[OUT_BUFFERS];     // buffers ready to fill
+    int nfree;
+    int current;               // buffer being filled, or -1
+    int queue[OUT_BUFFERS];    // filled buffers waiting to be written, oldest first
+    int qhead, qlen;
+    int writing;               // buffer being written, or -1
+    pthread_t completer;
+    _Atomic int pending;       // buffers queued or being written
+    _Atomic int running;       // set by out_open, cleared by out_close
+
+    // Statistics.
+    uint64_t writes, bytes, waits, short_writes, errors;
+};
+
+static inline const char *out_mode_name(int mode)
+{
+    return mode == OUT_URING ? "io_uring" : "synchronous";
+}
+
+// Write all n bytes at p to fd. Returns 0, or -1 with errno set.
+static inline int out_write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+// Buffer b has been written out (or failed to be); make it free again.
+static inline void out_retire_locked(struct async_out *o, int b, int failed)
+{
+    if (failed)
+        o->errors++;
+    o->writes++;
+    o->bytes += o->bufs[b].len;
+    o->free[o->nfree++] = b;
+    atomic_fetch_sub_explicit(&o->pending, 1, memory_order_release);
+    pthread_cond_broadcast(&o->space);
+}
+
+// Write the rest of buffer b now, and retire it.
+static inline void out_write_now_locked(struct async_out *o, int b)
+{
+    struct out_buffer *buf = &o->bufs[b];
+    out_retire_locked(o, b, out_write_all(o->fd, buf->data + buf->done, buf->len - buf->done) < 0);
+}
+
+// Start writing the rest of the buffer being written, or else the next queued
+// buffer, if there is one. In OUT_SYNC mode, write out the whole queue.
+static inline void out_start_locked(struct async_out *o)
+{
+    while (1) {
+        if (o->writing < 0) {
+            if (o->qlen == 0)
+                return;
+            o->writing = o->queue[o->qhead];
+            o->qhead = (o->qhead + 1) % OUT_BUFFERS;
+            o->qlen--;
+        }
+        struct out_buffer *buf = &o->bufs[o->writing];
+        if (o->mode == OUT_URING &&
+            uring_prep_write(&o->ring, o->fd, buf->data + buf->done, buf->len - buf->done, o->writing) != NULL &&
+            uring_submit(&o->ring, 0) == 0)
+            return;
+        o->mode = OUT_SYNC; // if the ring was in use, it's broken; carry on without it
+        out_write_now_locked(o, o->writing);
+        o->writing = -1;
+    }
+}
+
+// The completion thread: wait for each write to finish, then start the next.
+static inline void *out_completer(void *arg)
+{
+    struct async_out *o = (struct async_out *)arg;
+    while (uring_wait(&o->ring, 1) == 0) {
+        pthread_mutex_lock(&o->lock);
+        struct io_uring_cqe cqe;
+        while (uring_peek(&o->ring, &cqe)) {
+            int b = cqe.user_data;
+            struct out_buffer *buf = &o->bufs[b];
+            if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+                o->mode = OUT_SYNC; // no IORING_OP_WRITE on this kernel
+                out_write_now_locked(o, b);
+            } else if (cqe.res == -EINTR || cqe.res == -EAGAIN ||
+                       (cqe.res >= 0 && buf->done + cqe.res < buf->len)) {
+                if (cqe.res > 0) {
+                    buf->done += cqe.res;
+                    o->short_writes++;
+                }
+                continue; // still being written; the rest is started below
+            } else {
+                out_retire_locked(o, b, cqe.res < 0);
+            }
+            o->writing = -1;
+        }
+        out_start_locked(o);
+        pthread_mutex_unlock(&o->lock);
+    }
+    return NULL;
+}
+
+// Set up output to fd (normally 1), with the mode from IPC_OUTPUT. Anything
+// printf has buffered is flushed first, so it stays ahead of what follows.
+// Returns 0, or prints an error and returns -1.
+static inline int out_open(struct async_out *o, int fd)
+{
+    const char *env = getenv("IPC_OUTPUT");
+    if (env != NULL && strcmp(env, "sync") && strcmp(env, "uring")) {
+        printf("IPC_OUTPUT must be \"uring\" or \"sync\".\n");
+        return -1;
+    }
+    memset(o, 0, sizeof(*o));
+    o->fd = fd;
+    o->current = -1;
+    o->writing = -1;
+    o->ring.fd = -1;
+    o->mode = (env != NULL && !strcmp(env, "sync")) ? OUT_SYNC : OUT_URING;
+    char *pool = mmap(0, (size_t)OUT_BUFFERS * OUT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        perror("mmap");
+        printf("Can't allocate output buffers.\n");
+        return -1;
+    }
+    for (int i = 0; i < OUT_BUFFERS; i++) {
+        o->bufs[i].data = pool + (size_t)i * OUT_BUFFER_SIZE;
+        o->free[o->nfree++] = i;
+    }
+    pthread_mutex_init(&o->lock, NULL);
+    pthread_cond_init(&o->space, NULL);
+    if (o->mode == OUT_URING && uring_init(&o->ring, 4) < 0) {
+        perror("io_uring_setup");
+        printf("io_uring is not available; writing output synchronously.\n");
+        o->mode = OUT_SYNC;
+    }
+    if (o->mode == OUT_URING && pthread_create(&o->completer, NULL, out_completer, o) != 0) {
+        printf("Can't start the output completion thread; writing output synchronously.\n");
+        o->mode = OUT_SYNC;
+    }
+    printf("Writing output with %s writes.\n", out_mode_name(o->mode));
+    fflush(stdout);
+    atomic_store_explicit(&o->running, 1, memory_order_release);
+    return 0;
+}
+
+// Make the current buffer one with room in it, waiting for a write to finish
+// if every buffer is taken.
+static inline struct out_buffer *out_take_locked(struct async_out *o)
+{
+    if (o->current >= 0)
+        return &o->bufs[o->current];
+    if (o->nfree == 0)
+        o->waits++;
+    while (o->nfree == 0)
+        pthread_cond_wait(&o->space, &o->lock);
+    o->current = o->free[--o->nfree];
+    struct out_buffer *buf = &o->bufs[o->current];
+    buf->len = 0;
+    buf->done = 0;
+    return buf;
+}
+
+// Queue the current buffer for writing, if anything is in it.
+static inline void out_send_locked(struct async_out *o)
+{
+    if (o->current < 0 || o->bufs[o->current].len == 0)
+        return;
+    o->queue[(o->qhead + o->qlen++) % OUT_BUFFERS] = o->current;
+    o->current = -1;
+    atomic_fetch_add_explicit(&o->pending, 1, memory_order_relaxed);
+    if (o->writing < 0)
+        out_start_locked(o);
+}
+
+// Format into the output buffers. Nothing is written until out_flush, or
+// until a buffer fills up.
+static inline void out_printf(struct async_out *o, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static inline void out_printf(struct async_out *o, const char *fmt, ...)
+{
+    va_list ap;
+    if (!atomic_load_explicit(&o->running, memory_order_acquire)) {
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        return;
+    }
+    pthread_mutex_lock(&o->lock);
+    for (int tries = 0; tries < 2; tries++) {
+        struct out_buffer *buf = out_take_locked(o);
+        size_t room = OUT_BUFFER_SIZE - buf->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(buf->data + buf->len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            break;
+        if ((size_t)n < room) {
+            buf->len += n;
+            break;
+        }
+        if (buf->len == 0) {
+            buf->len = OUT_BUFFER_SIZE - 1; // longer than a whole buffer: cut it off
+            break;
+        }
+        out_send_locked(o); // doesn't fit: send what's there and start a fresh one
+    }
+    pthread_mutex_unlock(&o->lock);
+}
+
+// Start writing everything printed so far. Does not wait for it.
+static inline void out_flush(struct async_out *o)
+{
+    if (!atomic_load_explicit(&o->running, memory_order_acquire)) {
+        fflush(stdout);
+        return;
+    }
+    pthread_mutex_lock(&o->lock);
+    out_send_locked(o);
+    pthread_mutex_unlock(&o->lock);
+}
+
+// Write out everything printed so far and wait for it, then send all further
+// output through printf. Safe to call from a signal handler that may have
+// interrupted out_printf: it does not wait for the lock, and gives up on the
+// queued buffers after two seconds.
+static inline void out_close(struct async_out *o)
+{
+    if (!atomic_load_explicit(&o->running, memory_order_acquire))
+        return;
+    if (pthread_mutex_trylock(&o->lock) == 0) {
+        out_send_locked(o);
+        pthread_mutex_unlock(&o->lock);
+    }
+    for (int i = 0; i < 2000 && atomic_load_explicit(&o->pending, memory_order_acquire) > 0; i++)
+        usleep(1000);
+    atomic_store_explicit(&o->running, 0, memory_order_release);
+    int left = atomic_load(&o->pending);
+    if (left > 0)
+        printf("\nOutput did not finish; %d buffers were not written.\n", left);
+    if (o->mode == OUT_URING)
+        printf("Output: %llu writes through io_uring of %.1f KB on average, %llu short, %llu failed, %llu waits for a free buffer.\n",
+               (unsigned long long)o->writes, o->writes ? o->bytes / 1024.0 / o->writes : 0.0,
+               (unsigned long long)o->short_writes, (unsigned long long)o->errors,
+               (unsigned long long)o->waits);
+}
+
+#endif // ASYNC_OUT_H
@@ -0,0 +1,460 @@
+// bb_ring.h
+// Single-producer/single-consumer ring for the bounded-buffer transport.
+// Shared by server_bb.c and client_bb.c.
+
+// The original bounded buffer put "in", "out", and "totalValue" on the same
+// cache line as the start of the buffer, and relied on volatile for ordering.
+// Every item then bounced that line between the producer's and the consumer's
+// cores. This version fixes that:
+//
+// * "in" (written only by the producer) and "out" (written only by the
+//   consumer) each live on their own cache line, and the buffer starts on a
+//   third line, so the two sides never false-share.
+// * Indices are free-running 32-bit counters. The capacity is a power of two,
+//   so the slot for an index is (index & BB_MASK) and no division is needed.
+//   Because the counters never wrap modulo the capacity, all BB_CAPACITY slots
+//   are usable (no "one slot must stay empty" rule).
+// * Publishing uses C11 release stores and observing uses acquire loads, so the
+//   item written into a slot is guaranteed to be visible before the index that
+//   covers it.
+// * Each side keeps a private copy of the other side's index, and only reloads
+//   the shared one when the cached value says the ring is full (producer) or
+//   empty (consumer). In steady state that avoids touching the peer's line.
+//
+// * The batched calls further down let either side work on a
+//   contiguous span of slots and publish its index once per batch, so a batch
+//   of N items costs one cache-line handoff instead of N.
+//
+// * The record calls at the bottom of this file reuse the same indices and
+//   buffer as a byte ring of variable-length records, for payloads that are
+//   not a single int.
+//
+// * A fourth cache line carries completion tokens (see measure.h). The client
+//   posts a token along with its last publish, and the server acks it once it
+//   has drained everything up to that point, so the client knows exactly when
+//   the server finished instead of inferring it from the indices.
+//
+// NOTE: both programs must be rebuilt if this file changes.
+
+#ifndef BB_RING_H
+#define BB_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "measure.h"
+
+#define CACHE_LINE 64
+#define BB_CAPACITY (1024*1024) // number of int slots, must be a power of two
+#define BB_MASK (BB_CAPACITY - 1)
+
+_Static_assert((BB_CAPACITY & BB_MASK) == 0, "BB_CAPACITY must be a power of two");
+
+struct shared_stuff
+{
+    // Producer's cache line. in_waiters is written only when the consumer goes
+    // to sleep (see shm_wait.h), so it is almost always read-only here.
+    _Alignas(CACHE_LINE) _Atomic uint32_t in;   // next slot the producer will fill
+    _Atomic uint32_t in_waiters;                // consumers asleep waiting for "in" to move
+
+    // Consumer's cache line. totalValue is only written by the consumer, so it
+    // can share the line with "out" without causing extra traffic.
+    _Alignas(CACHE_LINE) _Atomic uint32_t out;  // next slot the consumer will drain
+    _Atomic int64_t totalValue;                 // sum of all items consumed so far
+    _Atomic int64_t totalRecords;               // items (ints or records) consumed so far
+    _Atomic uint32_t mode;                      // BB_MODE_INTS or BB_MODE_RECORDS, set by the server
+    _Atomic uint32_t out_waiters;               // producers asleep waiting for "out" to move
+
+    // Completion token line, touched once per run. The client writes
+    // token_at and token; the server writes ack and then acked.
+    _Alignas(CACHE_LINE) _Atomic uint32_t token; // the client's latest token
+    uint32_t token_at;                          // its position: "in" when it was posted
+    _Atomic uint32_t acked;                     // the last token the server acked
+    _Atomic uint32_t acked_waiters;             // clients asleep waiting for "acked" to move
+    struct measure_ack ack;                     // the server's answer to token "acked"
+
+    _Alignas(CACHE_LINE) union {
+        int buffer[BB_CAPACITY];                       // BB_MODE_INTS: one int per slot
+        unsigned char bytes[BB_CAPACITY * sizeof(int)]; // BB_MODE_RECORDS: indices count bytes
+    };
+};
+
+// What the ring carries. The server picks the mode when it creates the region,
+// and the client checks it before producing anything.
+#define BB_MODE_INTS 0
+#define BB_MODE_RECORDS 1
+
+// Producer-side handle. Lives in the producer's private memory.
+struct bb_producer
+{
+    struct shared_stuff *p;
+    uint32_t head;       // private copy of p->in
+    uint32_t tail_cache; // last value of p->out we observed
+    uint32_t seq;        // sequence number for the next record (BB_MODE_RECORDS)
+};
+
+// Consumer-side handle. Lives in the consumer's private memory.
+struct bb_consumer
+{
+    struct shared_stuff *p;
+    uint32_t tail;       // private copy of p->out
+    uint32_t head_cache; // last value of p->in we observed
+};
+
+// Reset the shared indices. Only the side that creates the region should call
+// this, and only before the other side attaches.
+static inline void bb_init(struct shared_stuff *p, uint32_t mode)
+{
+    atomic_store_explicit(&p->in, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->out, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->totalValue, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->totalRecords, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->mode, mode, memory_order_relaxed);
+    atomic_store_explicit(&p->in_waiters, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->out_waiters, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->token, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->acked, 0, memory_order_relaxed);
+    atomic_store_explicit(&p->acked_waiters, 0, memory_order_relaxed);
+    memset(&p->ack, 0, sizeof(p->ack));
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void bb_producer_attach(struct bb_producer *w, struct shared_stuff *p)
+{
+    w->p = p;
+    w->head = atomic_load_explicit(&p->in, memory_order_relaxed);
+    w->tail_cache = atomic_load_explicit(&p->out, memory_order_acquire);
+    w->seq = 0;
+}
+
+static inline void bb_consumer_attach(struct bb_consumer *r, struct shared_stuff *p)
+{
+    r->p = p;
+    r->tail = atomic_load_explicit(&p->out, memory_order_relaxed);
+    r->head_cache = atomic_load_explicit(&p->in, memory_order_acquire);
+}
+
+// Add one item. Returns 1 on success, or 0 if the ring is full.
+static inline int bb_push(struct bb_producer *w, int item)
+{
+    if (w->head - w->tail_cache == BB_CAPACITY) {
+        w->tail_cache = atomic_load_explicit(&w->p->out, memory_order_acquire);
+        if (w->head - w->tail_cache == BB_CAPACITY)
+            return 0;
+    }
+    w->p->buffer[w->head & BB_MASK] = item;
+    w->head++;
+    atomic_store_explicit(&w->p->in, w->head, memory_order_release);
+    return 1;
+}
+
+// Look at the oldest item without removing it. Returns a pointer to the slot,
+// or NULL if the ring is empty. The slot stays owned by the consumer until
+// bb_consume() is called, so anything the consumer wants the producer to see
+// along with the freed slot (e.g. totalValue) should be stored before that.
+static inline int *bb_peek(struct bb_consumer *r)
+{
+    if (r->tail == r->head_cache) {
+        r->head_cache = atomic_load_explicit(&r->p->in, memory_order_acquire);
+        if (r->tail == r->head_cache)
+            return NULL;
+    }
+    return &r->p->buffer[r->tail & BB_MASK];
+}
+
+// Release the slot returned by the last bb_peek() back to the producer.
+static inline void bb_consume(struct bb_consumer *r)
+{
+    r->tail++;
+    atomic_store_explicit(&r->p->out, r->tail, memory_order_release);
+}
+
+// Remove one item. Returns 1 on success, or 0 if the ring is empty.
+static inline int bb_pop(struct bb_consumer *r, int *item)
+{
+    int *slot = bb_peek(r);
+    if (slot == NULL)
+        return 0;
+    *item = *slot;
+    bb_consume(r);
+    return 1;
+}
+
+// Batched interface.
+//
+// The producer calls bb_reserve() to get a pointer to up to n contiguous free
+// slots, fills them however it likes (memcpy, a vectorized loop, ...), and
+// marks them filled with bb_produce(). Nothing is visible to the consumer until
+// bb_publish() stores the index, so a batch that wraps around the end of the
+// buffer can be built from two spans and still be published once. The consumer
+// side is symmetric: bb_peek_n(), bb_advance(), bb_release().
+
+// Returns a pointer to the first of *got (<= n) contiguous free slots, or NULL
+// with *got = 0 if the ring is full. Spans never cross the end of the buffer.
+static inline int *bb_reserve(struct bb_producer *w, uint32_t n, uint32_t *got)
+{
+    uint32_t free_slots = BB_CAPACITY - (w->head - w->tail_cache);
+    if (free_slots < n) {
+        w->tail_cache = atomic_load_explicit(&w->p->out, memory_order_acquire);
+        free_slots = BB_CAPACITY - (w->head - w->tail_cache);
+    }
+    uint32_t idx = w->head & BB_MASK;
+    uint32_t to_end = BB_CAPACITY - idx;
+    if (n > free_slots)
+        n = free_slots;
+    if (n > to_end)
+        n = to_end;
+    *got = n;
+    return n ? &w->p->buffer[idx] : NULL;
+}
+
+// Mark n reserved slots as filled. They are not visible until bb_publish().
+static inline void bb_produce(struct bb_producer *w, uint32_t n)
+{
+    w->head += n;
+}
+
+// Make every produced slot visible to the consumer.
+static inline void bb_publish(struct bb_producer *w)
+{
+    atomic_store_explicit(&w->p->in, w->head, memory_order_release);
+}
+
+// Returns a pointer to the first of *got (<= n) contiguous filled slots, or
+// NULL with *got = 0 if the ring is empty. Spans never cross the end of the buffer.
+static inline int *bb_peek_n(struct bb_consumer *r, uint32_t n, uint32_t *got)
+{
+    uint32_t avail = r->head_cache - r->tail;
+    if (avail < n) {
+        r->head_cache = atomic_load_explicit(&r->p->in, memory_order_acquire);
+        avail = r->head_cache - r->tail;
+    }
+    uint32_t idx = r->tail & BB_MASK;
+    uint32_t to_end = BB_CAPACITY - idx;
+    if (n > avail)
+        n = avail;
+    if (n > to_end)
+        n = to_end;
+    *got = n;
+    return n ? &r->p->buffer[idx] : NULL;
+}
+
+// Mark n peeked slots as drained. They are not returned to the producer until
+// bb_release().
+static inline void bb_advance(struct bb_consumer *r, uint32_t n)
+{
+    r->tail += n;
+}
+
+// Hand every drained slot back to the producer.
+static inline void bb_release(struct bb_consumer *r)
+{
+    atomic_store_explicit(&r->p->out, r->tail, memory_order_release);
+}
+
+// Copy up to n items into the ring, wrapping around the end of the buffer if
+// needed, and publish once. Returns the number of items actually copied.
+static inline uint32_t bb_push_n(struct bb_producer *w, const int *items, uint32_t n)
+{
+    uint32_t done = 0, got;
+    int *span;
+    while (done < n && (span = bb_reserve(w, n - done, &got)) != NULL) {
+        memcpy(span, items + done, got * sizeof(int));
+        bb_produce(w, got);
+        done += got;
+    }
+    if (done)
+        bb_publish(w);
+    return done;
+}
+
+// Copy up to n items out of the ring, wrapping around the end of the buffer if
+// needed, and release once. Returns the number of items actually copied.
+static inline uint32_t bb_pop_n(struct bb_consumer *r, int *items, uint32_t n)
+{
+    uint32_t done = 0, got;
+    int *span;
+    while (done < n && (span = bb_peek_n(r, n - done, &got)) != NULL) {
+        memcpy(items + done, span, got * sizeof(int));
+        bb_advance(r, got);
+        done += got;
+    }
+    if (done)
+        bb_release(r);
+    return done;
+}
+
+// Completion tokens.
+//
+// The producer posts a token with bb_post_token() just before its final
+// bb_publish(), while at least one item is still unpublished: the server is
+// woken for the publish (the change to "in"), not for the token, so a token
+// posted with nothing left to publish could sit unseen while the server
+// sleeps. The consumer calls bb_token_due() after each bb_release(), and once
+// it returns a token, fills in p->ack and calls bb_ack_token().
+
+// Post a token for everything produced so far. Returns the token.
+static inline uint32_t bb_post_token(struct bb_producer *w)
+{
+    uint32_t token = atomic_load_explicit(&w->p->acked, memory_order_relaxed) + 1;
+    w->p->token_at = w->head;
+    atomic_store_explicit(&w->p->token, token, memory_order_release);
+    return token;
+}
+
+// The token the consumer should ack now, or 0 if there is none or it has not
+// yet drained up to the token's position.
+static inline uint32_t bb_token_due(struct bb_consumer *r)
+{
+    uint32_t token = atomic_load_explicit(&r->p->token, memory_order_acquire);
+    if (token == atomic_load_explicit(&r->p->acked, memory_order_relaxed))
+        return 0;
+    if ((int32_t)(r->tail - r->p->token_at) < 0)
+        return 0;
+    return token;
+}
+
+// Publish the ack in p->ack for token. The caller wakes the producer.
+static inline void bb_ack_token(struct bb_consumer *r, uint32_t token)
+{
+    r->p->ack.token = token;
+    atomic_store_explicit(&r->p->acked, token, memory_order_release);
+}
+
+// Record interface (BB_MODE_RECORDS).
+//
+// The buffer is treated as BB_BYTES bytes and "in"/"out" count bytes instead of
+// ints. Each record is a struct bb_record header followed by its payload, padded
+// so the next header starts on a BB_REC_ALIGN boundary. A record never wraps
+// around the end of the buffer: if it does not fit in the space that is left,
+// the producer fills that space with a BB_REC_PAD record, which the consumer
+// skips, and starts the real record at offset 0.
+//
+// The consumer can't trust a header: the producer can write it at any time.
+// So a pad is always skipped to the end of the buffer, whatever its size says,
+// and bb_msg_size() reads a record's size once and checks it before anything
+// uses it. A malformed record loses everything published with it
+// (bb_msg_discard), since where the next record starts is then unknown.
+//
+// Both sides work in place. The producer calls bb_msg_reserve() to get a
+// pointer straight into shared memory, serializes its payload there, and then
+// calls bb_msg_commit(). The consumer calls bb_msg_peek(), reads the payload
+// where it lies, and then calls bb_msg_advance(). As with the int interface,
+// bb_publish()/bb_release() make the work visible, so several records can be
+// handed over with one index store.
+
+#define BB_BYTES (BB_CAPACITY * sizeof(int))
+#define BB_BYTES_MASK (BB_BYTES - 1)
+#define BB_REC_ALIGN 16
+#define BB_REC_PAD 0xffffffffu
+#define BB_MSG_MAX (BB_BYTES / 4 - sizeof(struct bb_record)) // largest payload
+
+struct bb_record
+{
+    uint32_t size;   // payload bytes following this header
+    uint32_t type;   // BB_REC_PAD, or a message type (like ipcmsg's msgtype)
+    int32_t eventid; // the event type ID
+    uint32_t seq;    // producer's record counter, lets the consumer spot loss
+};
+
+_Static_assert(sizeof(struct bb_record) == BB_REC_ALIGN, "bb_record must be one alignment unit");
+
+static inline uint32_t bb_rec_span(uint32_t size)
+{
+    return (sizeof(struct bb_record) + size + BB_REC_ALIGN - 1) & ~(uint32_t)(BB_REC_ALIGN - 1);
+}
+
+// Returns a pointer to room for a payload of "size" bytes, or NULL if the ring
+// does not currently have that much contiguous space (try again later) or size
+// is larger than BB_MSG_MAX (never fits).
+static inline void *bb_msg_reserve(struct bb_producer *w, uint32_t size)
+{
+    if (size > BB_MSG_MAX)
+        return NULL;
+    uint32_t span = bb_rec_span(size);
+    uint32_t idx = w->head & BB_BYTES_MASK;
+    uint32_t to_end = BB_BYTES - idx;
+    uint32_t need = (span > to_end) ? to_end + span : span;
+
+    if (BB_BYTES - (w->head - w->tail_cache) < need) {
+        w->tail_cache = atomic_load_explicit(&w->p->out, memory_order_acquire);
+        if (BB_BYTES - (w->head - w->tail_cache) < need)
+            return NULL;
+    }
+    if (span > to_end) {
+        // Not enough room before the end: skip to the start of the buffer.
+        struct bb_record *pad = (struct bb_record *)&w->p->bytes[idx];
+        pad->size = to_end - sizeof(struct bb_record);
+        pad->type = BB_REC_PAD;
+        w->head += to_end;
+        idx = 0;
+    }
+    return &w->p->bytes[idx + sizeof(struct bb_record)];
+}
+
+// Finish the record started by the last bb_msg_reserve(). "size" may be smaller
+// than what was reserved. The record is not visible until bb_publish().
+static inline void bb_msg_commit(struct bb_producer *w, uint32_t type, int32_t eventid, uint32_t size)
+{
+    struct bb_record *rec = (struct bb_record *)&w->p->bytes[w->head & BB_BYTES_MASK];
+    rec->size = size;
+    rec->type = type;
+    rec->eventid = eventid;
+    rec->seq = w->seq++;
+    w->head += bb_rec_span(size);
+}
+
+// Returns the oldest published record, or NULL if there is none. Padding is
+// skipped, up to the end of the buffer; a pad that runs past what has been
+// published is returned, for bb_msg_size() to reject. The payload starts
+// right after the header: (void *)(rec + 1).
+static inline struct bb_record *bb_msg_peek(struct bb_consumer *r)
+{
+    for (;;) {
+        if (r->tail == r->head_cache) {
+            r->head_cache = atomic_load_explicit(&r->p->in, memory_order_acquire);
+            if (r->tail == r->head_cache)
+                return NULL;
+        }
+        uint32_t idx = r->tail & BB_BYTES_MASK;
+        struct bb_record *rec = (struct bb_record *)&r->p->bytes[idx];
+        if (rec->type != BB_REC_PAD || BB_BYTES - idx > r->head_cache - r->tail)
+            return rec;
+        r->tail += BB_BYTES - idx;
+    }
+}
+
+// Check the record returned by bb_msg_peek(), reading its size once into
+// *size; use only that copy. Returns 0, or -1 if the record is malformed: a
+// pad that runs past what has been published, or a payload larger than
+// BB_MSG_MAX or running past what has been published or the end of the buffer.
+static inline int bb_msg_size(const struct bb_consumer *r, const struct bb_record *rec, uint32_t *size)
+{
+    *size = *(const volatile uint32_t *)&rec->size;
+    if (*(const volatile uint32_t *)&rec->type == BB_REC_PAD || *size > BB_MSG_MAX)
+        return -1;
+    uint32_t span = bb_rec_span(*size);
+    if (span > r->head_cache - r->tail || span > BB_BYTES - (r->tail & BB_BYTES_MASK))
+        return -1;
+    return 0;
+}
+
+// Mark the record returned by bb_msg_peek(), of the size bb_msg_size() gave,
+// as consumed. Its space is not returned to the producer until bb_release().
+static inline void bb_msg_advance(struct bb_consumer *r, uint32_t size)
+{
+    r->tail += bb_rec_span(size);
+}
+
+// Skip everything published so far, after a malformed record. A publish
+// always ends on a record boundary, so the next record starts there. Returns
+// the number of bytes skipped. Not returned to the producer until bb_release().
+static inline uint32_t bb_msg_discard(struct bb_consumer *r)
+{
+    uint32_t skipped = r->head_cache - r->tail;
+    r->tail = r->head_cache;
+    return skipped;
+}
+
+#endif // BB_RING_H
@@ -0,0 +1,257 @@
+// bench.h
+// Timing, latency histograms, and result summaries for the IPC benchmarks.
+
+// Timestamps come from one of two clocks, chosen with bench_clock_init():
+//
+//   tsc - the CPU's time-stamp counter (rdtsc), converted to nanoseconds with
+//         a rate measured against CLOCK_MONOTONIC_RAW at startup. Cheapest to
+//         read (~10 ns) and fine-grained, but only meaningful when the TSC is
+//         invariant, which it is on every x86-64 server CPU of the last decade.
+//   raw - clock_gettime(CLOCK_MONOTONIC_RAW). Portable, not slewed by NTP, and
+//         costs a vDSO call (~20-30 ns).
+//
+// Latencies are recorded in an HDR-style histogram: values are bucketed by
+// their power of two, and each power of two is split into HIST_SUB linear
+// sub-buckets, in a fixed 10 KB table. Values below HIST_SUB ns are kept
+// exactly, and every other value up to 2^44 ns (about 4.9 hours) to within
+// 1/HIST_SUB (about 3%). Anything longer lands in the last bucket (max still
+// has its exact value). Percentiles are read off the bucket counts and reported
+// as the upper edge of the bucket they fall in, so below that limit they never
+// understate the latency.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAGNITUDES 40
+#define HIST_BUCKETS (HIST_MAGNITUDES * HIST_SUB)
+
+#define CLOCK_KIND_RAW 0
+#define CLOCK_KIND_TSC 1
+
+struct bench_clock {
+    int kind;
+    double ns_per_tick; // tsc only
+};
+
+struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+};
+
+static inline uint64_t raw_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// Set up the clock named "tsc" or "raw". Falls back to raw if there is no TSC.
+static inline void bench_clock_init(struct bench_clock *c, const char *kind)
+{
+    c->kind = CLOCK_KIND_RAW;
+    c->ns_per_tick = 1.0;
+#ifdef BENCH_HAVE_TSC
+    if (!strcmp(kind, "tsc")) {
+        // Measure the TSC rate over 50 ms of wall time.
+        uint64_t t0 = raw_ns(), c0 = __rdtsc();
+        while (raw_ns() - t0 < 50000000)
+            ;
+        uint64_t t1 = raw_ns(), c1 = __rdtsc();
+        c->kind = CLOCK_KIND_TSC;
+        c->ns_per_tick = (double)(t1 - t0) / (double)(c1 - c0);
+    }
+#endif
+}
+
+// Current time in clock ticks. Only differences are meaningful.
+static inline uint64_t bench_now(struct bench_clock *c)
+{
+#ifdef BENCH_HAVE_TSC
+    if (c->kind == CLOCK_KIND_TSC)
+        return __rdtsc();
+#endif
+    return raw_ns();
+}
+
+static inline uint64_t bench_ticks_to_ns(struct bench_clock *c, uint64_t ticks)
+{
+    if (c->kind == CLOCK_KIND_TSC)
+        return (uint64_t)(ticks * c->ns_per_tick);
+    return ticks;
+}
+
+static inline void hist_reset(struct hist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline int hist_bucket(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return (int)v;
+    int magnitude = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1; // >= 1
+    if (magnitude >= HIST_MAGNITUDES)
+        return HIST_BUCKETS - 1;
+    int sub = (int)(v >> (magnitude - 1)) - HIST_SUB; // top bits below the leading one
+    return magnitude * HIST_SUB + sub;
+}
+
+// Largest value that lands in bucket b.
+static inline uint64_t hist_bucket_high(int b)
+{
+    int magnitude = b / HIST_SUB;
+    int sub = b % HIST_SUB;
+    if (magnitude == 0)
+        return (uint64_t)sub;
+    return (((uint64_t)(HIST_SUB + sub + 1)) << (magnitude - 1)) - 1;
+}
+
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+    h->counts[hist_bucket(v)]++;
+    h->total++;
+    h->sum += (double)v;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+// The value at percentile p (0-100), e.g. 99.9.
+static inline uint64_t hist_percentile(const struct hist *h, double p)
+{
+    if (h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)ceil(p / 100.0 * (double)h->total);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            uint64_t high = hist_bucket_high(b);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Results of one trial.
+struct trial {
+    double seconds;       // wall time for the measured operations
+    double ops_per_sec;
+    double mb_per_sec;
+    uint64_t p50, p99, p999, max; // latency in ns
+    double mean;                  // latency in ns
+};
+
+static inline void trial_from_hist(struct trial *t, const struct hist *h, double seconds, double bytes)
+{
+    t->seconds = seconds;
+    t->ops_per_sec = h->total / seconds;
+    t->mb_per_sec = bytes / 1e6 / seconds;
+    t->p50 = hist_percentile(h, 50);
+    t->p99 = hist_percentile(h, 99);
+    t->p999 = hist_percentile(h, 99.9);
+    t->max = h->max;
+    t->mean = h->total ? h->sum / h->total : 0;
+}
+
+// Mean and sample standard deviation of one field over n trials.
+#define TRIAL_FIELD_STATS(trials, n, field, mean_out, stddev_out) do { \
+    double s_ = 0, ss_ = 0;                                              \
+    for (int i_ = 0; i_ < (n); i_++)                                     \
+        s_ += (double)(trials)[i_].field;                                \
+    (mean_out) = s_ / (n);                                               \
+    for (int i_ = 0; i_ < (n); i_++) {                                   \
+        double d_ = (double)(trials)[i_].field - (mean_out);             \
+        ss_ += d_ * d_;                                                  \
+    }                                                                    \
+    (stddev_out) = (n) > 1 ? sqrt(ss_ / ((n) - 1)) : 0;                  \
+} while (0)
+
+#define BENCH_TEXT 0
+#define BENCH_CSV 1
+#define BENCH_JSON 2
+
+// Print all trials and their mean/stddev summary. "label" identifies the run
+// (e.g. the transport and payload size) in CSV and JSON output.
+static inline void bench_report(FILE *out, int format, const char *label, struct trial *trials, int n)
+{
+    static const char *fields[] = { "ops_per_sec", "mb_per_sec", "mean_ns", "p50_ns", "p99_ns", "p999_ns", "max_ns" };
+    double mean[7], sd[7];
+    TRIAL_FIELD_STATS(trials, n, ops_per_sec, mean[0], sd[0]);
+    TRIAL_FIELD_STATS(trials, n, mb_per_sec, mean[1], sd[1]);
+    TRIAL_FIELD_STATS(trials, n, mean, mean[2], sd[2]);
+    TRIAL_FIELD_STATS(trials, n, p50, mean[3], sd[3]);
+    TRIAL_FIELD_STATS(trials, n, p99, mean[4], sd[4]);
+    TRIAL_FIELD_STATS(trials, n, p999, mean[5], sd[5]);
+    TRIAL_FIELD_STATS(trials, n, max, mean[6], sd[6]);
+
+    if (format == BENCH_CSV) {
+        fprintf(out, "label,trial,seconds");
+        for (int f = 0; f < 7; f++)
+            fprintf(out, ",%s", fields[f]);
+        fprintf(out, "\n");
+        for (int i = 0; i < n; i++)
+            fprintf(out, "%s,%d,%.6f,%.1f,%.3f,%.1f,%llu,%llu,%llu,%llu\n", label, i + 1,
+                    trials[i].seconds, trials[i].ops_per_sec, trials[i].mb_per_sec, trials[i].mean,
+                    (unsigned long long)trials[i].p50, (unsigned long long)trials[i].p99,
+                    (unsigned long long)trials[i].p999, (unsigned long long)trials[i].max);
+        fprintf(out, "%s,mean,", label);
+        for (int f = 0; f < 7; f++)
+            fprintf(out, ",%.3f", mean[f]);
+        fprintf(out, "\n%s,stddev,", label);
+        for (int f = 0; f < 7; f++)
+            fprintf(out, ",%.3f", sd[f]);
+        fprintf(out, "\n");
+    } else if (format == BENCH_JSON) {
+        fprintf(out, "{\"label\": \"%s\", \"trials\": [", label);
+        for (int i = 0; i < n; i++)
+            fprintf(out, "%s\n  {\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"mean_ns\": %.1f, "
+                    "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+                    i ? "," : "", trials[i].seconds, trials[i].ops_per_sec, trials[i].mb_per_sec, trials[i].mean,
+                    (unsigned long long)trials[i].p50, (unsigned long long)trials[i].p99,
+                    (unsigned long long)trials[i].p999, (unsigned long long)trials[i].max);
+        fprintf(out, "],\n \"mean\": {");
+        for (int f = 0; f < 7; f++)
+            fprintf(out, "%s\"%s\": %.3f", f ? ", " : "", fields[f], mean[f]);
+        fprintf(out, "},\n \"stddev\": {");
+        for (int f = 0; f < 7; f++)
+            fprintf(out, "%s\"%s\": %.3f", f ? ", " : "", fields[f], sd[f]);
+        fprintf(out, "}}\n");
+    } else {
+        fprintf(out, "%s\n", label);
+        fprintf(out, "%6s %14s %12s %10s %10s %10s %10s %12s\n",
+                "Trial", "Ops/second", "MB/second", "Mean(ns)", "p50(ns)", "p99(ns)", "p99.9(ns)", "Max(ns)");
+        for (int i = 0; i < n; i++)
+            fprintf(out, "%6d %14.1f %12.3f %10.1f %10llu %10llu %10llu %12llu\n", i + 1,
+                    trials[i].ops_per_sec, trials[i].mb_per_sec, trials[i].mean,
+                    (unsigned long long)trials[i].p50, (unsigned long long)trials[i].p99,
+                    (unsigned long long)trials[i].p999, (unsigned long long)trials[i].max);
+        fprintf(out, "%6s %14.1f %12.3f %10.1f %10.0f %10.0f %10.0f %12.0f\n", "mean",
+                mean[0], mean[1], mean[2], mean[3], mean[4], mean[5], mean[6]);
+        fprintf(out, "%6s %14.1f %12.3f %10.1f %10.0f %10.0f %10.0f %12.0f\n", "stddev",
+                sd[0], sd[1], sd[2], sd[3], sd[4], sd[5], sd[6]);
+    }
+}
+
+#endif // BENCH_H
@@ -0,0 +1,61 @@
+#!/bin/sh
+# bench_bulk.sh
+# Compare report throughput with the payload copied through a SystemV queue,
+# read straight out of the client (client_mpi test-bulk, see mpi_proto.h), and
+# written into a shared-memory ring (client_bb report), at the same sizes.
+#
+# usage: ./bench_bulk.sh [count] [mailbox_num] [region_name]
+#   Runs each transport against a fresh server for each size in SIZES and
+#   prints the end-to-end MB/second from measure.h, and whether the server's
+#   payload sum matched. Set SIZES to change the payload sizes (default
+#   "64 1024 8184 65536"); SystemV can't carry more than 8184 bytes, so it
+#   shows "-" above that. Set BATCH for client_bb's batch size (default 64).
+
+COUNT=${1:-100000}
+KEY=${2:-$((40000 + $$ % 10000))}
+REGION=${3:-/bench-bulk-$$}
+SIZES=${SIZES:-"64 1024 8184 65536"}
+BATCH=${BATCH:-64}
+LOG=$(mktemp)
+
+# Print the MB/second and checksum result of the run logged in $LOG.
+result() {
+    mbs=$(grep "Throughput:" "$LOG" | awk '{print $4}')
+    sums=ok
+    grep -q "MISMATCH" "$LOG" && sums=BAD
+    printf " %14s %4s" "${mbs:--}" "$sums"
+}
+
+run_mpi() {
+    ./server_mpi "$KEY" > /dev/null 2>&1 &
+    server=$!
+    sleep 0.2
+    ./client_mpi "$KEY" "$@" > "$LOG" 2>&1
+    result
+    kill -INT $server
+    wait $server 2> /dev/null
+}
+
+run_bb() {
+    ./server_bb "$REGION" records > /dev/null 2>&1 &
+    server=$!
+    sleep 0.2
+    ./client_bb "$REGION" report "$COUNT" "$1" "$BATCH" > "$LOG" 2>&1
+    result
+    kill -INT $server
+    wait $server 2> /dev/null
+}
+
+printf "%8s %14s %4s %14s %4s %14s %4s\n" "Size" "SysV MB/s" "Sum" "Bulk MB/s" "Sum" "Ring MB/s" "Sum"
+for size in $SIZES; do
+    printf "%8s" "$size"
+    if [ "$size" -le 8184 ]; then
+        run_mpi test "$COUNT" "$size"
+    else
+        printf " %14s %4s" - -
+    fi
+    run_mpi test-bulk "$COUNT" "$size"
+    run_bb "$size"
+    printf "\n"
+done
+rm -f "$LOG"
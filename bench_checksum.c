@@ -0,0 +1,82 @@
+// bench_checksum.c
+// Microbenchmark for the report checksum kernels in checksum.h.
+
+// For each payload size, this sums the same buffer many times with every
+// kernel the CPU supports, checks that all kernels agree with the scalar loop,
+// and prints the time per call and the bandwidth. The buffer is small enough to
+// stay in cache, so this measures the kernel itself rather than memory.
+//
+// usage: ./bench_checksum [bytes_per_size]
+//   bytes_per_size is how many bytes to sum in total for each size (default 1e9).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "checksum.h"
+
+static double now_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 1, 16, 64, 100, 256, 1024, 4096, 8184, 65536, 1 << 20 };
+    static const char *kernels[] = { "scalar", "sse2", "avx2" };
+    double budget = (argc > 1) ? atof(argv[1]) : 1e9;
+
+    size_t max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    char *data = malloc(max);
+    if (data == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    // A mix of positive and negative bytes, so a signedness bug shows up.
+    srand(346);
+    for (size_t i = 0; i < max; i++)
+        data[i] = (char)(rand() & 0xff);
+
+    printf("payload_sum() uses the %s kernel on this machine.\n", payload_sum_name());
+    printf("%10s %8s %12s %12s %10s\n", "Size", "Kernel", "ns/call", "MB/second", "Speedup");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t n = sizes[s];
+        long iterations = (long)(budget / n);
+        if (iterations < 10)
+            iterations = 10;
+        if (iterations > 100000000)
+            iterations = 100000000;
+        int64_t expected = payload_sum_scalar(data, n);
+        double scalar_ns = 0;
+
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            payload_sum_fn fn = payload_sum_kernel(kernels[k]);
+            if (fn == NULL)
+                continue;
+            if (fn(data, n) != expected) {
+                printf("ERROR: %s kernel gives %lld for %zu bytes, scalar gives %lld\n",
+                        kernels[k], (long long)fn(data, n), n, (long long)expected);
+                return 1;
+            }
+            // Offset the start a little each time, so the compiler can't hoist
+            // the call out of the loop and unaligned loads get exercised.
+            volatile int64_t sink = 0;
+            double t0 = now_seconds();
+            for (long i = 0; i < iterations; i++)
+                sink += fn(data + (i & 7) * (n < max - 8), n);
+            double t = now_seconds() - t0;
+            (void)sink;
+
+            double ns = t * 1e9 / iterations;
+            if (k == 0)
+                scalar_ns = ns;
+            printf("%10zu %8s %12.2f %12.1f %9.2fx\n", n, kernels[k], ns,
+                    (n * (double)iterations / 1e6) / t, scalar_ns / ns);
+        }
+    }
+    free(data);
+    return 0;
+}
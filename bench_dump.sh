@@ -0,0 +1,68 @@
+#!/bin/sh
+# bench_dump.sh
+# Measure how much server_mpi's statistics dumps hold up other messages, with
+# its output written synchronously and through io_uring (see async_out.h).
+#
+# usage: ./bench_dump.sh [rows] [mailbox_num]
+#   Registers <rows> event types (default 1024) with a fresh server whose
+#   output goes into a pipe that is read slowly, like a terminal over a slow
+#   link (READ_DELAY seconds per 4 KB, default 0.002). Then, while another
+#   client asks for a dump every DUMP_EVERY seconds (default 0.2), runs
+#   "client_mpi rtt" with one query every INTERVAL_US microseconds (default
+#   200) for DURATION seconds (default 4), timing each from when it was due.
+#   A report sent during a dump waits in the same queue as these queries, so
+#   their latency is what reports see. Runs once with no dumps, once with
+#   IPC_OUTPUT=sync, and once with IPC_OUTPUT=uring, and prints the latency
+#   percentiles in microseconds.
+
+ROWS=${1:-1024}
+KEY=${2:-$((40000 + $$ % 10000))}
+READ_DELAY=${READ_DELAY:-0.002}
+DUMP_EVERY=${DUMP_EVERY:-0.2}
+INTERVAL_US=${INTERVAL_US:-200}
+DURATION=${DURATION:-4}
+COUNT=$((DURATION * 1000000 / INTERVAL_US))
+LOG=$(mktemp)
+FLAG=$(mktemp)
+
+# Read stdin a 4 KB block at a time, pausing after each one.
+slow_reader() {
+    while [ "$(dd bs=4096 count=1 status=none | wc -c)" -gt 0 ]; do
+        sleep "$READ_DELAY"
+    done
+}
+
+# run <label> <none|sync|uring>
+run() {
+    output=$2
+    [ "$output" = none ] && output=uring
+    IPC_OUTPUT=$output IPC_STATS_MS=0 ./server_mpi "$KEY" 2>&1 | slow_reader &
+    sleep 0.3
+    server=$(pgrep -n -f "server_mpi $KEY")
+    i=1
+    while [ $i -le "$ROWS" ]; do
+        ./client_mpi "$KEY" register $i "Event$i" "Description$i" > /dev/null
+        i=$((i + 1))
+    done
+    touch "$FLAG"
+    if [ "$2" != none ]; then
+        (while [ -f "$FLAG" ]; do
+            ./client_mpi "$KEY" print > /dev/null
+            sleep "$DUMP_EVERY"
+        done) &
+        dumper=$!
+    fi
+    MQ_TIMEOUT_MS=10000 ./client_mpi "$KEY" rtt 1 "$COUNT" "$INTERVAL_US" > "$LOG"
+    rm -f "$FLAG"
+    [ "$2" != none ] && wait $dumper
+    kill -INT "$server"
+    wait 2> /dev/null
+    grep "Round trip (us)" "$LOG" |
+        awk -v l="$1" '{printf "%-8s %10s %10s %10s %12s\n", l, $5, $9, $11, $13}'
+}
+
+printf "%-8s %10s %10s %10s %12s\n" "Output" "Mean" "p50" "p99" "Max"
+run none none
+run sync sync
+run uring uring
+rm -f "$LOG" "$FLAG"
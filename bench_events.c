@@ -0,0 +1,143 @@
+// bench_events.c
+// Microbenchmark for the event table's report path and sparse ID index.
+
+// Counts reports the way the servers do, for a stream of randomly chosen event
+// IDs, and prints the time per report for:
+//
+//   flat    the original fixed table: a plain array indexed by ID, no lookup
+//   dense   the event table's fast path for IDs 0 to EVENT_IDS-1
+//   sparse  random 32-bit IDs found through the hash index, for growing
+//           numbers of registered IDs
+//
+// For the sparse case it also registers every ID from scratch and prints the
+// mean time of a single register, which is what the receive loop stalls for,
+// and the worst time of a register that had to grow the index. Growing is
+// incremental (see event_index.h), so that stays small however many IDs there
+// are; a rehash all at once would take milliseconds at a million IDs.
+//
+// usage: ./bench_events [reports]
+//   reports is how many reports to count for each case (default 1e8).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "event_table.h"
+
+#define PICKS (1 << 20) // IDs chosen ahead of time, so rand() is not in the loop
+
+static double now_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// A random ID that is not dense.
+static int64_t random_sparse_id(void)
+{
+    int64_t id;
+    do
+        id = (int32_t)(((uint32_t)rand() << 16) ^ (uint32_t)rand());
+    while (event_id_dense(id));
+    return id;
+}
+
+static void print_row(const char *kind, long ids, double ns, double flat_ns)
+{
+    printf("%8s %10ld %12.2f %9.2fx\n", kind, ids, ns, ns / flat_ns);
+}
+
+int main(int argc, char **argv)
+{
+    static const long sparse_counts[] = { 1000, 64000, 1000000, 4000000 };
+    long reports = (argc > 1) ? atol(argv[1]) : 100000000;
+    int64_t *picks = malloc(PICKS * sizeof(int64_t));
+    static struct event_table t; // big, so not on the stack
+    if (picks == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    srand(346);
+
+    // flat: what server_mpi.c did before event_table.h.
+    static struct { int64_t count, sum; } flat[EVENT_IDS];
+    for (int i = 0; i < PICKS; i++)
+        picks[i] = rand() % EVENT_IDS;
+    double t0 = now_seconds();
+    for (long i = 0; i < reports; i++) {
+        int64_t id = picks[i & (PICKS - 1)];
+        if (id >= 0 && id < EVENT_IDS) {
+            flat[id].count++;
+            flat[id].sum += i;
+        }
+    }
+    double flat_ns = (now_seconds() - t0) * 1e9 / reports;
+    printf("%8s %10s %12s %10s\n", "Path", "IDs", "ns/report", "vs flat");
+    print_row("flat", EVENT_IDS, flat_ns, flat_ns);
+
+    // dense: the same IDs through event_slot().
+    t0 = now_seconds();
+    for (long i = 0; i < reports; i++) {
+        uint32_t slot = event_slot(&t.index, picks[i & (PICKS - 1)]);
+        if (slot != EVENT_SLOT_NONE)
+            event_count(event_counter_at(&t.counters, slot), i);
+    }
+    print_row("dense", EVENT_IDS, (now_seconds() - t0) * 1e9 / reports, flat_ns);
+
+    // sparse: register n random IDs in a fresh index, then report on them.
+    printf("\n%10s %12s %12s %12s %12s\n", "Sparse IDs", "ns/report", "vs flat",
+            "register ns", "worst grow");
+    for (size_t k = 0; k < sizeof(sparse_counts) / sizeof(sparse_counts[0]); k++) {
+        long n = sparse_counts[k];
+        memset(&t.index, 0, sizeof(t.index));
+        int64_t *ids = malloc(n * sizeof(int64_t));
+        if (ids == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        double worst = 0;
+        double r0 = now_seconds();
+        for (long i = 0; i < n; i++) {
+            ids[i] = random_sparse_id();
+            // What server_mpi.c does for a new ID, less the names (which
+            // would take 88 bytes an ID here for nothing).
+            uint32_t cap = t.index.cur.cap;
+            double a = now_seconds();
+            if (event_counters_reserve(&t.counters, event_slot_end(&t.index)) < 0 ||
+                event_slot_add(&t.index, ids[i]) == EVENT_SLOT_NONE) {
+                printf("ERROR: can't register sparse ID %lld\n", (long long)ids[i]);
+                return 1;
+            }
+            double b = now_seconds() - a;
+            if (t.index.cur.cap != cap && b > worst)
+                worst = b;
+        }
+        double register_ns = (now_seconds() - r0) * 1e9 / n;
+        for (int i = 0; i < PICKS; i++)
+            picks[i] = ids[rand() % n];
+
+        int64_t missing = 0;
+        t0 = now_seconds();
+        for (long i = 0; i < reports; i++) {
+            uint32_t slot = event_slot(&t.index, picks[i & (PICKS - 1)]);
+            if (slot != EVENT_SLOT_NONE)
+                event_count(event_counter_at(&t.counters, slot), i);
+            else
+                missing++;
+        }
+        double ns = (now_seconds() - t0) * 1e9 / reports;
+        if (missing) {
+            printf("ERROR: %lld reports found no slot\n", (long long)missing);
+            return 1;
+        }
+        printf("%10ld %12.2f %11.2fx %12.1f %9.1f us\n", n, ns, ns / flat_ns, register_ns, worst * 1e6);
+
+        event_index_free_table(&t.index.cur);
+        event_index_free_table(&t.index.old);
+        free(ids);
+    }
+    free(picks);
+    return 0;
+}
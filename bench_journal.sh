@@ -0,0 +1,83 @@
+#!/bin/sh
+# bench_journal.sh
+# Measure server_mpi's ingest rate with the journal (see journal.h) off and on.
+#
+# usage: ./bench_journal.sh [count] [mailbox_num] [dir]
+#   Runs "client_mpi test <count> <size>" and "client_mpi test-batched <count>
+#   <size> 64" against a fresh server for each size in SIZES (default "0 100
+#   1024"), first without a journal, then journaling into <dir> (default a new
+#   temporary directory) with a 10 ms and then a 1 ms group-commit interval.
+#   Each journaled run starts from an empty journal. Prints the server's
+#   reports/second and how many fdatasync()s the writer made. Gives up, and
+#   exits non-zero, if the server has no results WAIT seconds (default 60)
+#   after the client finishes.
+
+COUNT=${1:-200000}
+KEY=${2:-$((40000 + $$ % 10000))}
+DIR=$3
+SIZES=${SIZES:-"0 100 1024"}
+WAIT=${WAIT:-60}
+LOG=$(mktemp)
+made_dir=
+if [ -z "$DIR" ]; then
+    DIR=$(mktemp -d)
+    made_dir=$DIR
+fi
+server=
+
+# Stop the server and remove what we created, however we exit.
+cleanup() {
+    [ -n "$server" ] && kill -INT $server 2> /dev/null
+    rm -f "$LOG" "$DIR"/bench.journal "$DIR"/bench.snapshot
+    [ -n "$made_dir" ] && rmdir "$made_dir"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# fail <message>: say what went wrong, with the end of the server's log, and stop.
+fail() {
+    echo "$0: $1" >&2
+    tail -5 "$LOG" >&2
+    exit 1
+}
+
+# run <label> <journal_ms or "off"> <client mode args...>
+run() {
+    label=$1
+    ms=$2
+    shift 2
+    rm -f "$DIR"/bench.journal "$DIR"/bench.snapshot
+    if [ "$ms" = off ]; then
+        ./server_mpi "$KEY" > "$LOG" 2>&1 &
+    else
+        IPC_JOURNAL="$DIR/bench" IPC_JOURNAL_MS=$ms ./server_mpi "$KEY" > "$LOG" 2>&1 &
+    fi
+    server=$!
+    sleep 0.2
+    ./client_mpi "$KEY" "$@" > /dev/null || fail "client_mpi $* failed"
+    # The server prints its results when it handles the final print message.
+    tries=$((WAIT * 10))
+    while ! grep -q "MB/second" "$LOG"; do
+        kill -0 $server 2> /dev/null || fail "server_mpi exited without results"
+        [ $tries -gt 0 ] || fail "no results from server_mpi after $WAIT seconds"
+        tries=$((tries - 1))
+        sleep 0.1
+    done
+    kill -INT $server
+    wait $server 2> /dev/null
+    server=
+    msgs=$(grep "messages per second" "$LOG" | awk '{print $3}')
+    commits=$(grep "^Journal:" "$LOG" | awk '{print $2}')
+    printf "%-14s %-8s %6s %18s %10s\n" "$1" "$label" "$3" "$msgs" "${commits:--}"
+}
+
+printf "%-14s %-8s %6s %18s %10s\n" "Mode" "Journal" "Size" "Reports/second" "Commits"
+for size in $SIZES; do
+    for mode in test test-batched; do
+        extra=
+        [ $mode = test-batched ] && extra=64
+        run off off $mode "$COUNT" "$size" $extra
+        run 10ms 10 $mode "$COUNT" "$size" $extra
+        run 1ms 1 $mode "$COUNT" "$size" $extra
+    done
+done
@@ -0,0 +1,64 @@
+#!/bin/sh
+# bench_mq.sh
+# Compare the SystemV and POSIX message queue transports of server_mpi and
+# client_mpi at identical payload sizes.
+#
+# usage: ./bench_mq.sh [count] [mailbox_num] [mq_name]
+#   Runs "client_mpi test <count> <size>" against a fresh server on each
+#   transport, for each size in SIZES, and prints the server's throughput.
+#   Set SIZES to change the payload sizes (default "1 100 1024 4096 8172";
+#   8172 is the largest report that fits in the default 8192-byte POSIX message).
+#   Gives up, and exits non-zero, if the server has no results WAIT seconds
+#   (default 60) after the client finishes.
+
+COUNT=${1:-100000}
+KEY=${2:-$((40000 + $$ % 10000))}
+MQ=${3:-/bench-mq-$$}
+SIZES=${SIZES:-"1 100 1024 4096 8172"}
+WAIT=${WAIT:-60}
+LOG=$(mktemp)
+server=
+
+# Stop the server and remove the log, however we exit.
+cleanup() {
+    [ -n "$server" ] && kill -INT $server 2> /dev/null
+    rm -f "$LOG"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# fail <message>: say what went wrong, with the end of the server's log, and stop.
+fail() {
+    echo "$0: $1" >&2
+    tail -5 "$LOG" >&2
+    exit 1
+}
+
+run() {
+    name=$1
+    size=$2
+    ./server_mpi "$name" > "$LOG" 2>&1 &
+    server=$!
+    sleep 0.2
+    ./client_mpi "$name" test "$COUNT" "$size" > /dev/null || fail "client_mpi $name test $COUNT $size failed"
+    # The server prints its results when it handles the final print message.
+    tries=$((WAIT * 10))
+    while ! grep -q "MB/second" "$LOG"; do
+        kill -0 $server 2> /dev/null || fail "server_mpi exited without results"
+        [ $tries -gt 0 ] || fail "no results from server_mpi after $WAIT seconds"
+        tries=$((tries - 1))
+        sleep 0.1
+    done
+    kill -INT $server
+    wait $server 2> /dev/null
+    server=
+    msgs=$(grep "messages per second" "$LOG" | awk '{print $3}')
+    mbs=$(grep "MB/second" "$LOG" | awk '{print $3}')
+    printf "%-6s %8s %18s %14s\n" "$3" "$size" "$msgs" "$mbs"
+}
+
+printf "%-6s %8s %18s %14s\n" "Queue" "Size" "Messages/second" "MB/second"
+for size in $SIZES; do
+    run "$KEY" "$size" sysv
+    run "$MQ" "$size" posix
+done
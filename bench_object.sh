@@ -0,0 +1,47 @@
+#!/bin/sh
+# bench_object.sh
+# Measure large reports passed as sealed memfds (see object.h), from 64 KB to 1 GB.
+#
+# usage: ./bench_object.sh [socket_path]
+#   Runs "client_sock <socket_path> object <count> <size>" against a fresh
+#   server_sock for each size in SIZES, sending about TOTAL_MB of payload at
+#   each size (but always at least 2 objects), and prints how fast the client
+#   wrote the payloads, how fast the server took them in, and the end-to-end
+#   throughput. Set SIZES to change the sizes (default 64k to 1G, by fours).
+#   A size too big for a SystemV message (8184 bytes) fails with client_mpi;
+#   here only the descriptor travels, so the size is limited only by memory.
+
+SOCK=${1:-/tmp/bench-object-$$.sock}
+SIZES=${SIZES:-"64k 256k 1M 4M 16M 64M 256M 1G"}
+TOTAL_MB=${TOTAL_MB:-2048}
+LOG=$(mktemp)
+
+# Bytes in a size such as 64k, 16M, or 1G.
+bytes() {
+    case $1 in
+        *k) echo $((${1%k} * 1024)) ;;
+        *M) echo $((${1%M} * 1024 * 1024)) ;;
+        *G) echo $((${1%G} * 1024 * 1024 * 1024)) ;;
+        *) echo "$1" ;;
+    esac
+}
+
+./server_sock "$SOCK" > /dev/null 2>&1 &
+server=$!
+sleep 0.2
+
+printf "%6s %8s %16s %16s %16s %8s\n" "Size" "Objects" "Write MB/s" "Handover MB/s" "End-to-end MB/s" "Sum"
+for size in $SIZES; do
+    count=$((TOTAL_MB * 1024 * 1024 / $(bytes "$size")))
+    [ "$count" -lt 2 ] && count=2
+    ./client_sock "$SOCK" object "$count" "$size" > "$LOG"
+    write=$(grep "Writing:" "$LOG" | awk '{print $5}')
+    handover=$(grep "Handing over:" "$LOG" | awk '{print $6}')
+    total=$(grep "Throughput:" "$LOG" | awk '{print $4}')
+    if grep -q MISMATCH "$LOG"; then sum=BAD; else sum=ok; fi
+    printf "%6s %8s %16s %16s %16s %8s\n" "$size" "$count" "$write" "$handover" "$total" "$sum"
+done
+
+kill -INT $server
+wait $server 2> /dev/null
+rm -f "$LOG"
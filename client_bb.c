@@ -16,19 +16,99 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 
-struct shared_stuff 
+#include "bb_ring.h"
+#include "shm_wait.h"
+#include "placement.h"
+#include "region.h"
+
+// Make everything produced so far visible and wake the server if it is asleep.
+void publish(struct bb_producer *w)
+{
+    bb_publish(w);
+    shm_wake(&w->p->in, &w->p->in_waiters);
+}
+
+// Wait until the server has freed at least one slot we have not yet seen freed.
+void wait_for_space(struct bb_producer *w, struct shm_waiter *waiter)
+{
+    publish(w);
+    shm_wait_while_equal(waiter, &w->p->out, w->tail_cache, &w->p->out_waiters);
+}
+
+// Send count ints, publishing once per batch except the last, which is left
+// for the caller to publish along with its completion token (see bb_ring.h).
+// Returns the number of bytes sent.
+long long produce_ints(struct bb_producer *w, struct shm_waiter *waiter, int count, int batch)
 {
-    int in;
-    int out;
-    int buffer [1024*1024];
-    int totalValue;
-};
+    int current = 0;
+    while(current != count)
+    {
+        //fill one batch directly in the ring, possibly as two spans if it
+        //wraps around the end of the buffer, then publish it once
+        uint32_t want = (count - current < batch) ? count - current : batch;
+        uint32_t filled = 0;
+        while(filled < want)
+        {
+            uint32_t got;
+            int *span = bb_reserve(w, want - filled, &got);
+            if(span == NULL)
+            {
+                //buffer is full: publish what we have so the server can drain it
+                wait_for_space(w, waiter);
+                continue;
+            }
+            for(uint32_t i = 0; i < got; i++)
+            {
+                span[i] = 1;
+            }
+            bb_produce(w, got);
+            filled += got;
+        }
+        current += want;
+        if(current != count)
+        {
+            publish(w);
+        }
+    }
+    return (long long)current * sizeof(int);
+}
+
+// Send count report records of size bytes each, publishing once per batch
+// except the last, as for produce_ints. The payload is written straight into
+// the ring, with no staging buffer. Returns the number of payload bytes sent.
+long long produce_records(struct bb_producer *w, struct shm_waiter *waiter, int count, int size, int batch)
+{
+    int current = 0;
+    while(current != count)
+    {
+        void *data = bb_msg_reserve(w, size);
+        if(data == NULL)
+        {
+            //buffer is full: publish what we have so the server can drain it
+            wait_for_space(w, waiter);
+            continue;
+        }
+        memset(data, 1, size);
+        bb_msg_commit(w, 2, 1, size); // 2 means "report", event type 1
+        current++;
+        if(current % batch == 0 && current != count)
+        {
+            publish(w);
+        }
+    }
+    return (long long)current * size;
+}
 
 int main(int argc, char **argv)
 {
     if (argc < 3) 
     {
-        printf("usage: %s <region_name> [count]\n", argv[0]);
+        printf("usage: %s <region_name> [ <count> [batch] | report <count> <size> [batch] ]\n", argv[0]);
+        printf("  Items are published in batches of [batch] (default 1).\n");
+        printf("  report sends <count> records of <size> bytes each, and needs\n");
+        printf("  the server to be started in \"records\" mode.\n");
+        printf("  The run ends when the server acks a completion token sent with\n");
+        printf("  the last batch, and end-to-end times are printed (see measure.h).\n");
         printf("  You can use any name you like for the region, but\n");
         printf("  by convention the name is usually of the form: \"/something\"\n");
         printf("  and it must be unique to you (if another person has already\n");
@@ -36,61 +116,86 @@ int main(int argc, char **argv)
         exit(1);
     }
     char *name = argv[1];
-    int count = atoi(argv[2]);
+    uint32_t mode = BB_MODE_INTS;
+    int size = sizeof(int);
+    int arg = 2;
+    if (!strcmp(argv[2], "report"))
+    {
+        if (argc < 5)
+        {
+            printf("you must provide count and size for report\n");
+            exit(1);
+        }
+        mode = BB_MODE_RECORDS;
+        size = atoi(argv[4]);
+        if (size < 0 || size > BB_MSG_MAX)
+        {
+            printf("size must be between 0 and %d\n", (int)BB_MSG_MAX);
+            exit(1);
+        }
+        arg = 3;
+    }
+    int count = atoi(argv[arg]);
+    int batch_arg = (mode == BB_MODE_RECORDS) ? 5 : 3;
+    int batch = (argc > batch_arg) ? atoi(argv[batch_arg]) : 1;
+    if (count <= 0 || batch <= 0 || batch > BB_CAPACITY)
+    {
+        printf("count must be greater than 0 and batch must be between 1 and %d\n", BB_CAPACITY);
+        exit(1);
+    }
     struct timespec t_end;
     struct timespec t_start;
+    placement_init(argv[0]);
 
-    int fd = shm_open(name, O_RDWR, 0);
-    if (fd < 0) 
+    // Map the region with every page populated, so the timed loop below
+    // takes no page faults.
+    struct region region;
+    if (region_open(&region, name, sizeof(struct shared_stuff)) < 0)
     {
-        perror("shm_open");
         printf("Can't open shared memory region.\n");
         return -1;
     }
-    printf("Opened shared memory region \"%s\".\n", name);
+    printf("Opened shared memory region \"%s\" (%ld KB pages).\n", name, region.pagesize >> 10);
 
-    // Get a pointer to the start of the region.
-    void *ptr = mmap(0, sizeof(struct shared_stuff), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (ptr == MAP_FAILED) 
+    struct shared_stuff *p = (struct shared_stuff *)region.ptr;
+    if (atomic_load_explicit(&p->mode, memory_order_relaxed) != mode)
     {
-        perror("mmap");
-        printf("Can't map shared memory region.\n");
+        printf("The server is not running in %s mode.\n", (mode == BB_MODE_RECORDS) ? "records" : "ints");
         return -1;
     }
+    struct measure_run run = { 0 };
+    run.begin.processed = atomic_load_explicit(&p->totalRecords, memory_order_relaxed);
+    run.begin.sum = atomic_load_explicit(&p->totalValue, memory_order_relaxed);
 
-    struct shared_stuff * volatile p = (struct shared_stuff *)ptr;
-    //getting size of a buffer
-    size_t size = sizeof(p->buffer) / sizeof(int);
-    int current = 0;
-    while(current != count)
+    struct shm_waiter waiter;
+    shm_wait_init(&waiter);
+    struct bb_producer w;
+    bb_producer_attach(&w, p);
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    run.start_ns = measure_now_ns();
+    long long bytes;
+    if (mode == BB_MODE_RECORDS)
+        bytes = produce_records(&w, &waiter, count, size, batch);
+    else
+        bytes = produce_ints(&w, &waiter, count, batch);
+    //hand over the last batch with a completion token, then stop the timer
+    //when the server acks it: that is, once it has drained and added up every
+    //item, not merely when "out" has caught up with "in"
+    uint32_t token = bb_post_token(&w);
+    run.end_sent_ns = measure_now_ns();
+    publish(&w);
+    run.sent_ns = measure_now_ns();
+    uint32_t acked;
+    while((acked = atomic_load_explicit(&p->acked, memory_order_acquire)) != token)
     {
-        //starts the timer if it's the first round
-        if(current == 0)
-        {
-            clock_gettime(CLOCK_MONOTONIC, &t_start);
-        }
-        //stops the timer if it's the last round
-        else if(current == count-1)
-        {
-            //wait for server to finish reading the last received message
-            while(p->in == p->out)
-            {
-                //usleep(15);
-            }
-            //stop the time
-            clock_gettime(CLOCK_MONOTONIC, &t_end);
-        }
-        //Wait until buffer is not full
-        while(p->out == ((p->in+1) % (size-1)))
-        {
-            //usleep(15);
-        }
-        //insert an item
-        p->buffer[p->in] = 1;    
-        current++;
-        //update index of oldest unfilled position in buffer
-        p->in = ((p->in + 1) % (size-1));
+        shm_wait_while_equal(&waiter, &p->acked, acked, &p->acked_waiters);
     }
+    run.end_acked_ns = measure_now_ns();
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    run.end = p->ack;
+    run.items = count;
+    run.bytes = bytes;
 
     int seconds = t_end.tv_sec - t_start.tv_sec;
     int nanoseconds = t_end.tv_nsec - t_start.tv_nsec;
@@ -99,10 +204,11 @@ int main(int argc, char **argv)
     printf("Elapsed time: %0.6f milliseconds\n", t * 1e3);
     printf("Elapsed time: %0.6f microseconds\n", t * 1e6);
     printf("Elapsed time: %0.6f nanoseconds\n", t * 1e9);
-    printf("Total sum is: %i.\n", p->totalValue);
-    printf("Total number of round completed are %i.\n", current);
-    printf("Throughput is %f MB/second\n", ((current*4)/1000000.0)/t);
+    printf("Total sum is: %lld.\n", (long long)(run.end.sum - run.begin.sum));
+    printf("Total number of round completed are %i.\n", count);
+    printf("Batch size is %i.\n", batch);
+    printf("Throughput is %f MB/second\n", (bytes/1000000.0)/t);
+    measure_print(&run, (mode == BB_MODE_RECORDS) ? "records" : "ints");
     
     return 0;
 }
-
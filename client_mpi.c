@@ -23,56 +23,117 @@
 #include <sys/ipc.h>
 #include <sys/msg.h>
 
-// Every SystemV IPC message needs to be a struct that starts with a long
-// integer, followed by whatever other data you want. For the toy event-logging
-// system, we will use one field to tell the server what operation to do, a
-// second field to hold the event type ID, and a third field to hold other
-// information (like the name and description when creating a new event type).
-//
-// NOTE: If you change this struct, you need to change it in server_mpi.c too.
-struct ipcmsg {
-    // The first field must be of type "long", as required by SystemV IPC.
-    long msgtype;    // IPC message type (1 = register, 2 = report, 3 = reset, etc.)
-    int eventid;     // the event type ID
-    char data[0];    // other data (zero or more bytes)
-};
-// NOTE: the data array is declared here as an array of length zero. In the code
-// below, the actual size may be zero (if there is no data for the message) but
-// it will often be somze be some larger size.
-
-// A "message" is everything in the above struct.
-// For a message carrying n bytes of "other data", the total message size is:
-#define MSG_SIZE(n) (sizeof(struct ipcmsg) + (n))
-
-// The "payload" is everything in the above struct except the required first
-// long integer.
-// For a message carrying n bytes of "other data", the "payload sizeC" is:
-#define MSG_PAYLOAD_SIZE(n) (sizeof(struct ipcmsg) - sizeof(long) + (n))
+#include "mpi_proto.h"
+#include "placement.h"
+#include "bench.h"
+#include "measure.h"
+
+
+// Send a request that wants a reply (msgtype 6 to 9, see mpi_proto.h) for
+// eventid, with n bytes of extra data after the reply_to header, and wait for
+// the reply. Returns the round-trip time in nanoseconds, or exits on failure.
+uint64_t request(struct mailbox *mb, long msgtype, int eventid, const char *extra, int n, struct ipcreply *r)
+{
+    static int token = 0;
+    if (token == 0)
+        token = (int)raw_ns() | 1; // differs from any earlier process with our PID
+    struct reply_to to = { getpid(), token++ };
+    struct ipcmsg *m = (struct ipcmsg *)malloc(MSG_SIZE(sizeof(to) + n));
+    m->msgtype = msgtype;
+    m->eventid = eventid;
+    memcpy(m->data, &to, sizeof(to));
+    if (n > 0)
+        memcpy(m->data + sizeof(to), extra, n);
+    uint64_t t0 = raw_ns();
+    if (mailbox_send(mb, m, MSG_PAYLOAD_SIZE(sizeof(to) + n)) < 0) {
+        perror("send");
+        printf("Can't send IPC message.\n");
+        exit(1);
+    }
+    if (mailbox_await_reply(mb, to.token, r) < 0) {
+        printf("Can't get a reply from the server.\n");
+        exit(1);
+    }
+    uint64_t rtt = raw_ns() - t0;
+    free(m);
+    return rtt;
+}
+
+// Send a completion token (msgtype 9, see measure.h) for eventid, and fill in
+// *ack from the reply and the times it was sent and its reply arrived.
+void measure_token(struct mailbox *mb, int eventid, struct measure_ack *ack, int64_t *sent_ns, int64_t *acked_ns)
+{
+    struct ipcreply r;
+    *sent_ns = measure_now_ns();
+    request(mb, 9, eventid, NULL, 0, &r); // 9 means "measure"
+    *acked_ns = measure_now_ns();
+    ack->token = r.token;
+    ack->first_ns = r.first_ns;
+    ack->done_ns = r.done_ns;
+    ack->processed = r.count;
+    ack->sum = r.sum;
+}
+
+// Measure a test run end to end if the mailbox has a reply queue to carry the
+// tokens, else say why not.
+int measure_begin(struct mailbox *mb, int eventid, struct measure_run *run)
+{
+    memset(run, 0, sizeof(*run));
+    if (mb->reply_q < 0) {
+        printf("No end-to-end measurement: it needs a SystemV mailbox with a reply queue.\n");
+        return 0;
+    }
+    measure_token(mb, eventid, &run->begin, &run->begin_sent_ns, &run->begin_acked_ns);
+    return 1;
+}
+
+void print_reply(int eventid, struct ipcreply *r)
+{
+    if (r->name[0] == '\0')
+        printf("Event type %d is not registered; count=%lld sum=%lld\n", eventid,
+                (long long)r->count, (long long)r->sum);
+    else
+        printf("Event type %d: name='%s' description='%s' count=%lld sum=%lld\n", eventid,
+                r->name, r->description, (long long)r->count, (long long)r->sum);
+}
 
 
 int main(int argc, char **argv)
 {
     if (argc < 3) {
-        printf("usage: %s <mailbox_num> [ register <id> <name> <desc> | reset <id> | print | report <id> | test <count> <size> ]\n", argv[0]);
+        printf("usage: %s <mailbox_num> [ register <id> <name> <desc> | reset <id> | print | report <id> | test <count> <size> | test-batched <count> <size> <batch> | test-bulk <count> <size> [window] ]\n", argv[0]);
+        printf("       %s <mailbox_num> [ register-sync <id> <name> <desc> | query <id> | sync <id> | rtt <id> <count> [interval_us] ]\n", argv[0]);
         printf("  You can use any positive number for the mailbox number\n");
         printf("  but it must be unique to you (if another person has already\n");
         printf("  created that mailbox queue, you won't be able to).\n");
+        printf("  A mailbox name of the form \"/something\" uses a POSIX message queue.\n");
+        printf("  The second group wait for the server's reply and print how long it\n");
+        printf("  took; they need a SystemV mailbox. sync replies only once everything\n");
+        printf("  sent before it has been counted. rtt times <count> queries, one after\n");
+        printf("  another, or one every interval_us microseconds, timed from when each\n");
+        printf("  was due (so time spent waiting behind a slow server is counted).\n");
+        printf("  On a SystemV mailbox, test and test-batched also bracket their reports\n");
+        printf("  with completion tokens and print end-to-end times (see measure.h).\n");
+        printf("  test-bulk sends no payloads at all: each message tells the server where\n");
+        printf("  [window] reports lie in our memory (default: 4 MB of them), and it reads\n");
+        printf("  them itself with process_vm_readv. It needs a SystemV mailbox, and\n");
+        printf("  <size> can be up to %d bytes.\n", BULK_CHUNK);
         exit(1);
     }
 
-    key_t key = atoi(argv[1]);
+    placement_init(argv[0]);
+
     //to do that 
     int index = 0;
     int reported = 0;
 
     // Open the mailbox queue, but don't create one if it doesn't exist yet.
-    int q = msgget(key, 0);
-    if (q == -1) {
-        perror("msgget");
+    struct mailbox mb;
+    if (mailbox_open(&mb, argv[1], 0) < 0) {
         printf("Can't open IPC mailbox queue.\n");
         exit(1);
     }
-    printf("Opened IPC mailbox queue number %d.\n", key);
+    printf("Opened IPC mailbox queue %s.\n", argv[1]);
 
     if (!strcmp(argv[2], "register")) {
         if (argc != 6) {
@@ -89,8 +150,8 @@ int main(int argc, char **argv)
         m->msgtype = 1; // 1 means "register"
         m->eventid = eventid;
         sprintf(m->data, "%s %s", name, desc);
-        if (msgsnd(q, m, MSG_PAYLOAD_SIZE(n), 0) < 0) {
-            perror("msgsnd");
+        if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(n)) < 0) {
+            perror("send");
             printf("Can't send IPC message.\n");
             exit(1);
         }
@@ -106,8 +167,8 @@ int main(int argc, char **argv)
         m->msgtype = 2; // 2 means "report"
         m->eventid = eventid;
         // m->data is not used here
-        if (msgsnd(q, m, MSG_PAYLOAD_SIZE(0), 0) < 0) {
-            perror("msgsnd");
+        if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(0)) < 0) {
+            perror("send");
             printf("Can't send IPC message.\n");
             exit(1);
         }
@@ -123,8 +184,8 @@ int main(int argc, char **argv)
         m->msgtype = 3; // 3 means "reset"
         m->eventid = eventid;
         // m->data is not used here
-        if (msgsnd(q, m, MSG_PAYLOAD_SIZE(0), 0) < 0) {
-            perror("msgsnd");
+        if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(0)) < 0) {
+            perror("send");
             printf("Can't send IPC message.\n");
             exit(1);
         }
@@ -133,8 +194,8 @@ int main(int argc, char **argv)
         printf("Sending an IPC message to print statistics for each registered type of event\n");
         struct ipcmsg *m = (struct ipcmsg *)malloc(MSG_SIZE(0));
         m->msgtype = 4; // 4 means "print statistics"
-        if (msgsnd(q, m, MSG_PAYLOAD_SIZE(0), 0) < 0) {
-            perror("msgsnd");
+        if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(0)) < 0) {
+            perror("send");
             printf("Can't send IPC message.\n");
             exit(1);
         }
@@ -161,8 +222,8 @@ int main(int argc, char **argv)
         m->msgtype = 1; // 1 means "register"
         m->eventid = eventid;
         sprintf(m->data, "%s %s", name, desc);
-        if (msgsnd(q, m, MSG_PAYLOAD_SIZE(n), 0) < 0) {
-            perror("msgsnd");
+        if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(n)) < 0) {
+            perror("send");
             printf("Can't send IPC message.\n");
             exit(1);
         }
@@ -174,35 +235,263 @@ int main(int argc, char **argv)
             m->data[index] = 1;
             index++;
         }
+        struct measure_run run;
+        int measuring = measure_begin(&mb, eventid, &run);
+        run.start_ns = measure_now_ns();
         while(reported < count)
         {
             //printf("Sending an IPC message to report occurrence of event type %d\n", eventid);
             // m->data is not used here
-            if (msgsnd(q, m, MSG_PAYLOAD_SIZE(datasize), 0) < 0) {
-                perror("msgsnd");
+            if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(datasize)) < 0) {
+                perror("send");
                 printf("Can't send IPC message.\n");
                 exit(1);
             }
             reported++;
         }
+        run.sent_ns = measure_now_ns();
+        run.items = count;
+        run.bytes = (int64_t)count * datasize;
+        if (measuring) {
+            measure_token(&mb, eventid, &run.end, &run.end_sent_ns, &run.end_acked_ns);
+            measure_print(&run, "reports");
+        }
         
         //sending a print message
         printf("Sending an IPC message to print statistics for each registered type of event\n");
         m->msgtype = 4; // 4 means "print statistics"
-        if (msgsnd(q, m, MSG_PAYLOAD_SIZE(0), 0) < 0) {
-            perror("msgsnd");
+        if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(0)) < 0) {
+            perror("send");
             printf("Can't send IPC message.\n");
             exit(1);
         }
         free(m);
+    } else if(!strcmp(argv[2], "test-batched")) {
+        if (argc != 6) {
+            printf("you must provide number of counts for reporting\n");
+            printf("you must provide size for data to send with each report\n");
+            printf("you must provide number of reports to pack into each message\n");
+            exit(1);
+        }
+        int count = atoi(argv[3]);
+        int datasize = atoi(argv[4]);
+        int batch = atoi(argv[5]);
+        if (count <= 0 || datasize < 0 || batch <= 0) {
+            printf("You must enter count and batch to be greater than 0 and size to be greater than or equal to 0\n");
+            exit(1);
+        }
+        // Fit as many reports in one message as the kernel allows.
+        long limit = mailbox_max_payload(&mb) - MSG_PAYLOAD_SIZE(0);
+        int per_msg = limit / BATCH_RECORD_SIZE(datasize);
+        if (per_msg < 1) {
+            printf("A report of %d bytes does not fit in a %ld-byte message.\n", datasize, mailbox_max_payload(&mb));
+            exit(1);
+        }
+        if (batch > per_msg) {
+            printf("Only %d reports of %d bytes fit in one message; using that as the batch.\n", per_msg, datasize);
+            batch = per_msg;
+        }
+        //registering new event
+        int eventid = 1;
+        char *name = "BatteryError";
+        char *desc = "UnexpectedShutDown";
+        int n = strlen(name) + 1 + strlen(desc) + 1;
+        printf("Sending an IPC message to register new event type %d with name %s and description %s\n",
+                eventid, name, desc);
+        struct ipcmsg *m = (struct ipcmsg *)malloc(MSG_SIZE(limit > n ? limit : n));
+        m->msgtype = 1; // 1 means "register"
+        m->eventid = eventid;
+        sprintf(m->data, "%s %s", name, desc);
+        if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(n)) < 0) {
+            perror("send");
+            printf("Can't send IPC message.\n");
+            exit(1);
+        }
+        //reporting events, batch at a time
+        char *report = (char *)malloc(datasize + 1);
+        memset(report, 1, datasize);
+        struct measure_run run;
+        int measuring = measure_begin(&mb, eventid, &run);
+        run.start_ns = measure_now_ns();
+        while(reported < count)
+        {
+            int used = 0;
+            m->msgtype = 5; // 5 means "report batch"
+            m->eventid = 0; // number of records so far
+            for (int i = 0; i < batch && reported < count; i++) {
+                used = batch_append(m, used, eventid, report, datasize);
+                reported++;
+            }
+            if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(used)) < 0) {
+                perror("send");
+                printf("Can't send IPC message.\n");
+                exit(1);
+            }
+        }
+        run.sent_ns = measure_now_ns();
+        run.items = count;
+        run.bytes = (int64_t)count * datasize;
+        if (measuring) {
+            measure_token(&mb, eventid, &run.end, &run.end_sent_ns, &run.end_acked_ns);
+            measure_print(&run, "reports");
+        }
+        free(report);
+
+        //sending a print message
+        printf("Sending an IPC message to print statistics for each registered type of event\n");
+        m->msgtype = 4; // 4 means "print statistics"
+        m->eventid = eventid;
+        if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(0)) < 0) {
+            perror("send");
+            printf("Can't send IPC message.\n");
+            exit(1);
+        }
+        free(m);
+    } else if(!strcmp(argv[2], "test-bulk")) {
+        if (argc != 5 && argc != 6) {
+            printf("you must provide number of counts for reporting\n");
+            printf("you must provide size for data to send with each report\n");
+            exit(1);
+        }
+        int count = atoi(argv[3]);
+        int datasize = atoi(argv[4]);
+        int window = (argc == 6) ? atoi(argv[5]) : (4 << 20) / (datasize > 0 ? datasize : 1);
+        if (window > count)
+            window = count;
+        if (argc != 6 && window > BULK_MAX_COUNT)
+            window = BULK_MAX_COUNT;
+        if (count <= 0 || datasize < 0 || datasize > BULK_CHUNK || window <= 0 || window > BULK_MAX_COUNT) {
+            printf("count and window must be greater than 0, window at most %d, and size between 0 and %d\n",
+                    BULK_MAX_COUNT, BULK_CHUNK);
+            exit(1);
+        }
+        //registering new event
+        int eventid = 1;
+        char *desc = "BatteryError UnexpectedShutDown";
+        struct ipcmsg *m = (struct ipcmsg *)malloc(MSG_SIZE(strlen(desc) + 1));
+        m->msgtype = 1; // 1 means "register"
+        m->eventid = eventid;
+        strcpy(m->data, desc);
+        if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(strlen(desc) + 1)) < 0) {
+            perror("send");
+            printf("Can't send IPC message.\n");
+            exit(1);
+        }
+        struct measure_run run;
+        if (!measure_begin(&mb, eventid, &run))
+            exit(1);
+        //the reports stay here; the server, and only the server, reads a window of them per message
+        struct ipcreply who;
+        request(&mb, 7, eventid, NULL, 0, &who); // 7 means "query"; any reply carries the server's PID
+        bulk_allow_reader(who.pid);
+        char *reports = (char *)malloc((size_t)window * datasize + 1);
+        memset(reports, 1, (size_t)window * datasize);
+        run.start_ns = measure_now_ns();
+        long calls = 0;
+        while(reported < count)
+        {
+            struct bulk_desc d;
+            d.count = (count - reported < window) ? count - reported : window;
+            d.addr = (uintptr_t)reports;
+            d.size = datasize;
+            bulk_seal(&d);
+            struct ipcreply r;
+            request(&mb, 12, eventid, (const char *)&d, sizeof(d), &r); // 12 means "bulk"
+            if (r.status != 0) {
+                printf("The server could not read the reports (see its output).\n");
+                exit(1);
+            }
+            reported += d.count;
+            calls++;
+        }
+        run.sent_ns = measure_now_ns();
+        run.items = count;
+        run.bytes = (int64_t)count * datasize;
+        measure_token(&mb, eventid, &run.end, &run.end_sent_ns, &run.end_acked_ns);
+        printf("Sent %d reports in %ld bulk messages of up to %d.\n", count, calls, window);
+        measure_print(&run, "reports");
+        if (run.end.sum - run.begin.sum != run.bytes)
+            printf("CHECKSUM MISMATCH: the server added up %lld bytes' worth, expected %lld\n",
+                    (long long)(run.end.sum - run.begin.sum), (long long)run.bytes);
+        free(reports);
+
+        //sending a print message
+        printf("Sending an IPC message to print statistics for each registered type of event\n");
+        m->msgtype = 4; // 4 means "print statistics"
+        if (mailbox_send(&mb, m, MSG_PAYLOAD_SIZE(0)) < 0) {
+            perror("send");
+            printf("Can't send IPC message.\n");
+            exit(1);
+        }
+        free(m);
+    } else if (!strcmp(argv[2], "register-sync")) {
+        if (argc != 6) {
+            printf("you must provide event id, name, and description\n");
+            exit(1);
+        }
+        int eventid = atoi(argv[3]);
+        int n = strlen(argv[4]) + 1 + strlen(argv[5]) + 1;
+        char *data = (char *)malloc(n);
+        sprintf(data, "%s %s", argv[4], argv[5]);
+        struct ipcreply r;
+        uint64_t rtt = request(&mb, 6, eventid, data, n, &r); // 6 means "register-sync"
+        if (r.status == 0)
+            printf("Server registered event type %d (round trip %.1f us)\n", eventid, rtt / 1e3);
+        else
+            printf("Server could not register event type %d (round trip %.1f us)\n", eventid, rtt / 1e3);
+        free(data);
+    } else if (!strcmp(argv[2], "query") || !strcmp(argv[2], "sync")) {
+        if (argc != 4) {
+            printf("you must provide event id\n");
+            exit(1);
+        }
+        int eventid = atoi(argv[3]);
+        struct ipcreply r;
+        uint64_t rtt = request(&mb, argv[2][0] == 'q' ? 7 : 8, eventid, NULL, 0, &r); // 7 means "query", 8 "sync"
+        print_reply(eventid, &r);
+        printf("Round trip %.1f us\n", rtt / 1e3);
+    } else if (!strcmp(argv[2], "rtt")) {
+        if ((argc != 5 && argc != 6) || atoi(argv[4]) <= 0) {
+            printf("you must provide event id and a count greater than 0\n");
+            exit(1);
+        }
+        int eventid = atoi(argv[3]);
+        int count = atoi(argv[4]);
+        uint64_t interval_ns = (argc == 6) ? atoll(argv[5]) * 1000ull : 0;
+        static struct hist h;
+        hist_reset(&h);
+        struct ipcreply r;
+        uint64_t t0 = raw_ns();
+        for (int i = 0; i < count; i++) {
+            if (interval_ns == 0) {
+                hist_record(&h, request(&mb, 7, eventid, NULL, 0, &r)); // 7 means "query"
+                continue;
+            }
+            // Paced: the i-th query is due at t0 + i*interval, and its latency
+            // runs from then, not from whenever the previous reply let us send it.
+            uint64_t due = t0 + i * interval_ns, now = raw_ns();
+            if (now < due) {
+                struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+                nanosleep(&ts, NULL);
+            }
+            request(&mb, 7, eventid, NULL, 0, &r); // 7 means "query"
+            hist_record(&h, raw_ns() - due);
+        }
+        double t = (raw_ns() - t0) / 1e9;
+        print_reply(eventid, &r);
+        printf("Round trips: %d in %.6f seconds, %.1f per second\n", count, t, count / t);
+        printf("Round trip (us): mean %.2f  min %.2f  p50 %.2f  p99 %.2f  max %.2f\n",
+                h.sum / h.total / 1e3, h.min / 1e3, hist_percentile(&h, 50) / 1e3,
+                hist_percentile(&h, 99) / 1e3, h.max / 1e3);
     } else {
         printf("Sorry, I don't know how to do '%s'\n", argv[2]);
         exit(1);
     }
     
     // Sadly, there is no built-in SystemV IPC way for the server to reply. So
-    // we will just assume that the message eventually gets there and the server
-    // successfully performs the requested operation without any errors.
+    // except for the synchronous commands (which use the reply queue described
+    // in mpi_proto.h), we just assume that the message eventually gets there
+    // and the server successfully performs the requested operation.
 
     printf("All done!\n");
     return 0;
@@ -22,44 +22,212 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
-// This struct will contain all the shared data. There is no required format,
-// and we can put anything we like into it. The idea is that a client can put
-// info into the operation, eventid, and data fields. The server will then
-// perform the action and reset the other fields back to zero.
-//
-// Shared memory does not have any built-in synchronization: the server and
-// client are both able to access all the fields, even while the other is busy
-// modifying the fields. The correct way to synchronize involves locks, mutexes,
-// semaphores, etc., to ensure that, for example, the server doesn't start a
-// deposit operation until _after_ the client has finished setting the
-// operation, eventid, and data fields.
-//
-// Since we don't know how to use locks, mutexes, or semaphores, we will use a
-// very simple synchronization protocol, as follows:
-//
-// * The client will not do anything until the operation is zero.
-// * Once the operation is zero, the client will then set the eventid and data,
-//   and finally the operation. The operation is the _last_ thing the client sets.
-//
-// * The server will not do anything until operation is non-zero.
-// * Once the operation is non-zero, the server will perform the operation, and
-//   set the operation back to zero. This indicates that the server is done with
-//   the transaction. 
-//
-// NOTE: If you change this struct, you need to change it in client_shmem.c too.
-struct shared_stuff {
-    int operation;  // requested operation (1 = register, 2 = report, 3 = reset, etc.)
-    int eventid;    // the event type ID
-    char data[100]; // other data (up to 100 bytes)
-};
+#include "shmem_proto.h"
+#include "sock_proto.h"
+#include "placement.h"
+#include "measure.h"
+
+// If the server waits in epoll (server_mux), get the eventfd that wakes it
+// (see shmem_proto.h). Without it, the server still finds our requests, but
+// only when it next wakes up by itself.
+void get_doorbell(struct shared_stuff *p)
+{
+    char path[sizeof(p->doorbell_socket)];
+    memcpy(path, p->doorbell_socket, sizeof(path));
+    path[sizeof(path) - 1] = '\0';
+    if (path[0] == '\0')
+        return;
+    int type;
+    int sock = sock_connect(path, &type);
+    if (sock < 0)
+    {
+        printf("Can't get the server's doorbell from %s.\n", path);
+        return;
+    }
+    struct ipcmsg m = { 10, 0 }; // 10 means "doorbell"
+    struct ipcreply r;
+    int fd = -1;
+    if (send(sock, &m, MSG_SIZE(0), 0) < 0 || sock_recv_fd(sock, &r, sizeof(r), &fd) < 0 || fd < 0)
+        printf("Can't get the server's doorbell from %s.\n", path);
+    else
+        shmem_doorbell_fd = fd;
+    close(sock);
+}
+
+// Register the event type used by the experiments.
+void register_experiment_event(struct shared_stuff *p, struct shmem_lane *lane, struct shm_waiter *waiter)
+{
+    int eventid = 1;
+    char *name = "Installation";
+    char *desc = "InstallationFailed";
+    struct shmem_slot *slot = &lane->slots[0];
+    slot->eventid = eventid;
+    sprintf(slot->data, "%s %s", name, desc);
+    shmem_post(p, lane, slot, 1); // 1 means "register"
+    shmem_wait_until_idle(lane, slot, waiter);
+}
+
+// Send a completion token (operation 4, see measure.h) through the first slot,
+// which must be idle, and fill in *ack from the answer and the times it was
+// posted and its answer seen.
+void measure_token(struct shared_stuff *p, struct shmem_lane *lane, struct shm_waiter *waiter,
+                   struct measure_ack *ack, int64_t *sent_ns, int64_t *acked_ns)
+{
+    static uint64_t token = 0;
+    struct shmem_slot *slot = &lane->slots[0];
+    token++;
+    memcpy(slot->data, &token, sizeof(token));
+    *sent_ns = measure_now_ns();
+    shmem_post(p, lane, slot, 4); // 4 means "measure"
+    shmem_wait_until_idle(lane, slot, waiter);
+    *acked_ns = measure_now_ns();
+    memcpy(ack, slot->data, sizeof(*ack));
+}
+
+// Do count report round-trips, keeping up to depth of them in flight at once
+// (depth 1 is stop-and-wait). Completions are collected in whatever order the
+// server finishes them, and each freed slot is refilled right away. Returns the
+// elapsed time in seconds.
+double report_round_trips(struct shared_stuff *p, struct shmem_lane *lane, struct shm_waiter *waiter,
+                          int count, int depth)
+{
+    struct timespec t_end;
+    struct timespec t_start;
+    int inflight[SHMEM_SLOTS] = { 0 };
+    int issued = 0;
+    int completed = 0;
+    uint32_t seen = atomic_load_explicit(&lane->completions, memory_order_acquire);
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    while (completed < count)
+    {
+        int progress = 0;
+        int submitted = 0;
+        for (int s = 0; s < depth; s++)
+        {
+            struct shmem_slot *slot = &lane->slots[s];
+            if (inflight[s])
+            {
+                if (!shmem_slot_done(slot))
+                    continue;
+                inflight[s] = 0;
+                completed++;
+                progress = 1;
+            }
+            if (issued < count)
+            {
+                slot->eventid = 1;
+                shmem_submit(lane, slot, 2); //report
+                inflight[s] = 1;
+                issued++;
+                submitted = 1;
+            }
+        }
+        if (submitted)
+            shmem_ring(p);
+        else if (!progress)
+            //waiting for server to finish one of them
+            shmem_wait_completions(lane, waiter, &seen);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    int seconds = t_end.tv_sec - t_start.tv_sec;
+    int nanoseconds = t_end.tv_nsec - t_start.tv_nsec;
+    return seconds + nanoseconds / 1e9;
+}
+
+void print_results(double t, int numTrips)
+{
+    // print elapsed time {in various units, just for variety)
+    printf("Elapsed time: %0.6f seconds\n", t);
+    printf("Elapsed time: %0.6f milliseconds\n", t * 1e3);
+    printf("Elapsed time: %0.6f microseconds\n", t * 1e6);
+    printf("Elapsed time: %0.6f nanoseconds\n", t * 1e9);
+    printf("Total number of round trips completed are %i.\n", numTrips);
+    printf("Throughput is %f round-trips/second\n", numTrips/t);
+    printf("Average round trip time is %f seconds.\n", t/numTrips);
+}
+
+// Run the experiment from several processes at once, each on its own lane, and
+// report the aggregate throughput. The children all start together when the
+// parent closes the start pipe.
+void multi_experiment(struct shared_stuff *p, struct shmem_lane *lane, struct shm_waiter *waiter,
+                      int clients, int count, int depth)
+{
+    int start[2];
+    if (pipe(start) < 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+    for (int c = 0; c < clients; c++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0)
+        {
+            close(start[1]);
+            struct shmem_lane *mine = shmem_claim_lane(p);
+            if (mine == NULL)
+            {
+                printf("Client %d: all %d lanes are busy.\n", c, SHMEM_LANES);
+                exit(1);
+            }
+            char go;
+            if (read(start[0], &go, 1) < 0)
+                exit(1);
+            double t = report_round_trips(p, mine, waiter, count, depth);
+            printf("Client %d: %f round-trips/second\n", c, count/t);
+            shmem_release_lane(mine);
+            exit(0);
+        }
+    }
+    close(start[0]);
+    usleep(100000); // give the children time to claim their lanes
+
+    struct measure_run run = { 0 };
+    measure_token(p, lane, waiter, &run.begin, &run.begin_sent_ns, &run.begin_acked_ns);
+    struct timespec t_end;
+    struct timespec t_start;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    run.start_ns = measure_now_ns();
+    close(start[1]);
+    int failed = 0;
+    for (int c = 0; c < clients; c++)
+    {
+        int status;
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    run.sent_ns = measure_now_ns();
+    run.items = (int64_t)(clients - failed) * count;
+    measure_token(p, lane, waiter, &run.end, &run.end_sent_ns, &run.end_acked_ns);
+    int seconds = t_end.tv_sec - t_start.tv_sec;
+    int nanoseconds = t_end.tv_nsec - t_start.tv_nsec;
+    double t = seconds + nanoseconds / 1e9;
+    if (failed)
+        printf("%d of %d clients failed.\n", failed, clients);
+    printf("Aggregate over %d clients:\n", clients - failed);
+    print_results(t, (clients - failed) * count);
+    measure_print(&run, "reports");
+}
 
 int main(int argc, char **argv)
 {
 
     if (argc < 4) 
     {
-        printf("usage: %s <region_name> [ register <id> <name> <desc> | reset <id> | report <id> | experiment <count> ]\n", argv[0]);
+        printf("usage: %s <region_name> [ register <id> <name> <desc> | reset <id> | report <id> | experiment <count> [depth] | multi <clients> <count> [depth] ]\n", argv[0]);
+        printf("  With [depth], up to that many requests (at most %d) are kept in flight.\n", SHMEM_SLOTS);
+        printf("  experiment then measures every power-of-two depth up to [depth].\n");
+        printf("  Without it, and for multi, the run is bracketed with completion tokens\n");
+        printf("  and end-to-end times are printed as well (see measure.h).\n");
         printf("  You can use any name you like for the region, but\n");
         printf("  by convention the name is usually of the form: \"/something\"\n");
         printf("  and it must be unique to you (if another person has already\n");
@@ -68,6 +236,7 @@ int main(int argc, char **argv)
     }
 
     char *name = argv[1];
+    placement_init(argv[0]);
 
     int fd = shm_open(name, O_RDWR, 0);
     if (fd < 0) 
@@ -86,15 +255,23 @@ int main(int argc, char **argv)
         printf("Can't map shared memory region.\n");
         return -1;
     }
-    struct shared_stuff * volatile p = (struct shared_stuff *)ptr;
+    struct shared_stuff *p = (struct shared_stuff *)ptr;
+    struct shm_waiter waiter;
+    shm_wait_init(&waiter);
+    get_doorbell(p);
+
+    // Get a mailbox of our own, so we don't collide with other clients.
+    struct shmem_lane *lane = shmem_claim_lane(p);
+    if (lane == NULL)
+    {
+        printf("All %d lanes of the shared memory region are busy.\n", SHMEM_LANES);
+        return -1;
+    }
 
+    // One-at-a-time operations all go through the first slot.
+    struct shmem_slot *slot = &lane->slots[0];
     printf("Waiting until shared memory is not busy.\n");
-    while (p->operation != 0)
-        usleep(1);
-    
-    struct timespec t_end;
-    struct timespec t_start;
-    int numReports = 0;
+    shmem_wait_until_idle(lane, slot, &waiter);
 
     // Now that memory is not busy, do one operation, depending on command line parameters.
     if (!strcmp(argv[2], "register")) 
@@ -109,10 +286,9 @@ int main(int argc, char **argv)
         char *desc = argv[5];
         printf("Writing an operation in shared memory regiion to register new event type %d with name %s and description %s\n",
                 eventid, name, desc);
-        p->eventid = eventid;
-        sprintf(p->data, "%s %s", name, desc);
-        // note: operation needs to happen _last_
-        p->operation = 1; // 1 means "register
+        slot->eventid = eventid;
+        sprintf(slot->data, "%s %s", name, desc);
+        shmem_post(p, lane, slot, 1); // 1 means "register"
     } 
     else if (!strcmp(argv[2], "report")) 
     {
@@ -123,10 +299,9 @@ int main(int argc, char **argv)
         }
         int eventid = atoi(argv[3]);
         printf("Writing an operation in shared memory to report occurrence of event type %d\n", eventid);
-        p->eventid = eventid;
-        strcpy(p->data, ""); // data is not used here
-        // note: operation needs to happen _last_
-        p->operation = 2; // 1 means "report"
+        slot->eventid = eventid;
+        strcpy(slot->data, ""); // data is not used here
+        shmem_post(p, lane, slot, 2); // 2 means "report"
     } 
     else if (!strcmp(argv[2], "reset")) 
     {
@@ -137,60 +312,77 @@ int main(int argc, char **argv)
         }
         int eventid = atoi(argv[3]);
         printf("Writing an operation in shared memory to reset statistics for event type %d\n", eventid);
-        p->eventid = eventid;
-        strcpy(p->data, ""); // data is not used here
-        // note: operation needs to happen _last_
-        p->operation = 3; // 3 means "reset"
+        slot->eventid = eventid;
+        strcpy(slot->data, ""); // data is not used here
+        shmem_post(p, lane, slot, 3); // 3 means "reset"
     } 
     else if(!strcmp(argv[2], "experiment"))
     {
-        if (argc != 4) 
+        if (argc != 4 && argc != 5) 
         {
             printf("you must provide count");
             exit(1);
         }
-        //register 
-        int eventid = 1;
-        char *name = "Installation";
-        char *desc = "InstallationFailed";
-        p->eventid = eventid;
-        sprintf(p->data, "%s %s", name, desc);
-        // note: operation needs to happen _last_
-        p->operation = 1; // 1 means "register
-
-        //Report and Reset
         int count = atoi(argv[3]);
-        while(numReports != count+1)
+        register_experiment_event(p, lane, &waiter);
+        if (argc == 4)
         {
-            //waiting for server to get finished
-            while (p->operation != 0)
-            {
-                usleep(1);
-            }
-            
-            int eventid = 1;
-            p->eventid = eventid;
-            //Reset
-            //if it's the last transaction
-            if(numReports == count)
+            struct measure_run run = { 0 };
+            measure_token(p, lane, &waiter, &run.begin, &run.begin_sent_ns, &run.begin_acked_ns);
+            run.start_ns = measure_now_ns();
+            double t = report_round_trips(p, lane, &waiter, count, 1);
+            run.sent_ns = measure_now_ns();
+            run.items = count;
+            measure_token(p, lane, &waiter, &run.end, &run.end_sent_ns, &run.end_acked_ns);
+            print_results(t, count);
+            measure_print(&run, "reports");
+        }
+        else
+        {
+            int depth = atoi(argv[4]);
+            if (depth < 1 || depth > SHMEM_SLOTS)
             {
-                //stop the timer
-                clock_gettime(CLOCK_MONOTONIC, &t_end);
-                numReports++;
-                //change operation to reset
-                p->operation = 3;
+                printf("depth must be between 1 and %d\n", SHMEM_SLOTS);
+                exit(1);
             }
-            else
+            // Throughput against pipeline depth: every power of two below
+            // depth, then depth itself.
+            printf("%6s %20s %22s\n", "Depth", "Round-trips/second", "Avg time in flight (s)");
+            for (int d = 1; d <= depth; d = (d * 2 > depth && d < depth) ? depth : d * 2)
             {
-                //if it's the first transaction, turn on the timer
-                if(numReports == 0)
-                {
-                    clock_gettime(CLOCK_MONOTONIC, &t_start);
-                }
-                numReports++;
-                p->operation = 2; //report
+                double t = report_round_trips(p, lane, &waiter, count, d);
+                printf("%6d %20f %22f\n", d, count/t, t*d/count);
             }
         }
+        //Reset
+        slot->eventid = 1;
+        shmem_post(p, lane, slot, 3);
+    }
+    else if(!strcmp(argv[2], "multi"))
+    {
+        if (argc != 5 && argc != 6) 
+        {
+            printf("you must provide number of clients and count");
+            exit(1);
+        }
+        int clients = atoi(argv[3]);
+        int count = atoi(argv[4]);
+        int depth = (argc == 6) ? atoi(argv[5]) : 1;
+        if (depth < 1 || depth > SHMEM_SLOTS)
+        {
+            printf("depth must be between 1 and %d\n", SHMEM_SLOTS);
+            exit(1);
+        }
+        if (clients <= 0 || clients >= SHMEM_LANES)
+        {
+            printf("number of clients must be between 1 and %d\n", SHMEM_LANES - 1);
+            exit(1);
+        }
+        register_experiment_event(p, lane, &waiter);
+        multi_experiment(p, lane, &waiter, clients, count, depth);
+        //Reset
+        slot->eventid = 1;
+        shmem_post(p, lane, slot, 3);
     }
     else 
     {
@@ -198,23 +390,10 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    int seconds = t_end.tv_sec - t_start.tv_sec;
-    int nanoseconds = t_end.tv_nsec - t_start.tv_nsec;
-    double t = seconds + nanoseconds / 1e9;
-
-    // print elapsed time {in various units, just for variety)
-    printf("Elapsed time: %0.6f seconds\n", t);
-    printf("Elapsed time: %0.6f milliseconds\n", t * 1e3);
-    printf("Elapsed time: %0.6f microseconds\n", t * 1e6);
-    printf("Elapsed time: %0.6f nanoseconds\n", t * 1e9);
-    printf("Total number of round trips completed are %i.\n", numReports-1);
-    printf("Throughput is %f round-trips/second\n", (numReports-1)/t);
-    printf("Average round trip time is %f seconds.\n", t/(numReports-1));
     printf("Waiting until server completes the transaction.\n");
-    while (p->operation != 0)
-        usleep(1);
+    shmem_wait_until_idle(lane, slot, &waiter);
+    shmem_release_lane(lane);
 
     printf("All done!\n");
     return 0;
 }
-
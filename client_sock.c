@@ -0,0 +1,350 @@
+// client_sock.c
+// Event-logging client over a UNIX domain socket, sending packets in batches.
+
+// This is client_mpi for server_sock (or server_mux's socket): the same
+// commands, carried as packets on a UNIX socket (see sock_proto.h). It works
+// with either kind of socket, whichever the server created. Replies come back
+// on the socket, so every command that waits for one works, and test measures
+// end to end with completion tokens (see measure.h).
+//
+// test sends its reports [batch] packets (default SOCK_BATCH) per sendmmsg
+// call, so a batch costs one system call however many reports are in it.
+// Every packet in a batch carries the same report, so they all point at the
+// same buffer and nothing is copied to build one.
+//
+// object sends reports too big for a packet, each as a sealed memfd (see
+// object.h), and says how long writing the payloads took apart from how long
+// the server took to add them up and reply.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "mpi_proto.h"
+#include "sock_proto.h"
+#include "placement.h"
+#include "bench.h"
+#include "measure.h"
+#include "object.h"
+
+
+// Send n bytes of message m as one packet, or exit on failure.
+void send_msg(int sock, struct ipcmsg *m, int n)
+{
+    if (send(sock, m, n, 0) < 0) {
+        perror("send");
+        printf("Can't send IPC message.\n");
+        exit(1);
+    }
+}
+
+// Send a request that wants a reply (msgtype 6 to 9, see mpi_proto.h, or 11)
+// for eventid, with n bytes of extra data after the reply_to header and
+// descriptor fd attached (if it isn't -1), and wait for the reply. Returns the
+// round-trip time in nanoseconds, or exits on failure.
+uint64_t request(int sock, long msgtype, int eventid, const char *extra, int n, int fd, struct ipcreply *r)
+{
+    static int token = 0;
+    if (token == 0)
+        token = (int)raw_ns() | 1; // differs from any earlier process with our PID
+    struct reply_to to = { getpid(), token++ };
+    struct ipcmsg *m = (struct ipcmsg *)malloc(MSG_SIZE(sizeof(to) + n));
+    m->msgtype = msgtype;
+    m->eventid = eventid;
+    memcpy(m->data, &to, sizeof(to));
+    if (n > 0)
+        memcpy(m->data + sizeof(to), extra, n);
+    uint64_t t0 = raw_ns();
+    if (sock_send_fd(sock, m, MSG_SIZE(sizeof(to) + n), fd, 0) < 0) {
+        perror("send");
+        printf("Can't send IPC message.\n");
+        exit(1);
+    }
+    // Only replies to our own requests come back on this socket, in order.
+    do {
+        if (recv(sock, r, sizeof(*r), 0) <= 0) {
+            printf("Can't get a reply from the server.\n");
+            exit(1);
+        }
+    } while (r->token != to.token);
+    uint64_t rtt = raw_ns() - t0;
+    free(m);
+    return rtt;
+}
+
+// Send a completion token (msgtype 9, see measure.h) for eventid, and fill in
+// *ack from the reply and the times it was sent and its reply arrived.
+void measure_token(int sock, int eventid, struct measure_ack *ack, int64_t *sent_ns, int64_t *acked_ns)
+{
+    struct ipcreply r;
+    *sent_ns = measure_now_ns();
+    request(sock, 9, eventid, NULL, 0, -1, &r); // 9 means "measure"
+    *acked_ns = measure_now_ns();
+    ack->token = r.token;
+    ack->first_ns = r.first_ns;
+    ack->done_ns = r.done_ns;
+    ack->processed = r.count;
+    ack->sum = r.sum;
+}
+
+void print_reply(int eventid, struct ipcreply *r)
+{
+    if (r->name[0] == '\0')
+        printf("Event type %d is not registered; count=%lld sum=%lld\n", eventid,
+                (long long)r->count, (long long)r->sum);
+    else
+        printf("Event type %d: name='%s' description='%s' count=%lld sum=%lld\n", eventid,
+                r->name, r->description, (long long)r->count, (long long)r->sum);
+}
+
+// Send count copies of the n-byte message m, batch packets per sendmmsg.
+// Returns the number of calls it took, or exits on failure.
+long send_batched(int sock, struct ipcmsg *m, int n, int count, int batch)
+{
+    struct sock_mmsghdr hdrs[SOCK_BATCH];
+    struct iovec iov = { m, n };
+    memset(hdrs, 0, sizeof(hdrs));
+    for (int i = 0; i < batch; i++) {
+        hdrs[i].msg_hdr.msg_iov = &iov;
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+    long calls = 0;
+    int sent = 0;
+    while (sent < count) {
+        int want = (count - sent < batch) ? count - sent : batch;
+        int got = sock_sendmmsg(sock, hdrs, want, 0);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("sendmmsg");
+            printf("Can't send IPC message.\n");
+            exit(1);
+        }
+        sent += got; // fewer than want if the socket filled up part way
+        calls++;
+    }
+    return calls;
+}
+
+// Parse a size such as "65536", "64k", "16M", or "1G". Returns -1 if the
+// string is not a size.
+long long parse_size(const char *s)
+{
+    char *end;
+    long long n = strtoll(s, &end, 10);
+    if (end == s || n < 0)
+        return -1;
+    switch (tolower(*end)) {
+    case 'g': n <<= 10; // fall through
+    case 'm': n <<= 10; // fall through
+    case 'k': n <<= 10; end++; break;
+    }
+    return *end == '\0' ? n : -1;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        printf("usage: %s <socket_path> [ register <id> <name> <desc> | reset <id> | print | report <id> | test <count> <size> [batch] ]\n", argv[0]);
+        printf("       %s <socket_path> [ register-sync <id> <name> <desc> | query <id> | sync <id> | object <count> <size> ]\n", argv[0]);
+        printf("  The socket is the one server_sock (or server_mux) created.\n");
+        printf("  test sends <count> reports of <size> bytes, [batch] (default %d, at\n", SOCK_BATCH);
+        printf("  most %d) per system call, and prints end-to-end times (see measure.h).\n", SOCK_BATCH);
+        printf("  The second group wait for the server's reply and print how long it took.\n");
+        printf("  object sends <count> reports of <size> bytes (k, M, or G allowed) one\n");
+        printf("  at a time, each as a sealed memfd that the server reads in place.\n");
+        printf("  SOCK_BUF_KB sets the socket's send buffer, which is what absorbs a burst.\n");
+        exit(1);
+    }
+
+    placement_init(argv[0]);
+
+    int type;
+    int sock = sock_connect(argv[1], &type);
+    if (sock < 0) {
+        printf("Can't connect to socket %s.\n", argv[1]);
+        exit(1);
+    }
+
+    if (!strcmp(argv[2], "register")) {
+        if (argc != 6) {
+            printf("you must provide event id, name, and description\n");
+            exit(1);
+        }
+        int eventid = atoi(argv[3]);
+        char *name = argv[4];
+        char *desc = argv[5];
+        int n = strlen(name) + 1 + strlen(desc) + 1;
+        printf("Sending an IPC message to register new event type %d with name %s and description %s\n",
+                eventid, name, desc);
+        struct ipcmsg *m = (struct ipcmsg *)malloc(MSG_SIZE(n));
+        m->msgtype = 1; // 1 means "register"
+        m->eventid = eventid;
+        sprintf(m->data, "%s %s", name, desc);
+        send_msg(sock, m, MSG_SIZE(n));
+        free(m);
+    } else if (!strcmp(argv[2], "report") || !strcmp(argv[2], "reset")) {
+        if (argc != 4) {
+            printf("you must provide event id\n");
+            exit(1);
+        }
+        struct ipcmsg m;
+        m.msgtype = (argv[2][2] == 'p') ? 2 : 3; // 2 means "report", 3 "reset"
+        m.eventid = atoi(argv[3]);
+        send_msg(sock, &m, MSG_SIZE(0));
+    } else if (!strcmp(argv[2], "print")) {
+        printf("Sending an IPC message to print statistics for each registered type of event\n");
+        struct ipcmsg m;
+        m.msgtype = 4; // 4 means "print statistics"
+        m.eventid = 0;
+        send_msg(sock, &m, MSG_SIZE(0));
+    } else if (!strcmp(argv[2], "test")) {
+        if (argc != 5 && argc != 6) {
+            printf("you must provide number of counts for reporting\n");
+            printf("you must provide size for data to send with each report\n");
+            exit(1);
+        }
+        int count = atoi(argv[3]);
+        int datasize = atoi(argv[4]);
+        int batch = (argc == 6) ? atoi(argv[5]) : SOCK_BATCH;
+        if (count <= 0 || datasize < 0 || MSG_SIZE(datasize) > SOCK_MSG_MAX || batch <= 0 || batch > SOCK_BATCH) {
+            printf("count must be greater than 0, size between 0 and %d, and batch between 1 and %d\n",
+                    (int)(SOCK_MSG_MAX - MSG_SIZE(0)), SOCK_BATCH);
+            exit(1);
+        }
+        printf("Connected to %s socket %s (send buffer %d KB).\n", sock_type_name(type), argv[1],
+                sock_tune(sock, SO_SNDBUF) >> 10);
+        //registering new event
+        int eventid = 1;
+        char *name = "BatteryError";
+        char *desc = "UnexpectedShutDown";
+        int n = strlen(name) + 1 + strlen(desc) + 1;
+        printf("Sending an IPC message to register new event type %d with name %s and description %s\n",
+                eventid, name, desc);
+        struct ipcmsg *m = (struct ipcmsg *)malloc(MSG_SIZE(n + datasize));
+        m->msgtype = 1; // 1 means "register"
+        m->eventid = eventid;
+        sprintf(m->data, "%s %s", name, desc);
+        send_msg(sock, m, MSG_SIZE(n));
+        //reporting event
+        m->msgtype = 2; // 2 means "report"
+        memset(m->data, 1, datasize);
+        struct measure_run run;
+        memset(&run, 0, sizeof(run));
+        measure_token(sock, eventid, &run.begin, &run.begin_sent_ns, &run.begin_acked_ns);
+        run.start_ns = measure_now_ns();
+        long calls = send_batched(sock, m, MSG_SIZE(datasize), count, batch);
+        run.sent_ns = measure_now_ns();
+        run.items = count;
+        run.bytes = (int64_t)count * datasize;
+        measure_token(sock, eventid, &run.end, &run.end_sent_ns, &run.end_acked_ns);
+        printf("Sent %d reports in %ld calls (%.1f per call).\n", count, calls, (double)count / calls);
+        measure_print(&run, "reports");
+
+        //sending a print message
+        printf("Sending an IPC message to print statistics for each registered type of event\n");
+        m->msgtype = 4; // 4 means "print statistics"
+        send_msg(sock, m, MSG_SIZE(0));
+        free(m);
+    } else if (!strcmp(argv[2], "object")) {
+        if (argc != 5) {
+            printf("you must provide number of objects and size of each\n");
+            exit(1);
+        }
+        int count = atoi(argv[3]);
+        long long size = parse_size(argv[4]);
+        if (count <= 0 || size < 0) {
+            printf("count must be greater than 0 and size a number of bytes, e.g. 64k or 1G\n");
+            exit(1);
+        }
+        //registering new event
+        int eventid = 1;
+        char *desc = "BatteryError UnexpectedShutDown";
+        struct ipcmsg *m = (struct ipcmsg *)malloc(MSG_SIZE(strlen(desc) + 1));
+        m->msgtype = 1; // 1 means "register"
+        m->eventid = eventid;
+        strcpy(m->data, desc);
+        send_msg(sock, m, MSG_SIZE(strlen(desc) + 1));
+        free(m);
+        struct measure_run run;
+        memset(&run, 0, sizeof(run));
+        measure_token(sock, eventid, &run.begin, &run.begin_sent_ns, &run.begin_acked_ns);
+        run.start_ns = measure_now_ns();
+        uint64_t write_ns = 0, handover_ns = 0;
+        for (int i = 0; i < count; i++) {
+            //write the payload into a fresh memfd and seal it
+            uint64_t t0 = raw_ns();
+            char *p;
+            int fd = object_create(size, &p);
+            if (fd < 0) {
+                printf("Can't create an object of %lld bytes.\n", size);
+                exit(1);
+            }
+            memset(p, 1, size);
+            if (object_seal(fd, p, size) < 0)
+                exit(1);
+            write_ns += raw_ns() - t0;
+            //then hand it over, and wait until the server has added it up
+            struct ipcreply r;
+            handover_ns += request(sock, 11, eventid, NULL, 0, fd, &r); // 11 means "object"
+            close(fd);
+            if (r.status != 0) {
+                printf("The server could not read object %d.\n", i);
+                exit(1);
+            }
+        }
+        run.sent_ns = measure_now_ns();
+        run.items = count;
+        run.bytes = (int64_t)count * size;
+        measure_token(sock, eventid, &run.end, &run.end_sent_ns, &run.end_acked_ns);
+        printf("Objects: %d of %lld bytes\n", count, size);
+        printf("  Writing:      %12.3f us each, %f MB/second (memfd_create, fill, seal)\n",
+                write_ns / 1e3 / count, run.bytes / 1e6 / (write_ns / 1e9));
+        printf("  Handing over: %12.3f us each, %f MB/second (send to the server's reply)\n",
+                handover_ns / 1e3 / count, run.bytes / 1e6 / (handover_ns / 1e9));
+        measure_print(&run, "objects");
+        if (run.end.sum - run.begin.sum != run.bytes)
+            printf("CHECKSUM MISMATCH: the server added up %lld bytes' worth, expected %lld\n",
+                    (long long)(run.end.sum - run.begin.sum), (long long)run.bytes);
+    } else if (!strcmp(argv[2], "register-sync")) {
+        if (argc != 6) {
+            printf("you must provide event id, name, and description\n");
+            exit(1);
+        }
+        int eventid = atoi(argv[3]);
+        int n = strlen(argv[4]) + 1 + strlen(argv[5]) + 1;
+        char *data = (char *)malloc(n);
+        sprintf(data, "%s %s", argv[4], argv[5]);
+        struct ipcreply r;
+        uint64_t rtt = request(sock, 6, eventid, data, n, -1, &r); // 6 means "register-sync"
+        if (r.status == 0)
+            printf("Server registered event type %d (round trip %.1f us)\n", eventid, rtt / 1e3);
+        else
+            printf("Server could not register event type %d (round trip %.1f us)\n", eventid, rtt / 1e3);
+        free(data);
+    } else if (!strcmp(argv[2], "query") || !strcmp(argv[2], "sync")) {
+        if (argc != 4) {
+            printf("you must provide event id\n");
+            exit(1);
+        }
+        int eventid = atoi(argv[3]);
+        struct ipcreply r;
+        uint64_t rtt = request(sock, argv[2][0] == 'q' ? 7 : 8, eventid, NULL, 0, -1, &r); // 7 means "query", 8 "sync"
+        print_reply(eventid, &r);
+        printf("Round trip %.1f us\n", rtt / 1e3);
+    } else {
+        printf("Sorry, I don't know how to do '%s'\n", argv[2]);
+        exit(1);
+    }
+
+    close(sock);
+    printf("All done!\n");
+    return 0;
+}
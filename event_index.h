@@ -0,0 +1,171 @@
+// event_index.h
+// A growable hash index from sparse event IDs to entries in the event table.
+
+// Event IDs 0 to EVENT_IDS-1 index the event table directly (see event_table.h).
+// Any other ID, such as a 32-bit hash of an event name or a 64-bit ID from some
+// other system, is looked up here. The index numbers IDs 1, 2, 3, ... in the
+// order they are first inserted, and the event table keeps the counters and
+// names for entry n in its nth sparse slot.
+//
+// The index is an open-addressing table with linear probing, a power-of-two
+// capacity, and a load factor of at most 1/2, so a lookup usually touches a
+// single cache line. Keys and entry numbers are kept in separate arrays, and
+// an entry number of 0 marks an empty bucket.
+//
+// Growing does not stop the world. When an insert would take the load past
+// 1/2, the index allocates a table of twice the capacity and starts using it
+// for new keys, but keeps the old table too. That insert, and every insert
+// after it, moves EVENT_INDEX_MIGRATE buckets' worth of entries from the old
+// table to the new, and lookups check the new table and then the old until the
+// move is done. The old table is at most half full when it is retired, so its
+// buckets are all moved before the new one fills up to 1/2 in turn. A register
+// thus costs a bounded amount of work however big the index is, and the
+// receive loop never waits behind a rehash of millions of IDs.
+//
+// Tables are mapped straight from the kernel rather than calloc()ed. The pages
+// arrive zeroed and are faulted in a few at a time as buckets fill, where
+// malloc would (once a big block has been freed and its mmap threshold has
+// risen) hand back heap memory and clear all of it up front, which for a table
+// of millions of buckets is milliseconds spent inside one register.
+//
+// Entries are never removed: re-registering an ID finds its existing entry.
+// Nothing here locks; a multi-threaded server must keep lookups from running
+// during an insert (server_mpi.c uses a read-write lock).
+
+#ifndef EVENT_INDEX_H
+#define EVENT_INDEX_H
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define EVENT_INDEX_MIN 64     // smallest table capacity
+#define EVENT_INDEX_MIGRATE 16 // old buckets moved per insert while growing
+
+struct event_index_table {
+    uint64_t *keys;    // event IDs (this is the start of the mapping)
+    uint32_t *entries; // entry numbers, 0 for an empty bucket (after the keys)
+    uint32_t cap;      // a power of two, or 0 before the first insert
+    uint32_t used;     // non-empty buckets
+};
+
+struct event_index {
+    struct event_index_table cur; // where inserts go
+    struct event_index_table old; // still being moved into cur (cap 0 if not)
+    uint32_t moved;               // buckets of old already moved
+    uint32_t count;               // entries inserted so far, the last entry number
+};
+
+// Scramble the bits of key (the splitmix64 finalizer), so that IDs that differ
+// only in their high bits, or that are all multiples of some stride, still
+// spread over the whole table.
+static inline uint64_t event_index_hash(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return key;
+}
+
+// The entry number for key in table t, or 0 if it is not there.
+static inline uint32_t event_index_probe(const struct event_index_table *t, uint64_t key)
+{
+    if (t->cap == 0)
+        return 0;
+    uint32_t mask = t->cap - 1;
+    for (uint32_t i = event_index_hash(key) & mask; t->entries[i] != 0; i = (i + 1) & mask)
+        if (t->keys[i] == key)
+            return t->entries[i];
+    return 0;
+}
+
+// Add key to table t, which must have room and must not already hold it.
+static inline void event_index_put(struct event_index_table *t, uint64_t key, uint32_t entry)
+{
+    uint32_t mask = t->cap - 1;
+    uint32_t i = event_index_hash(key) & mask;
+    while (t->entries[i] != 0)
+        i = (i + 1) & mask;
+    t->keys[i] = key;
+    t->entries[i] = entry;
+    t->used++;
+}
+
+// Map an empty table of cap buckets. Returns 0, or -1 if there is no memory.
+static inline int event_index_alloc_table(struct event_index_table *t, uint32_t cap)
+{
+    void *p = mmap(0, (size_t)cap * (sizeof(uint64_t) + sizeof(uint32_t)), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    t->keys = p;
+    t->entries = (uint32_t *)(t->keys + cap);
+    t->cap = cap;
+    t->used = 0;
+    return 0;
+}
+
+static inline void event_index_free_table(struct event_index_table *t)
+{
+    if (t->cap != 0)
+        munmap(t->keys, (size_t)t->cap * (sizeof(uint64_t) + sizeof(uint32_t)));
+    t->keys = NULL;
+    t->entries = NULL;
+    t->cap = 0;
+    t->used = 0;
+}
+
+// Move up to n buckets of the old table into the current one, and retire the
+// old table once every bucket has been moved.
+static inline void event_index_migrate(struct event_index *ix, uint32_t n)
+{
+    struct event_index_table *old = &ix->old;
+    if (old->cap == 0)
+        return;
+    for (; n > 0 && ix->moved < old->cap; n--, ix->moved++) {
+        uint32_t i = ix->moved;
+        if (old->entries[i] != 0 && event_index_probe(&ix->cur, old->keys[i]) == 0)
+            event_index_put(&ix->cur, old->keys[i], old->entries[i]);
+    }
+    if (ix->moved == old->cap)
+        event_index_free_table(old);
+}
+
+// The entry number for key, or 0 if it has not been inserted.
+static inline uint32_t event_index_find(const struct event_index *ix, uint64_t key)
+{
+    uint32_t entry = event_index_probe(&ix->cur, key);
+    if (entry == 0)
+        entry = event_index_probe(&ix->old, key);
+    return entry;
+}
+
+// Insert key, if it is not there already. Returns its entry number, or 0 if a
+// larger table could not be allocated.
+static inline uint32_t event_index_insert(struct event_index *ix, uint64_t key)
+{
+    uint32_t entry = event_index_find(ix, key);
+    if (entry != 0)
+        return entry;
+
+    if (2 * (ix->cur.used + 1) > ix->cur.cap) {
+        uint32_t cap = ix->cur.cap ? 2 * ix->cur.cap : EVENT_INDEX_MIN;
+        struct event_index_table grown;
+        if (cap == 0 || event_index_alloc_table(&grown, cap) < 0)
+            return 0;
+        // The previous move is always finished by now (see above), but make
+        // sure of it rather than lose entries.
+        event_index_migrate(ix, UINT32_MAX);
+        ix->old = ix->cur;
+        ix->cur = grown;
+        ix->moved = 0;
+    }
+
+    entry = ++ix->count;
+    event_index_put(&ix->cur, key, entry);
+    event_index_migrate(ix, EVENT_INDEX_MIGRATE);
+    return entry;
+}
+
+#endif // EVENT_INDEX_H
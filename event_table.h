@@ -0,0 +1,216 @@
+// event_table.h
+// The event statistics table shared by server_mpi.c and server_shmem.c.
+
+// Each event type has an ID number, a short name (up to 15 characters), a
+// longer description (up to 63 characters), and counters for how many reports
+// have arrived and the sum of their payload bytes.
+//
+// Every event type has a slot in the table. IDs 0 to EVENT_IDS-1 are dense:
+// the ID is the slot number, so the common case costs one array index and no
+// lookup. Any other ID is sparse: registering it gives it the next free slot
+// from EVENT_IDS up, found again through a hash index (see event_index.h).
+// Sparse slots live in chunks of EVENT_CHUNK that are allocated as they are
+// needed and never move, so a reader holding a slot's address never sees it
+// go stale, and a table with no sparse IDs costs no more than before.
+//
+// The table is split by how often each part is touched:
+//
+// * counters is what every report updates: arrays of 16-byte
+//   {count, sum} pairs, four IDs to a cache line, so the hot path never pulls
+//   in names or descriptions. Both are 64-bit; an int count of reports wraps
+//   after two billion, and a sum of payload bytes much sooner.
+// * meta is what register and print use: names and descriptions stored
+//   inline at a fixed width, so registering allocates nothing beyond a new
+//   chunk (re-registering an ID simply overwrites it, where the old strdup()s
+//   leaked) and printing walks the slots in order. A slot is registered when
+//   its name is not empty.
+//
+// Counters are written by one thread only, but they are atomics so another
+// thread (a print, or a stats reader) may read them while they change. The
+// writer uses relaxed loads and stores, which compile to ordinary instructions.
+
+#ifndef EVENT_TABLE_H
+#define EVENT_TABLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "event_index.h"
+
+#define EVENT_IDS 1024       // dense IDs, 0 to EVENT_IDS-1
+#define EVENT_CHUNK_BITS 12
+#define EVENT_CHUNK (1 << EVENT_CHUNK_BITS) // sparse slots per chunk
+#define EVENT_CHUNKS 4096    // so up to 16M sparse event types
+#define EVENT_SLOTS (EVENT_IDS + EVENT_CHUNK * EVENT_CHUNKS)
+#define EVENT_SLOT_NONE UINT32_MAX // what a lookup of an unregistered sparse ID gives
+#define EVENT_NAME_LEN 16 // including the NUL
+#define EVENT_DESC_LEN 64 // including the NUL
+
+struct event_counter {
+    _Atomic int64_t count; // reports received
+    _Atomic int64_t sum;   // sum of their payload bytes (see checksum.h)
+};
+
+struct event_meta {
+    int64_t id; // the event ID this slot belongs to
+    char name[EVENT_NAME_LEN];
+    char description[EVENT_DESC_LEN];
+};
+
+struct event_counters {
+    struct event_counter dense[EVENT_IDS];
+    struct event_counter *chunks[EVENT_CHUNKS]; // sparse slots, NULL until needed
+};
+
+struct event_metas {
+    struct event_meta dense[EVENT_IDS];
+    struct event_meta *chunks[EVENT_CHUNKS];
+};
+
+struct event_table {
+    struct event_counters counters; // hot: touched by every report
+    struct event_metas meta;        // cold: touched by register and print
+    struct event_index index;       // sparse IDs to slots
+};
+
+static inline int event_id_dense(int64_t eventid)
+{
+    return eventid >= 0 && eventid < EVENT_IDS;
+}
+
+// The slot for eventid, or EVENT_SLOT_NONE if it is a sparse ID that has not
+// been registered.
+static inline uint32_t event_slot(const struct event_index *ix, int64_t eventid)
+{
+    if (event_id_dense(eventid))
+        return (uint32_t)eventid;
+    uint32_t entry = event_index_find(ix, (uint64_t)eventid);
+    return entry ? EVENT_IDS - 1 + entry : EVENT_SLOT_NONE;
+}
+
+// The slot the next new sparse ID will get, and one past the last slot in use.
+static inline uint32_t event_slot_end(const struct event_index *ix)
+{
+    return EVENT_IDS + ix->count;
+}
+
+static inline struct event_counter *event_counter_at(struct event_counters *c, uint32_t slot)
+{
+    if (slot < EVENT_IDS)
+        return &c->dense[slot];
+    slot -= EVENT_IDS;
+    return &c->chunks[slot >> EVENT_CHUNK_BITS][slot & (EVENT_CHUNK - 1)];
+}
+
+static inline struct event_meta *event_meta_at(struct event_metas *m, uint32_t slot)
+{
+    if (slot < EVENT_IDS)
+        return &m->dense[slot];
+    slot -= EVENT_IDS;
+    return &m->chunks[slot >> EVENT_CHUNK_BITS][slot & (EVENT_CHUNK - 1)];
+}
+
+// Make sure the chunk holding slot is allocated. Returns 0, or -1 if it can't be.
+static inline int event_counters_reserve(struct event_counters *c, uint32_t slot)
+{
+    if (slot < EVENT_IDS)
+        return 0;
+    if (slot >= EVENT_SLOTS)
+        return -1;
+    struct event_counter **chunk = &c->chunks[(slot - EVENT_IDS) >> EVENT_CHUNK_BITS];
+    if (*chunk == NULL)
+        *chunk = calloc(EVENT_CHUNK, sizeof(struct event_counter));
+    return (*chunk == NULL) ? -1 : 0;
+}
+
+static inline int event_metas_reserve(struct event_metas *m, uint32_t slot)
+{
+    if (slot < EVENT_IDS)
+        return 0;
+    if (slot >= EVENT_SLOTS)
+        return -1;
+    struct event_meta **chunk = &m->chunks[(slot - EVENT_IDS) >> EVENT_CHUNK_BITS];
+    if (*chunk == NULL)
+        *chunk = calloc(EVENT_CHUNK, sizeof(struct event_meta));
+    return (*chunk == NULL) ? -1 : 0;
+}
+
+// Give eventid a slot if it does not have one yet. The caller must already
+// have reserved storage for event_slot_end(ix) in every set of counters and
+// metadata it keeps. Returns the slot, or EVENT_SLOT_NONE if the index is full.
+static inline uint32_t event_slot_add(struct event_index *ix, int64_t eventid)
+{
+    if (event_id_dense(eventid))
+        return (uint32_t)eventid;
+    uint32_t entry = event_index_insert(ix, (uint64_t)eventid);
+    return entry ? EVENT_IDS - 1 + entry : EVENT_SLOT_NONE;
+}
+
+// Find or add the slot for eventid in a single-threaded table. Prints an error
+// and returns EVENT_SLOT_NONE if the table is full.
+static inline uint32_t event_table_add(struct event_table *t, int64_t eventid)
+{
+    uint32_t slot = event_slot(&t->index, eventid);
+    if (slot != EVENT_SLOT_NONE)
+        return slot;
+    uint32_t next = event_slot_end(&t->index);
+    if (event_counters_reserve(&t->counters, next) < 0 || event_metas_reserve(&t->meta, next) < 0 ||
+        (slot = event_slot_add(&t->index, eventid)) == EVENT_SLOT_NONE) {
+        printf("ERROR: can't register event ID %lld, the event table is full\n", (long long)eventid);
+        return EVENT_SLOT_NONE;
+    }
+    return slot;
+}
+
+static inline int event_registered(const struct event_meta *meta)
+{
+    return meta->name[0] != '\0';
+}
+
+// Count one report with the given payload sum. Only the counter's owner calls this.
+static inline void event_count(struct event_counter *c, int64_t sum)
+{
+    atomic_store_explicit(&c->count, atomic_load_explicit(&c->count, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&c->sum, atomic_load_explicit(&c->sum, memory_order_relaxed) + sum,
+                          memory_order_relaxed);
+}
+
+static inline int64_t event_load_count(struct event_counter *c)
+{
+    return atomic_load_explicit(&c->count, memory_order_relaxed);
+}
+
+static inline int64_t event_load_sum(struct event_counter *c)
+{
+    return atomic_load_explicit(&c->sum, memory_order_relaxed);
+}
+
+// Set the name and description of an event type from data, which holds a name
+// and a description separated by a space and terminated with a NUL character.
+// Either part is truncated to fit. Returns 0, or prints an error and returns -1.
+static inline int event_register(struct event_meta *meta, int64_t eventid, const char *data)
+{
+    const char *p = strchr(data, ' ');
+    if (p == NULL) {
+        printf("ERROR: can't register event ID %lld, data is missing space separator\n", (long long)eventid);
+        return -1;
+    }
+    size_t n = p - data;
+    if (n == 0) {
+        printf("ERROR: can't register event ID %lld, name is empty\n", (long long)eventid);
+        return -1;
+    }
+    meta->id = eventid;
+    if (n > EVENT_NAME_LEN - 1)
+        n = EVENT_NAME_LEN - 1;
+    memcpy(meta->name, data, n);
+    meta->name[n] = '\0';
+    snprintf(meta->description, EVENT_DESC_LEN, "%s", p + 1);
+    return 0;
+}
+
+#endif // EVENT_TABLE_H
@@ -0,0 +1,404 @@
+// ipc_bench.c
+// One benchmark driver for all three transports: mpi, shmem, and bb.
+
+// Each transport's client prints its own kind of summary (an average round
+// trip, a throughput, ...), which is not enough to size a deployment: what
+// matters there is the tail. This driver runs the same measurement loop against
+// any of the three servers and times every single operation:
+//
+//   mpi   - one operation is sending one report of <size> bytes to a running
+//           server_mpi. The latency is the time the send call takes, which
+//           includes blocking while the queue is full.
+//   shmem - one operation is one report round trip through a running
+//           server_shmem: post it on our lane and wait until it is handled.
+//   bb    - one operation is writing and publishing one record of <size>
+//           bytes (records mode) or <batch> ints (ints mode) into a running
+//           server_bb's ring, including any wait for free space.
+//
+// Every run does the warmup operations first (not measured), then the given
+// number of trials of <iters> operations each. Each trial gets its own latency
+// histogram (see bench.h), and its throughput is measured from the first
+// operation until the server has drained everything sent in that trial. The
+// report lists every trial plus the mean and standard deviation across trials.
+// Only the report goes to stdout; progress messages and errors go to stderr.
+//
+// usage: ./ipc_bench <mpi|shmem|bb> <mailbox_or_region> [options]
+//   -w <n>    warmup operations (default 1000)
+//   -n <n>    operations per trial (default 100000)
+//   -t <n>    trials (default 5)
+//   -s <n>    payload bytes per report (mpi, bb records; default 0 / 64)
+//   -b <n>    ints per operation (bb ints mode; default 1)
+//   -c <clk>  timestamp clock: tsc or raw (default tsc)
+//   -f <fmt>  output: text, csv, or json (default text)
+//   -o <file> write the results to file instead of stdout
+//
+// The servers must already be running, e.g. "./server_mpi 1234",
+// "./server_shmem /region", or "./server_bb /region records".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+#include "shm_wait.h"
+#include "mpi_proto.h"
+#include "placement.h"
+#include "region.h"
+
+// shmem_proto.h and bb_ring.h each describe their region as "struct
+// shared_stuff", since each was written for its own pair of programs. Give
+// them distinct names here so both can be used in one program.
+#define shared_stuff shmem_region
+#include "shmem_proto.h"
+#undef shared_stuff
+#define shared_stuff bb_region
+#include "bb_ring.h"
+#undef shared_stuff
+
+struct options {
+    long warmup;
+    long iters;
+    int trials;
+    int size;
+    int batch;
+    int format;
+    struct bench_clock clock;
+};
+
+// State for one transport. setup() runs once; op() does one operation and
+// returns the payload bytes it moved; drain() waits until the server has
+// handled everything sent so far.
+struct transport {
+    const char *name;
+    void (*setup)(struct transport *t, const char *target, struct options *o);
+    long (*op)(struct transport *t, struct options *o);
+    void (*drain)(struct transport *t);
+    void (*finish)(struct transport *t);
+
+    struct shm_waiter waiter;
+    // mpi
+    struct mailbox mb;
+    struct ipcmsg *m;
+    // shmem
+    struct shmem_region *sp;
+    struct shmem_lane *lane;
+    // bb
+    struct bb_region *bp;
+    struct bb_producer w;
+};
+
+void *map_region(const char *name, size_t size)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror("shm_open");
+        fprintf(stderr, "Can't open shared memory region %s. Is the server running?\n", name);
+        exit(1);
+    }
+    void *ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        fprintf(stderr, "Can't map shared memory region.\n");
+        exit(1);
+    }
+    close(fd);
+    return ptr;
+}
+
+// --- mpi ---
+
+void mpi_setup(struct transport *t, const char *target, struct options *o)
+{
+    if (mailbox_open(&t->mb, target, 0) < 0) {
+        fprintf(stderr, "Can't open IPC mailbox queue.\n");
+        exit(1);
+    }
+    if (MSG_PAYLOAD_SIZE(o->size) > mailbox_max_payload(&t->mb)) {
+        fprintf(stderr, "A report of %d bytes does not fit in a %ld-byte message.\n", o->size, mailbox_max_payload(&t->mb));
+        exit(1);
+    }
+    t->m = (struct ipcmsg *)malloc(MSG_SIZE(o->size + 64));
+    t->m->msgtype = 1; // 1 means "register"
+    t->m->eventid = 1;
+    int n = sprintf(t->m->data, "%s %s", "Benchmark", "IpcBenchReport") + 1;
+    if (mailbox_send(&t->mb, t->m, MSG_PAYLOAD_SIZE(n)) < 0) {
+        perror("send");
+        fprintf(stderr, "Can't send IPC message.\n");
+        exit(1);
+    }
+    t->m->msgtype = 2; // 2 means "report"
+    memset(t->m->data, 1, o->size);
+}
+
+long mpi_op(struct transport *t, struct options *o)
+{
+    if (mailbox_send(&t->mb, t->m, MSG_PAYLOAD_SIZE(o->size)) < 0) {
+        perror("send");
+        fprintf(stderr, "Can't send IPC message.\n");
+        exit(1);
+    }
+    return o->size;
+}
+
+// Messages still waiting in the queue.
+long mpi_pending(struct transport *t)
+{
+    if (t->mb.posix) {
+        struct mq_attr attr;
+        mq_getattr(t->mb.mq, &attr);
+        return attr.mq_curmsgs;
+    }
+    struct msqid_ds ds;
+    msgctl(t->mb.q, IPC_STAT, &ds);
+    return ds.msg_qnum;
+}
+
+void mpi_drain(struct transport *t)
+{
+    // Neither kind of queue can wake us when it empties, so poll. A message
+    // the server has received but not yet applied is not counted; that is one
+    // message per worker thread at most.
+    while (mpi_pending(t) > 0)
+        sched_yield();
+}
+
+void mpi_finish(struct transport *t)
+{
+    t->m->msgtype = 4; // 4 means "print statistics"
+    mailbox_send(&t->mb, t->m, MSG_PAYLOAD_SIZE(0));
+    free(t->m);
+}
+
+// --- shmem ---
+
+void shmem_setup(struct transport *t, const char *target, struct options *o)
+{
+    t->sp = map_region(target, sizeof(struct shmem_region));
+    t->lane = shmem_claim_lane(t->sp);
+    if (t->lane == NULL) {
+        fprintf(stderr, "All %d lanes are busy.\n", SHMEM_LANES);
+        exit(1);
+    }
+    struct shmem_slot *slot = &t->lane->slots[0];
+    slot->eventid = 1;
+    sprintf(slot->data, "%s %s", "Benchmark", "IpcBenchReport");
+    shmem_post(t->sp, t->lane, slot, 1); // 1 means "register"
+    shmem_wait_until_idle(t->lane, slot, &t->waiter);
+}
+
+long shmem_op(struct transport *t, struct options *o)
+{
+    struct shmem_slot *slot = &t->lane->slots[0];
+    slot->eventid = 1;
+    shmem_post(t->sp, t->lane, slot, 2); // 2 means "report"
+    shmem_wait_until_idle(t->lane, slot, &t->waiter);
+    return 0;
+}
+
+void shmem_drain(struct transport *t)
+{
+    // Every operation is already a complete round trip.
+}
+
+void shmem_finish(struct transport *t)
+{
+    shmem_release_lane(t->lane);
+}
+
+// --- bb ---
+
+void bb_setup(struct transport *t, const char *target, struct options *o)
+{
+    struct region region;
+    if (region_open(&region, target, sizeof(struct bb_region)) < 0) {
+        fprintf(stderr, "Can't open shared memory region %s. Is the server running?\n", target);
+        exit(1);
+    }
+    t->bp = region.ptr;
+    bb_producer_attach(&t->w, t->bp);
+    uint32_t mode = atomic_load_explicit(&t->bp->mode, memory_order_acquire);
+    if (mode == BB_MODE_RECORDS && (uint32_t)o->size > BB_MSG_MAX) {
+        fprintf(stderr, "A record of %d bytes does not fit in the ring (at most %zu).\n", o->size, (size_t)BB_MSG_MAX);
+        exit(1);
+    }
+    if (mode == BB_MODE_INTS && (o->batch < 1 || o->batch > BB_CAPACITY)) {
+        fprintf(stderr, "The batch must be between 1 and %d ints.\n", BB_CAPACITY);
+        exit(1);
+    }
+    fprintf(stderr, "Server is in %s mode.\n", mode == BB_MODE_RECORDS ? "records" : "ints");
+}
+
+void bb_wait_for_space(struct transport *t)
+{
+    bb_publish(&t->w);
+    shm_wake(&t->bp->in, &t->bp->in_waiters);
+    shm_wait_while_equal(&t->waiter, &t->bp->out, t->w.tail_cache, &t->bp->out_waiters);
+}
+
+long bb_op(struct transport *t, struct options *o)
+{
+    long bytes;
+    if (atomic_load_explicit(&t->bp->mode, memory_order_relaxed) == BB_MODE_RECORDS) {
+        void *data;
+        while ((data = bb_msg_reserve(&t->w, o->size)) == NULL)
+            bb_wait_for_space(t);
+        memset(data, 1, o->size);
+        bb_msg_commit(&t->w, 2, 1, o->size); // 2 means "report", event type 1
+        bytes = o->size;
+    } else {
+        uint32_t filled = 0;
+        while (filled < (uint32_t)o->batch) {
+            uint32_t got;
+            int *span = bb_reserve(&t->w, o->batch - filled, &got);
+            if (span == NULL) {
+                bb_wait_for_space(t);
+                continue;
+            }
+            for (uint32_t i = 0; i < got; i++)
+                span[i] = 1;
+            bb_produce(&t->w, got);
+            filled += got;
+        }
+        bytes = (long)o->batch * sizeof(int);
+    }
+    bb_publish(&t->w);
+    shm_wake(&t->bp->in, &t->bp->in_waiters);
+    return bytes;
+}
+
+void bb_drain(struct transport *t)
+{
+    uint32_t out;
+    while ((out = atomic_load_explicit(&t->bp->out, memory_order_acquire)) != t->w.head)
+        shm_wait_while_equal(&t->waiter, &t->bp->out, out, &t->bp->out_waiters);
+}
+
+void bb_finish(struct transport *t)
+{
+    fprintf(stderr, "Server has consumed a total of %lld.\n",
+            (long long)atomic_load_explicit(&t->bp->totalValue, memory_order_relaxed));
+}
+
+struct transport transports[] = {
+    { "mpi", mpi_setup, mpi_op, mpi_drain, mpi_finish },
+    { "shmem", shmem_setup, shmem_op, shmem_drain, shmem_finish },
+    { "bb", bb_setup, bb_op, bb_drain, bb_finish },
+};
+
+// Run one trial of o->iters operations, timing each one.
+void run_trial(struct transport *t, struct options *o, struct hist *h, struct trial *result)
+{
+    hist_reset(h);
+    double bytes = 0;
+    uint64_t start = bench_now(&o->clock);
+    uint64_t prev = start;
+    for (long i = 0; i < o->iters; i++) {
+        bytes += t->op(t, o);
+        uint64_t now = bench_now(&o->clock);
+        hist_record(h, bench_ticks_to_ns(&o->clock, now - prev));
+        prev = now;
+    }
+    t->drain(t);
+    uint64_t end = bench_now(&o->clock);
+    trial_from_hist(result, h, bench_ticks_to_ns(&o->clock, end - start) / 1e9, bytes);
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s <mpi|shmem|bb> <mailbox_or_region> [-w warmup] [-n iters] [-t trials]\n", prog);
+    fprintf(stderr, "          [-s size] [-b batch] [-c tsc|raw] [-f text|csv|json] [-o file]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct options o = { 1000, 100000, 5, -1, 1, BENCH_TEXT };
+    const char *clock = "tsc";
+    FILE *out = stdout;
+    int c;
+    while ((c = getopt(argc, argv, "w:n:t:s:b:c:f:o:")) != -1) {
+        switch (c) {
+        case 'w': o.warmup = atol(optarg); break;
+        case 'n': o.iters = atol(optarg); break;
+        case 't': o.trials = atoi(optarg); break;
+        case 's': o.size = atoi(optarg); break;
+        case 'b': o.batch = atoi(optarg); break;
+        case 'c': clock = optarg; break;
+        case 'f':
+            if (!strcmp(optarg, "csv"))
+                o.format = BENCH_CSV;
+            else if (!strcmp(optarg, "json"))
+                o.format = BENCH_JSON;
+            else if (!strcmp(optarg, "text"))
+                o.format = BENCH_TEXT;
+            else
+                usage(argv[0]);
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (out == NULL) {
+                perror(optarg);
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || o.warmup < 0 || o.iters < 1 || o.trials < 1)
+        usage(argv[0]);
+
+    struct transport *t = NULL;
+    for (size_t i = 0; i < sizeof(transports) / sizeof(transports[0]); i++)
+        if (!strcmp(argv[optind], transports[i].name))
+            t = &transports[i];
+    if (t == NULL)
+        usage(argv[0]);
+    if (o.size < 0)
+        o.size = (t->setup == bb_setup) ? 64 : 0;
+
+    // Only results go to stdout, so CSV and JSON can be piped straight into
+    // another program. Everything else goes to stderr, including what the
+    // shared headers print with printf: results keep a copy of stdout, and
+    // stdout itself is pointed at stderr.
+    if (out == stdout) {
+        out = fdopen(dup(STDOUT_FILENO), "w");
+        if (out == NULL) {
+            perror("fdopen");
+            exit(1);
+        }
+    }
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    setvbuf(stdout, NULL, _IONBF, 0); // and unbuffered, like stderr, so the two stay in order
+
+    placement_init(argv[0]);
+    bench_clock_init(&o.clock, clock);
+    shm_wait_init(&t->waiter);
+    t->setup(t, argv[optind + 1], &o);
+    fprintf(stderr, "Timing with the %s clock, %s wait strategy.\n",
+            o.clock.kind == CLOCK_KIND_TSC ? "tsc" : "raw", shm_wait_name(t->waiter.mode));
+
+    for (long i = 0; i < o.warmup; i++)
+        t->op(t, &o);
+    t->drain(t);
+
+    struct hist *h = malloc(sizeof(struct hist));
+    struct trial *trials = calloc(o.trials, sizeof(struct trial));
+    for (int i = 0; i < o.trials; i++)
+        run_trial(t, &o, h, &trials[i]);
+    t->finish(t);
+
+    char label[64];
+    snprintf(label, sizeof(label), "%s size=%d batch=%d", t->name, o.size, o.batch);
+    bench_report(out, o.format, label, trials, o.trials);
+    fclose(out);
+    free(trials);
+    free(h);
+    return 0;
+}
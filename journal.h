@@ -0,0 +1,610 @@
+// journal.h
+// An append-only journal of register/report/reset operations, with periodic
+// snapshots, so a server's statistics survive a restart.
+
+// Setting IPC_JOURNAL=<prefix> in a server's environment makes it keep two
+// files: <prefix>.journal, a log of every operation that changes the table,
+// and <prefix>.snapshot, a compact copy of the whole table as of some point in
+// that log. At startup the server loads the snapshot, replays the journal
+// records written after it, and carries on from there.
+//
+// The receive loop never touches the disk. It appends each record to an
+// in-memory buffer (journal_append copies 16 or 96 bytes under a mutex) and
+// goes on. A background thread does group commit: when the buffer holds
+// IPC_JOURNAL_KB kilobytes (default 1024), or IPC_JOURNAL_MS milliseconds have
+// passed (default 10), it swaps in the other buffer and writes the full one
+// out with a single write() and fdatasync(), which go to the kernel together as
+// a linked pair of io_uring requests (see uring.h) when it can, so a commit
+// costs one system call. So a record is on disk at most
+// about IPC_JOURNAL_MS after it is appended, and one fdatasync covers
+// thousands of reports. Only if the disk falls so far behind that the spare
+// buffer fills up too does the receive loop wait.
+//
+// The background thread also applies every record it writes to a private
+// copy of the table (the "shadow"). Once IPC_JOURNAL_SNAPSHOT_MB megabytes
+// (default 64) have been journaled since the last snapshot, it writes the
+// shadow out as a new snapshot and starts a new, empty journal. The snapshot
+// therefore matches an exact point in the log without ever stopping the
+// server to take it. Each file is written to a temporary name, synced, and
+// renamed into place. A journal's header carries a generation number, and a
+// snapshot records the generation of the journal that follows it. So a crash
+// between the two renames is harmless: replay skips a journal whose records
+// are already in the snapshot.
+//
+// A crash can leave a partly written record at the end of the journal.
+// Replay stops at the first record that is incomplete or has an unknown
+// operation, and cuts the file back to the last good record.
+//
+// Counts and sums in the journal are the raw totals since the last reset.
+// server_mpi's per-measurement sum (reset by each print) is not journaled.
+//
+// NOTE: both servers must be rebuilt if this file changes, and old journals
+// can't be read after the record layout (JOURNAL_LAYOUT) changes.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "event_table.h"
+#include "uring.h"
+
+#define JOURNAL_MAGIC 0x4c4e524au  // "JRNL"
+#define SNAPSHOT_MAGIC 0x50414e53u // "SNAP"
+#define JOURNAL_LAYOUT 1
+#define JOURNAL_MAX_APPEND 65536 // most bytes one journal_append may add
+
+#define JOURNAL_REGISTER 1
+#define JOURNAL_REPORT 2
+#define JOURNAL_RESET 3
+
+struct journal_record {
+    uint32_t op;     // JOURNAL_REGISTER, JOURNAL_REPORT, or JOURNAL_RESET
+    int32_t eventid;
+    int64_t sum;     // JOURNAL_REPORT: the report's payload sum
+};
+
+// A JOURNAL_REGISTER record is followed by the name and description.
+struct journal_register {
+    struct journal_record r;
+    char name[EVENT_NAME_LEN];
+    char description[EVENT_DESC_LEN];
+};
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t layout;
+    uint64_t generation;
+};
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t layout;
+    uint64_t next_generation; // the journal that continues from this snapshot
+    uint64_t nrows;
+};
+
+struct snapshot_row {
+    int64_t id;
+    int64_t count;
+    int64_t sum;
+    char name[EVENT_NAME_LEN];       // empty if never registered
+    char description[EVENT_DESC_LEN];
+};
+
+struct journal {
+    char journal_path[512];
+    char snapshot_path[512];
+    int fd;                     // the current journal, open for appending
+    uint64_t generation;        // its generation
+
+    pthread_mutex_t lock;       // guards the fields down to "stopping"
+    pthread_cond_t wake;        // the writer waits here for records
+    pthread_cond_t space;       // appenders wait here for buffer space
+    char *active;               // buffer being appended to
+    size_t used;                // bytes in it
+    char *spare;                // buffer being written out (writer only)
+    size_t capacity;            // size of each buffer
+    _Atomic int stopping;
+
+    size_t commit_bytes;        // commit once this much is buffered ...
+    long commit_ms;             // ... or this long has passed
+    uint64_t snapshot_bytes;    // snapshot after this much journal
+    uint64_t since_snapshot;    // bytes journaled since the last snapshot
+    pthread_t thread;
+    _Atomic int finished;       // set by the writer when it exits
+    struct uring ring;          // the writer's, for commits (fd -1 if not in use)
+
+    struct event_table shadow;  // the table as of the end of the journal
+
+    // Statistics, kept by the writer.
+    uint64_t commits, bytes, snapshots;
+    double commit_seconds, commit_max;
+};
+
+static inline double journal_seconds(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static inline long journal_env(const char *name, long fallback)
+{
+    const char *value = getenv(name);
+    return value ? atol(value) : fallback;
+}
+
+// Apply one record to table t. Returns the record's size, or 0 if the n bytes
+// at p do not hold a complete, valid record.
+static inline size_t journal_apply(struct event_table *t, const char *p, size_t n)
+{
+    struct journal_record r;
+    if (n < sizeof(r))
+        return 0;
+    memcpy(&r, p, sizeof(r));
+    if (r.op == JOURNAL_REGISTER) {
+        struct journal_register reg;
+        if (n < sizeof(reg))
+            return 0;
+        memcpy(&reg, p, sizeof(reg));
+        uint32_t slot = event_table_add(t, r.eventid);
+        if (slot != EVENT_SLOT_NONE) {
+            struct event_meta *meta = event_meta_at(&t->meta, slot);
+            meta->id = r.eventid;
+            memcpy(meta->name, reg.name, EVENT_NAME_LEN);
+            memcpy(meta->description, reg.description, EVENT_DESC_LEN);
+            meta->name[EVENT_NAME_LEN - 1] = '\0';
+            meta->description[EVENT_DESC_LEN - 1] = '\0';
+        }
+        return sizeof(reg);
+    }
+    if (r.op == JOURNAL_REPORT || r.op == JOURNAL_RESET) {
+        uint32_t slot = event_slot(&t->index, r.eventid);
+        if (slot != EVENT_SLOT_NONE) {
+            struct event_counter *c = event_counter_at(&t->counters, slot);
+            if (r.op == JOURNAL_REPORT)
+                event_count(c, r.sum);
+            else
+                atomic_store_explicit(&c->count, 0, memory_order_relaxed);
+        }
+        return sizeof(r);
+    }
+    return 0;
+}
+
+// Write all n bytes at p to fd. Returns 0, or -1 with errno set.
+static inline int journal_write_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += w;
+        n -= w;
+    }
+    return 0;
+}
+
+// Write n bytes at p to the end of the journal and fdatasync it. With a ring,
+// the write and the fdatasync are submitted together, linked so the sync only
+// runs once the write has succeeded. Returns 0, or -1 with errno set.
+static inline int journal_commit(struct journal *j, const char *p, size_t n)
+{
+    if (j->ring.fd >= 0) {
+        struct io_uring_sqe *w = uring_prep_write(&j->ring, j->fd, p, n, 0);
+        struct io_uring_sqe *s = uring_get_sqe(&j->ring);
+        if (w != NULL && s != NULL) {
+            w->flags |= IOSQE_IO_LINK;
+            s->opcode = IORING_OP_FSYNC;
+            s->fd = j->fd;
+            s->fsync_flags = IORING_FSYNC_DATASYNC;
+            s->user_data = 1;
+            if (uring_submit(&j->ring, 2) == 0) {
+                struct io_uring_cqe cqe;
+                int written = -EIO, synced = -EIO;
+                while (uring_peek(&j->ring, &cqe))
+                    *(cqe.user_data == 0 ? &written : &synced) = cqe.res;
+                if (written >= 0 && synced >= 0 && (size_t)written == n)
+                    return 0;
+                if (written == -EINVAL || written == -EOPNOTSUPP) {
+                    uring_close(&j->ring); // an old kernel; do it the slow way from now on
+                } else if (written >= 0) {
+                    p += written; // short write: the link broke, so finish below
+                    n -= written;
+                } else {
+                    errno = -written;
+                    return -1;
+                }
+            }
+        }
+    }
+    if (journal_write_all(j->fd, p, n) < 0 || fdatasync(j->fd) < 0)
+        return -1;
+    return 0;
+}
+
+// Make a rename in the directory holding path durable.
+static inline void journal_sync_dir(const char *path)
+{
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+        snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Write data (n bytes) to path via a synced temporary file and a rename.
+// Returns an fd for path, positioned at the end, or -1 with errno set.
+static inline int journal_replace_file(const char *path, const void *data, size_t n)
+{
+    char tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0)
+        return -1;
+    if (journal_write_all(fd, data, n) < 0 || fsync(fd) < 0 || rename(tmp, path) < 0) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    journal_sync_dir(path);
+    return fd;
+}
+
+// Start a new journal with the given generation, replacing the current one.
+static inline int journal_start(struct journal *j, uint64_t generation)
+{
+    struct journal_header h = { JOURNAL_MAGIC, JOURNAL_LAYOUT, generation };
+    int fd = journal_replace_file(j->journal_path, &h, sizeof(h));
+    if (fd < 0)
+        return -1;
+    if (j->fd >= 0)
+        close(j->fd);
+    j->fd = fd;
+    j->generation = generation;
+    return 0;
+}
+
+// Write the shadow table out as a snapshot, then start the next journal.
+// Called only by the writer (or before it starts).
+static inline int journal_snapshot(struct journal *j)
+{
+    uint32_t end = event_slot_end(&j->shadow.index);
+    size_t size = sizeof(struct snapshot_header) + (size_t)end * sizeof(struct snapshot_row);
+    char *buf = malloc(size);
+    if (buf == NULL)
+        return -1;
+    struct snapshot_header *h = (struct snapshot_header *)buf;
+    struct snapshot_row *rows = (struct snapshot_row *)(h + 1);
+    uint64_t n = 0;
+    for (uint32_t slot = 0; slot < end; slot++) {
+        struct event_meta *meta = event_meta_at(&j->shadow.meta, slot);
+        struct event_counter *c = event_counter_at(&j->shadow.counters, slot);
+        int64_t count = event_load_count(c), sum = event_load_sum(c);
+        if (!event_registered(meta) && count == 0 && sum == 0)
+            continue;
+        struct snapshot_row *row = &rows[n++];
+        memset(row, 0, sizeof(*row));
+        row->id = event_registered(meta) ? meta->id : slot;
+        row->count = count;
+        row->sum = sum;
+        memcpy(row->name, meta->name, EVENT_NAME_LEN);
+        memcpy(row->description, meta->description, EVENT_DESC_LEN);
+    }
+    h->magic = SNAPSHOT_MAGIC;
+    h->layout = JOURNAL_LAYOUT;
+    h->next_generation = j->generation + 1;
+    h->nrows = n;
+    int fd = journal_replace_file(j->snapshot_path, buf,
+                                  sizeof(struct snapshot_header) + n * sizeof(struct snapshot_row));
+    free(buf);
+    if (fd < 0)
+        return -1;
+    close(fd);
+    j->snapshots++;
+    j->since_snapshot = 0;
+    return journal_start(j, j->generation + 1);
+}
+
+// Read the whole file at path into a malloc()ed buffer. Returns NULL (with
+// errno set) if it can't be read, and the size in *n otherwise.
+static inline char *journal_read_file(const char *path, size_t *n)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)) != NULL) {
+        size_t got = 0;
+        while (got < (size_t)st.st_size) {
+            ssize_t r = read(fd, buf + got, st.st_size - got);
+            if (r <= 0)
+                break;
+            got += r;
+        }
+        *n = got;
+    }
+    close(fd);
+    return buf;
+}
+
+// Load <prefix>.snapshot and replay <prefix>.journal into the shadow table.
+// Prints what was recovered. Returns 0, or prints an error and returns -1.
+static inline int journal_recover(struct journal *j)
+{
+    double t0 = journal_seconds();
+    uint64_t next_generation = 1;
+    uint64_t nrows = 0, nrecords = 0;
+    size_t n;
+
+    char *snap = journal_read_file(j->snapshot_path, &n);
+    if (snap != NULL) {
+        struct snapshot_header *h = (struct snapshot_header *)snap;
+        // Divide rather than multiply, so a corrupt nrows can't overflow the check.
+        if (n < sizeof(*h) || h->magic != SNAPSHOT_MAGIC || h->layout != JOURNAL_LAYOUT ||
+            h->nrows > (n - sizeof(*h)) / sizeof(struct snapshot_row)) {
+            printf("%s is not a snapshot this server can read.\n", j->snapshot_path);
+            free(snap);
+            return -1;
+        }
+        struct snapshot_row *rows = (struct snapshot_row *)(h + 1);
+        for (nrows = 0; nrows < h->nrows; nrows++) {
+            struct snapshot_row *row = &rows[nrows];
+            uint32_t slot = event_table_add(&j->shadow, row->id);
+            if (slot == EVENT_SLOT_NONE)
+                continue;
+            struct event_meta *meta = event_meta_at(&j->shadow.meta, slot);
+            meta->id = row->id;
+            memcpy(meta->name, row->name, EVENT_NAME_LEN);
+            memcpy(meta->description, row->description, EVENT_DESC_LEN);
+            meta->name[EVENT_NAME_LEN - 1] = '\0';
+            meta->description[EVENT_DESC_LEN - 1] = '\0';
+            struct event_counter *c = event_counter_at(&j->shadow.counters, slot);
+            atomic_store(&c->count, row->count);
+            atomic_store(&c->sum, row->sum);
+        }
+        next_generation = h->next_generation;
+        free(snap);
+    } else if (errno != ENOENT) {
+        perror("open");
+        printf("Can't read snapshot %s.\n", j->snapshot_path);
+        return -1;
+    }
+
+    // Replay the journal if it continues from the snapshot, keeping it (cut
+    // back to its last good record) to append to.
+    char *log = journal_read_file(j->journal_path, &n);
+    struct journal_header jh = { 0 };
+    if (log != NULL && n >= sizeof(jh))
+        memcpy(&jh, log, sizeof(jh));
+    if (jh.magic == JOURNAL_MAGIC && (jh.layout != JOURNAL_LAYOUT || jh.generation > next_generation)) {
+        // Newer than the snapshot (was the snapshot deleted?), or unreadable:
+        // starting over would throw it away.
+        printf("Journal %s does not follow snapshot %s; move one of them aside.\n",
+               j->journal_path, j->snapshot_path);
+        free(log);
+        return -1;
+    }
+    if (jh.magic == JOURNAL_MAGIC && jh.generation == next_generation) {
+        size_t off = sizeof(jh), step;
+        while ((step = journal_apply(&j->shadow, log + off, n - off)) > 0) {
+            off += step;
+            nrecords++;
+        }
+        if (off < n)
+            printf("Journal %s has %zu bytes of incomplete or damaged records at the end; dropping them.\n",
+                   j->journal_path, n - off);
+        j->fd = open(j->journal_path, O_WRONLY);
+        if (j->fd < 0 || ftruncate(j->fd, off) < 0 || lseek(j->fd, off, SEEK_SET) < 0) {
+            perror("journal");
+            printf("Can't reopen journal %s.\n", j->journal_path);
+            free(log);
+            return -1;
+        }
+        j->generation = next_generation;
+        j->since_snapshot = off;
+    } else if (journal_start(j, next_generation) < 0) {
+        perror("journal");
+        printf("Can't create journal %s.\n", j->journal_path);
+        free(log);
+        return -1;
+    }
+    free(log);
+
+    printf("Recovered %llu event rows from %s and %llu records from %s in %.3f ms.\n",
+           (unsigned long long)nrows, j->snapshot_path, (unsigned long long)nrecords,
+           j->journal_path, (journal_seconds() - t0) * 1e3);
+    return 0;
+}
+
+// The writer thread: group commit, and snapshots.
+static inline void *journal_writer(void *arg)
+{
+    struct journal *j = (struct journal *)arg;
+    pthread_mutex_lock(&j->lock);
+    while (1) {
+        if (j->used < j->commit_bytes && !j->stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += j->commit_ms * 1000000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&j->wake, &j->lock, &deadline);
+        }
+        if (j->used == 0) {
+            if (j->stopping)
+                break;
+            continue;
+        }
+        char *full = j->active;
+        size_t n = j->used;
+        j->active = j->spare;
+        j->used = 0;
+        j->spare = full;
+        pthread_cond_broadcast(&j->space);
+        pthread_mutex_unlock(&j->lock);
+
+        double t0 = journal_seconds();
+        if (journal_commit(j, full, n) < 0) {
+            perror("journal");
+            printf("Can't write journal %s; records are being lost.\n", j->journal_path);
+        }
+        double t = journal_seconds() - t0;
+        j->commits++;
+        j->bytes += n;
+        j->commit_seconds += t;
+        if (t > j->commit_max)
+            j->commit_max = t;
+
+        for (size_t off = 0, step; off < n; off += step)
+            if ((step = journal_apply(&j->shadow, full + off, n - off)) == 0)
+                break;
+        j->since_snapshot += n;
+        if (j->snapshot_bytes > 0 && j->since_snapshot >= j->snapshot_bytes && journal_snapshot(j) < 0) {
+            perror("snapshot");
+            printf("Can't write snapshot %s.\n", j->snapshot_path);
+            j->since_snapshot = 0; // try again after another snapshot's worth
+        }
+        pthread_mutex_lock(&j->lock);
+    }
+    pthread_mutex_unlock(&j->lock);
+    atomic_store(&j->finished, 1);
+    return NULL;
+}
+
+// Set up a journal from IPC_JOURNAL and friends. Returns 0 if journaling is
+// on and the shadow table holds the recovered state, 1 if IPC_JOURNAL is not
+// set, or -1 after printing an error. The writer is not started yet, so the
+// caller can copy the shadow table into its own first.
+static inline int journal_open(struct journal *j)
+{
+    const char *prefix = getenv("IPC_JOURNAL");
+    if (prefix == NULL || prefix[0] == '\0')
+        return 1;
+    memset(j, 0, sizeof(*j));
+    j->fd = -1;
+    j->ring.fd = -1;
+    snprintf(j->journal_path, sizeof(j->journal_path), "%s.journal", prefix);
+    snprintf(j->snapshot_path, sizeof(j->snapshot_path), "%s.snapshot", prefix);
+    j->commit_bytes = journal_env("IPC_JOURNAL_KB", 1024) << 10;
+    j->commit_ms = journal_env("IPC_JOURNAL_MS", 10);
+    j->snapshot_bytes = (uint64_t)journal_env("IPC_JOURNAL_SNAPSHOT_MB", 64) << 20;
+    if (j->commit_bytes < sizeof(struct journal_register) || j->commit_ms < 1) {
+        printf("IPC_JOURNAL_KB and IPC_JOURNAL_MS must be at least 1.\n");
+        return -1;
+    }
+    j->capacity = 2 * j->commit_bytes + JOURNAL_MAX_APPEND;
+    j->active = malloc(j->capacity);
+    j->spare = malloc(j->capacity);
+    if (j->active == NULL || j->spare == NULL) {
+        printf("Can't allocate journal buffers.\n");
+        return -1;
+    }
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->wake, NULL);
+    pthread_cond_init(&j->space, NULL);
+    const char *output = getenv("IPC_OUTPUT"); // "sync" keeps plain write() here too
+    if ((output == NULL || strcmp(output, "sync")) && uring_init(&j->ring, 2) < 0)
+        j->ring.fd = -1;
+    return journal_recover(j);
+}
+
+// Start the writer thread. Returns 0, or prints an error and returns -1.
+static inline int journal_start_writer(struct journal *j)
+{
+    if (pthread_create(&j->thread, NULL, journal_writer, j) != 0) {
+        printf("Can't start the journal writer thread.\n");
+        return -1;
+    }
+    printf("Journaling to %s (commit every %zu KB or %ld ms%s, snapshot every %llu MB).\n",
+           j->journal_path, j->commit_bytes >> 10, j->commit_ms,
+           j->ring.fd >= 0 ? " through io_uring" : "", (unsigned long long)(j->snapshot_bytes >> 20));
+    return 0;
+}
+
+// Append n bytes of records (at most JOURNAL_MAX_APPEND). Waits only if both
+// buffers are full.
+static inline void journal_append(struct journal *j, const void *record, size_t n)
+{
+    pthread_mutex_lock(&j->lock);
+    while (j->used + n > j->capacity && !j->stopping) {
+        pthread_cond_signal(&j->wake);
+        pthread_cond_wait(&j->space, &j->lock);
+    }
+    if (j->used + n <= j->capacity) {
+        memcpy(j->active + j->used, record, n);
+        j->used += n;
+        if (j->used >= j->commit_bytes)
+            pthread_cond_signal(&j->wake);
+    }
+    pthread_mutex_unlock(&j->lock);
+}
+
+static inline void journal_report(struct journal *j, int eventid, int64_t sum)
+{
+    struct journal_record r = { JOURNAL_REPORT, eventid, sum };
+    journal_append(j, &r, sizeof(r));
+}
+
+static inline void journal_reset(struct journal *j, int eventid)
+{
+    struct journal_record r = { JOURNAL_RESET, eventid, 0 };
+    journal_append(j, &r, sizeof(r));
+}
+
+static inline void journal_register(struct journal *j, int eventid, const struct event_meta *meta)
+{
+    struct journal_register r;
+    memset(&r, 0, sizeof(r));
+    r.r.op = JOURNAL_REGISTER;
+    r.r.eventid = eventid;
+    memcpy(r.name, meta->name, EVENT_NAME_LEN);
+    memcpy(r.description, meta->description, EVENT_DESC_LEN);
+    journal_append(j, &r, sizeof(r));
+}
+
+// Flush everything appended so far, stop the writer, and print what it did.
+// Safe to call from a signal handler that may have interrupted an append: it
+// does not take the lock, and gives up on the writer after two seconds.
+static inline void journal_close(struct journal *j)
+{
+    j->stopping = 1;
+    pthread_cond_signal(&j->wake);
+    for (int i = 0; i < 2000 && !atomic_load(&j->finished); i++)
+        usleep(1000);
+    if (!atomic_load(&j->finished)) {
+        printf("Journal writer did not finish; the last records may be lost.\n");
+        return;
+    }
+    printf("Journal: %llu commits of %.1f KB on average, %.3f ms mean and %.3f ms worst write+fdatasync, %llu snapshots.\n",
+           (unsigned long long)j->commits, j->commits ? j->bytes / 1024.0 / j->commits : 0.0,
+           j->commits ? j->commit_seconds * 1e3 / j->commits : 0.0, j->commit_max * 1e3,
+           (unsigned long long)j->snapshots);
+}
+
+#endif // JOURNAL_H
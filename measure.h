@@ -0,0 +1,112 @@
+// measure.h
+// End-to-end measurement with completion tokens, for every transport.
+
+// Each client used to time its benchmark its own way. client_bb stopped its
+// clock when it saw the ring empty, server_mpi timed from the first report it
+// received to the "print" message after the last, and client_shmem timed its
+// own round trips, so none of them measured the same thing and setup costs
+// were mixed in with the transfer. Now every benchmark client brackets its
+// run with completion tokens:
+//
+//   1. (mpi, shmem) A "begin" token, sent to an idle server. Its ack gives
+//      the server's totals before the run, and how long a token takes to
+//      reach an idle server (one-way) and to come back (round trip).
+//   2. The client notes the time, sends its items, and notes the time the
+//      last send returned.
+//   3. An "end" token, sent right behind the last item. The server handles
+//      it only once every item ahead of it has been processed, and acks with
+//      its totals and two timestamps: when it started on the first item after
+//      the previous token, and when it reached this one.
+//
+// Both sides read CLOCK_MONOTONIC (measure_now_ns), so the server's
+// timestamps can be compared with the client's directly. measure_print then
+// reports separately:
+//
+//   sending     the client's first send to its last send returning
+//   server busy the server's first item to its reaching the end token
+//   drain       the last send returning to the server reaching the end token
+//   one-way     the end token being sent to the server reaching it
+//   round trip  the end token being sent to its ack arriving back
+//
+// and the throughput from the client's first send to the server reaching the
+// end token, which is the same span on every transport.
+//
+// How a token travels is up to the transport: msgtype 9 with a reply on the
+// reply queue for mpi (see mpi_proto.h) or on the socket for sock (see
+// sock_proto.h), operation 4 with the ack written back into the slot for
+// shmem (see shmem_proto.h), and a request posted in the ring's header for bb
+// (see bb_ring.h).
+//
+// NOTE: all the clients and servers must be rebuilt if this file changes.
+
+#ifndef MEASURE_H
+#define MEASURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+// What a server sends back for a token. Totals are since the server started
+// (or, for mpi, since the event type was registered or reset).
+struct measure_ack {
+    uint64_t token;
+    int64_t first_ns;  // when the server started on the first item after the previous token, 0 if none
+    int64_t done_ns;   // when it reached this token, with every item ahead of it processed
+    int64_t processed; // items processed in total
+    int64_t sum;       // their payload sum in total
+};
+
+// What the client records about one run.
+struct measure_run {
+    struct measure_ack begin;   // the server's totals before the run
+    struct measure_ack end;     // the ack for the end token
+    int64_t begin_sent_ns;      // begin token sent (0 if there was none)
+    int64_t begin_acked_ns;     // and its ack received
+    int64_t start_ns;           // the first send
+    int64_t sent_ns;            // the last send returned
+    int64_t end_sent_ns;        // end token sent
+    int64_t end_acked_ns;       // and its ack received
+    int64_t items;              // items the client sent
+    int64_t bytes;              // payload bytes the client sent
+};
+
+static inline int64_t measure_now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// Print the separate times and the end-to-end throughput for a run. unit
+// names the items ("reports", "ints", ...).
+static inline void measure_print(const struct measure_run *m, const char *unit)
+{
+    int64_t processed = m->end.processed - m->begin.processed;
+    int64_t sum = m->end.sum - m->begin.sum;
+    double total = (m->end.done_ns - m->start_ns) / 1e9;
+    printf("End-to-end measurement:\n");
+    printf("  %-12s %lld %s sent, %lld processed, payload sum %lld%s\n", "Items:",
+           (long long)m->items, unit, (long long)processed, (long long)sum,
+           processed == m->items ? "" : "  (MISMATCH)");
+    printf("  %-12s %12.6f s   first send to last send returned\n", "Sending:",
+           (m->sent_ns - m->start_ns) / 1e9);
+    if (m->end.first_ns != 0)
+        printf("  %-12s %12.6f s   server's first item to end token\n", "Server busy:",
+               (m->end.done_ns - m->end.first_ns) / 1e9);
+    printf("  %-12s %12.3f ms  last send returned to server reaching end token\n", "Drain:",
+           (m->end.done_ns - m->sent_ns) / 1e6);
+    printf("  %-12s %12.3f us  end token sent to server reaching it", "One-way:",
+           (m->end.done_ns - m->end_sent_ns) / 1e3);
+    if (m->begin_sent_ns != 0)
+        printf(" (idle: %.3f us)", (m->begin.done_ns - m->begin_sent_ns) / 1e3);
+    printf("\n");
+    printf("  %-12s %12.3f us  end token sent to its ack received", "Round trip:",
+           (m->end_acked_ns - m->end_sent_ns) / 1e3);
+    if (m->begin_sent_ns != 0)
+        printf(" (idle: %.3f us)", (m->begin_acked_ns - m->begin_sent_ns) / 1e3);
+    printf("\n");
+    printf("  %-12s %f %s/second, %f MB/second (first send to server reaching end token)\n",
+           "Throughput:", processed / total, unit, (m->bytes / 1e6) / total);
+}
+
+#endif // MEASURE_H
@@ -0,0 +1,432 @@
+// mpi_proto.h
+// Message format shared by server_mpi.c and client_mpi.c.
+
+#ifndef MPI_PROTO_H
+#define MPI_PROTO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <mqueue.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/uio.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+// Every SystemV IPC message needs to be a struct that starts with a long
+// integer, followed by whatever other data you want. For the toy event-logging
+// system, we will use one field to tell the server what operation to do, a
+// second field to hold the event type ID, and a third field to hold other
+// information (like the name and description when creating a new event type).
+//
+// NOTE: both programs must be rebuilt if this file changes.
+struct ipcmsg {
+    // The first field must be of type "long", as required by SystemV IPC.
+    long msgtype;    // IPC message type (1 = register, 2 = report, 3 = reset, etc.)
+    int eventid;     // the event type ID
+    char data[0];    // other data (zero or more bytes)
+};
+// NOTE: the data array is declared here as an array of length zero. In the code
+// below, the actual size may be zero (if there is no data for the message) but
+// it will often be somze be some larger size.
+
+// A "message" is everything in the above struct.
+// For a message carrying n bytes of "other data", the total message size is:
+#define MSG_SIZE(n) (sizeof(struct ipcmsg) + (n))
+
+// The "payload" is everything in the above struct except the required first
+// long integer.
+// For a message carrying n bytes of "other data", the "payload sizeC" is:
+#define MSG_PAYLOAD_SIZE(n) (sizeof(struct ipcmsg) - sizeof(long) + (n))
+
+// The largest message the kernel will take, from /proc/sys/kernel/msgmax
+// (8192 unless an administrator has changed it). This is the limit on
+// MSG_PAYLOAD_SIZE(n), i.e. everything after the msgtype.
+static inline long msgmax()
+{
+    long max = 8192;
+    FILE *f = fopen("/proc/sys/kernel/msgmax", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &max) != 1)
+            max = 8192;
+        fclose(f);
+    }
+    return max;
+}
+
+// A "report batch" message (msgtype 5) carries many reports at once. Its
+// eventid field holds the number of reports, and its data holds that many
+// records back to back, each a batch_record header followed by "size" bytes of
+// report data and padded to a multiple of 4 bytes. The server applies every
+// record exactly as if it had arrived in its own msgtype 2 message.
+struct batch_record {
+    int eventid;     // the event type ID being reported
+    int size;        // bytes of report data that follow
+    char data[0];
+};
+
+// Bytes a record carrying n bytes of report data takes up in a batch.
+#define BATCH_RECORD_SIZE(n) ((sizeof(struct batch_record) + (n) + 3) & ~(size_t)3)
+
+// Append a record to the batch in m, which currently holds "used" bytes of
+// data. Returns the new number of bytes used.
+static inline int batch_append(struct ipcmsg *m, int used, int eventid, const char *data, int size)
+{
+    struct batch_record *r = (struct batch_record *)(m->data + used);
+    r->eventid = eventid;
+    r->size = size;
+    memcpy(r->data, data, size);
+    m->eventid++;
+    return used + BATCH_RECORD_SIZE(size);
+}
+
+// Messages with msgtype 6, 7, 8, and 9 (and 12, below) ask for a reply. Their data starts with a
+// reply_to header saying who is asking, followed by whatever the request needs:
+//
+//   6 = register-sync: as register (the name and description follow the header),
+//       but the reply says whether it worked.
+//   7 = query: the reply holds the event's name, description, count, and sum.
+//   8 = sync: as query, but sent only after every message that was in the
+//       mailbox ahead of it has been applied. One sync acknowledges all the
+//       reports before it, so a client that wants to know its reports have
+//       landed sends one sync after a burst rather than paying for a reply to
+//       each report. Reports themselves never get a reply.
+//   9 = measure: as sync, and the reply also holds when the server reached it
+//       (done_ns) and when it started on the first report after the previous
+//       measure (first_ns, 0 if none), both from CLOCK_MONOTONIC. This is the
+//       completion token of measure.h.
+//
+// SystemV has no way to send a message to one particular process, but a
+// receiver can ask for only the messages of a given msgtype. So the server
+// creates a second queue, the reply queue, with key -mailbox_num (see
+// MAILBOX_REPLY_KEY), and sends each reply there with msgtype set to the asking client's PID; the client
+// receives with msgtyp = getpid() and so sees only its own replies. The token
+// is echoed back so a client can discard a stale reply (meant for an earlier
+// process with the same PID, say). The server never blocks on the reply queue:
+// if it is full, the reply is dropped and the client's wait times out.
+//
+// Replies are only available on SystemV mailboxes; POSIX message queues have
+// no selective receive.
+struct reply_to {
+    int pid;   // the client waiting for the reply
+    int token; // echoed back in the reply
+};
+
+struct ipcreply {
+    long msgtype;          // the client's PID
+    int token;             // from the request
+    int status;            // 0 if the request worked, -1 if not
+    int64_t count;         // the event's count (query and sync)
+    int64_t sum;           // the event's payload sum (query and sync)
+    int64_t first_ns;      // measure: first report since the previous measure
+    int64_t done_ns;       // measure: when the server reached this one
+    char name[16];         // the event's name (see EVENT_NAME_LEN)
+    char description[64];  // and description (EVENT_DESC_LEN)
+    int pid;               // the server's PID (see bulk_allow_reader)
+};
+
+#define REPLY_PAYLOAD_SIZE (sizeof(struct ipcreply) - sizeof(long))
+
+// A "bulk" message (msgtype 12) doesn't carry its reports at all. Even a
+// report batch is copied twice, into the kernel by msgsnd and back out by
+// msgrcv; for a bulk message, the server copies the reports straight out of
+// the client's memory with process_vm_readv, once. After the reply_to header
+// comes a bulk_desc saying where they are: count reports of size bytes each,
+// back to back at addr in process pid. The server reads them BULK_CHUNK bytes
+// at a time, so they pass through a buffer that stays in its cache, counts
+// each one exactly as if it had come in its own msgtype 2 message, and then
+// replies as for sync (status -1 if it could not read them). The client must
+// leave the reports and the descriptor alone until the reply comes, so bulk
+// needs a SystemV mailbox, and the server must be allowed to read the
+// client's memory (the same user, and see bulk_allow_reader).
+//
+// A SystemV message doesn't say who sent it, so before reading anything the
+// server reads the descriptor back from the client at self and checks it
+// matches the one in the message (see bulk_check). The nonce makes sure only
+// the process that wrote the descriptor can send it: otherwise any process
+// could name another's PID and have the server count that one's memory.
+// count is at most BULK_MAX_COUNT, which also bounds a message of empty reports.
+struct bulk_desc {
+    int64_t count;  // how many reports
+    uint64_t addr;  // where the first one starts, in the client
+    int size;       // bytes in each one, at most BULK_CHUNK
+    int pid;        // the client
+    uint64_t self;  // where this descriptor is, in the client
+    uint64_t nonce; // random, so no other process can make up the descriptor
+};
+
+#define BULK_CHUNK (256 * 1024)
+#define BULK_MAX_COUNT (1 << 20) // most reports one bulk message may describe
+
+// Let the server, and no other process, read this one's memory (server_pid is
+// in the reply to any request). Only needed where the Yama security module
+// restricts process_vm_readv to a process's ancestors; where there is no Yama,
+// this does nothing, and any process of the same user can read it anyway.
+static inline void bulk_allow_reader(int server_pid)
+{
+    prctl(PR_SET_PTRACER, server_pid, 0, 0, 0);
+}
+
+// Fill in the rest of d, whose count, addr and size are set, before it is
+// sent: the client's PID, where d is, and a fresh nonce. getrandom is made
+// through syscall() so as not to depend on a newer glibc.
+static inline void bulk_seal(struct bulk_desc *d)
+{
+    d->pid = getpid();
+    d->self = (uintptr_t)d;
+    if (syscall(SYS_getrandom, &d->nonce, sizeof(d->nonce), 0) != sizeof(d->nonce)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        d->nonce = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^ ((uint64_t)d->pid << 32);
+    }
+}
+
+// Copy len bytes at addr in process pid into buf. glibc only declares
+// process_vm_readv with _GNU_SOURCE, so (as placement.h does for its calls)
+// it is made through syscall(). Returns 0, or -1 with errno set.
+static inline int bulk_read(int pid, uint64_t addr, void *buf, size_t len)
+{
+    while (len > 0) {
+        struct iovec local = { buf, len };
+        struct iovec remote = { (void *)(uintptr_t)addr, len };
+        long got = syscall(SYS_process_vm_readv, pid, &local, 1, &remote, 1, 0);
+        if (got <= 0) {
+            if (got == 0)
+                errno = EFAULT;
+            return -1;
+        }
+        buf = (char *)buf + got;
+        addr += got;
+        len -= got;
+    }
+    return 0;
+}
+
+// Check that process d->pid really sent the bulk descriptor d: that it holds
+// the same descriptor, nonce and all, at d->self. Returns 0, or -1 with errno
+// set (EPERM if the descriptor doesn't match).
+static inline int bulk_check(const struct bulk_desc *d)
+{
+    struct bulk_desc theirs;
+    if (bulk_read(d->pid, d->self, &theirs, sizeof(theirs)) < 0)
+        return -1;
+    if (memcmp(&theirs, d, sizeof(theirs)) != 0) {
+        errno = EPERM;
+        return -1;
+    }
+    return 0;
+}
+
+// A mailbox is where clients send messages and the server receives them. It is
+// either a SystemV message queue (named by a number, as before) or a POSIX
+// message queue (named "/something"). Both carry the same struct ipcmsg; a
+// POSIX message is simply the whole struct, msgtype included.
+//
+// The POSIX queue's limits are set when the server creates it, from MQ_MAXMSG
+// and MQ_MSGSIZE in the environment (default: the largest values an ordinary
+// user may ask for, /proc/sys/fs/mqueue/msg_max and msgsize_max). Register and
+// reset are sent at priority 1 and everything else at priority 0, so they are
+// delivered ahead of any reports already waiting in the queue. Print stays at
+// priority 0 so it still arrives after the reports it is measuring.
+//
+// Waits on a POSIX mailbox are bounded by MQ_TIMEOUT_MS (default 1000 ms).
+// A client whose send times out gives up (the server is gone or stuck) rather
+// than hanging; a server whose receive times out just waits again.
+struct mailbox {
+    int posix;    // 1 for a POSIX message queue, 0 for SystemV
+    int q;        // SystemV queue identifier
+    int reply_q;  // SystemV reply queue identifier, or -1 if there is none
+    mqd_t mq;     // POSIX queue descriptor
+    long msgsize; // POSIX: largest message the queue accepts
+    const char *name;
+};
+
+static inline long read_proc_long(const char *path, long fallback)
+{
+    long value = fallback;
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &value) != 1)
+            value = fallback;
+        fclose(f);
+    }
+    return value;
+}
+
+static inline long env_long(const char *name, long fallback)
+{
+    const char *value = getenv(name);
+    return value ? atol(value) : fallback;
+}
+
+static inline struct timespec mailbox_deadline()
+{
+    long ms = env_long("MQ_TIMEOUT_MS", 1000);
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += ms / 1000;
+    t.tv_nsec += (ms % 1000) * 1000000;
+    if (t.tv_nsec >= 1000000000) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000;
+    }
+    return t;
+}
+
+// The key of a SystemV mailbox's reply queue. Mailbox numbers must be positive
+// (0 is IPC_PRIVATE), so reply queues have the negative keys to themselves and
+// can never be another mailbox's request queue.
+#define MAILBOX_REPLY_KEY(mailbox_num) (-(mailbox_num))
+
+// Open the mailbox called name, creating it if create is set. Prints an error
+// and returns -1 on failure.
+static inline int mailbox_open(struct mailbox *mb, const char *name, int create)
+{
+    mb->name = name;
+    mb->posix = (name[0] == '/');
+    mb->reply_q = -1;
+    if (!mb->posix) {
+        if (atoi(name) <= 0) {
+            printf("Mailbox number %s must be a positive number.\n", name);
+            return -1;
+        }
+        mb->q = msgget(atoi(name), create ? (IPC_CREAT | 0660) : 0);
+        if (mb->q < 0) {
+            perror("msgget");
+            return -1;
+        }
+        // A client can do without the reply queue (an older server has none),
+        // so failing to open it is only an error when it is actually needed.
+        mb->reply_q = msgget(MAILBOX_REPLY_KEY(atoi(name)), create ? (IPC_CREAT | 0660) : 0);
+        if (mb->reply_q < 0 && create) {
+            perror("msgget");
+            return -1;
+        }
+        return 0;
+    }
+    if (create) {
+        struct mq_attr attr = { 0 };
+        attr.mq_maxmsg = env_long("MQ_MAXMSG", read_proc_long("/proc/sys/fs/mqueue/msg_max", 10));
+        attr.mq_msgsize = env_long("MQ_MSGSIZE", read_proc_long("/proc/sys/fs/mqueue/msgsize_max", 8192));
+        mb->mq = mq_open(name, O_CREAT | O_RDWR, 0660, &attr);
+    } else {
+        mb->mq = mq_open(name, O_WRONLY);
+    }
+    if (mb->mq == (mqd_t)-1) {
+        perror("mq_open");
+        return -1;
+    }
+    struct mq_attr attr;
+    mq_getattr(mb->mq, &attr);
+    mb->msgsize = attr.mq_msgsize;
+    return 0;
+}
+
+// The most "payload" (as in MSG_PAYLOAD_SIZE) one message can carry.
+static inline long mailbox_max_payload(struct mailbox *mb)
+{
+    if (mb->posix)
+        return mb->msgsize - sizeof(long);
+    return msgmax();
+}
+
+// Send a message with the given payload size. Returns -1 (with errno set) on failure.
+static inline int mailbox_send(struct mailbox *mb, struct ipcmsg *m, size_t payload)
+{
+    if (!mb->posix)
+        return msgsnd(mb->q, m, payload, 0);
+    unsigned prio = (m->msgtype == 1 || m->msgtype == 3 || m->msgtype == 6) ? 1 : 0;
+    struct timespec deadline = mailbox_deadline();
+    return mq_timedsend(mb->mq, (const char *)m, payload + sizeof(long), prio, &deadline);
+}
+
+// Receive the next message into m, which has room for max_payload bytes of
+// payload. Returns the payload size, as msgrcv does, or -1 on failure.
+static inline int mailbox_recv(struct mailbox *mb, struct ipcmsg *m, size_t max_payload)
+{
+    if (!mb->posix)
+        return msgrcv(mb->q, m, max_payload, 0, 0);
+    for (;;) {
+        struct timespec deadline = mailbox_deadline();
+        ssize_t n = mq_timedreceive(mb->mq, (char *)m, max_payload + sizeof(long), NULL, &deadline);
+        if (n >= 0)
+            return n - sizeof(long);
+        if (errno != ETIMEDOUT && errno != EINTR)
+            return -1;
+    }
+}
+
+// Send reply r to the client named in "to". Never blocks. Returns -1 (with
+// errno set) if the reply could not be sent.
+static inline int mailbox_reply(struct mailbox *mb, const struct reply_to *to, struct ipcreply *r)
+{
+    if (mb->reply_q < 0) {
+        errno = ENOSYS;
+        return -1;
+    }
+    r->msgtype = to->pid;
+    r->token = to->token;
+    r->pid = getpid();
+    return msgsnd(mb->reply_q, r, REPLY_PAYLOAD_SIZE, IPC_NOWAIT);
+}
+
+static inline void mailbox_reply_timeout(int s)
+{
+    // Nothing to do: the signal is only there to interrupt msgrcv.
+}
+
+// Wait for the reply to the request this process sent with the given token,
+// for at most MQ_TIMEOUT_MS. Prints an error and returns -1 on failure.
+static inline int mailbox_await_reply(struct mailbox *mb, int token, struct ipcreply *r)
+{
+    if (mb->reply_q < 0) {
+        printf("This mailbox has no reply queue (replies need a SystemV mailbox and a current server).\n");
+        return -1;
+    }
+    struct sigaction sa = { 0 };
+    sa.sa_handler = mailbox_reply_timeout; // no SA_RESTART, so msgrcv returns EINTR
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+    long ms = env_long("MQ_TIMEOUT_MS", 1000);
+    struct itimerval timer = { { 0, 0 }, { ms / 1000, (ms % 1000) * 1000 } };
+    setitimer(ITIMER_REAL, &timer, NULL);
+    int result = -1;
+    for (;;) {
+        if (msgrcv(mb->reply_q, r, REPLY_PAYLOAD_SIZE, getpid(), 0) < 0) {
+            if (errno == EINTR)
+                printf("No reply from the server within %ld ms.\n", ms);
+            else
+                perror("msgrcv");
+            break;
+        }
+        if (r->token == token) {
+            result = 0;
+            break;
+        }
+        // A stale reply meant for an earlier request; keep waiting.
+    }
+    struct itimerval off = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_REAL, &off, NULL);
+    return result;
+}
+
+// Remove the mailbox from the system. Only the server does this.
+static inline int mailbox_remove(struct mailbox *mb)
+{
+    if (mb->posix)
+        return mq_unlink(mb->name);
+    if (mb->reply_q >= 0)
+        msgctl(mb->reply_q, IPC_RMID, NULL);
+    return msgctl(mb->q, IPC_RMID, NULL);
+}
+
+#endif // MPI_PROTO_H
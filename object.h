@@ -0,0 +1,115 @@
+// object.h
+// Large report payloads passed as sealed memfds, for client_sock and the socket servers.
+
+// A report has to fit in one message: 8184 bytes on a SystemV queue (msgmax),
+// and SOCK_MSG_MAX on a socket. Anything bigger used to fail outright, and
+// even when it fits, a message is copied twice, into the kernel and back out.
+//
+// An object is a report whose payload lives in a memfd instead. The client
+// writes the payload into the memfd, unmaps it, seals it, and sends msgtype
+// 11 ("object", see sock_proto.h) with the descriptor attached. The server
+// maps the memfd read-only and adds up the payload in place, so the payload
+// itself is never copied, whatever its size; only the descriptor travels.
+//
+// The seals are what make this safe for the server. F_SEAL_WRITE means no one
+// can change the payload while the server reads it, and F_SEAL_SHRINK means
+// the memfd can't be truncated under the server's mapping, which would make
+// it fault with SIGBUS. The server refuses an object without them.
+//
+// memfd_create and the seal constants are only declared with _GNU_SOURCE, so,
+// as placement.h does for its calls, this uses syscall() and the kernel's
+// values.
+//
+// NOTE: everything that includes this must be rebuilt if it changes.
+
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_GET_SEALS (1024 + 10)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+// Every seal an object must carry before a server will read it.
+#define OBJECT_SEALS (F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+// Create an object of size bytes and map it for writing. Returns the memfd and
+// sets *p, or prints an error and returns -1.
+static inline int object_create(size_t size, char **p)
+{
+    int fd = syscall(SYS_memfd_create, "ipc-object", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    *p = (char *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*p == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Unmap an object the client has finished writing, and seal it. The mapping
+// must go first: F_SEAL_WRITE fails while any writable mapping exists.
+// Prints an error and returns -1 on failure.
+static inline int object_seal(int fd, char *p, size_t size)
+{
+    munmap(p, size);
+    if (fcntl(fd, F_ADD_SEALS, OBJECT_SEALS) < 0) {
+        perror("fcntl(F_ADD_SEALS)");
+        return -1;
+    }
+    return 0;
+}
+
+// Map an object the server was sent, read-only and with every page faulted
+// in, after checking its seals. Sets *size. Returns the mapping, or NULL with
+// errno set (EPERM if the seals are missing).
+static inline const char *object_map(int fd, size_t *size)
+{
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || fstat(fd, &st) < 0)
+        return NULL;
+    if ((seals & OBJECT_SEALS) != OBJECT_SEALS) {
+        errno = EPERM;
+        return NULL;
+    }
+    *size = st.st_size;
+    if (*size == 0)
+        return "";
+    void *p = mmap(0, *size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    return p == MAP_FAILED ? NULL : (const char *)p;
+}
+
+static inline void object_unmap(const char *p, size_t size)
+{
+    if (size > 0)
+        munmap((void *)p, size);
+}
+
+#endif // OBJECT_H
@@ -0,0 +1,211 @@
+// placement.h
+// CPU-affinity and NUMA placement controls for the servers and clients.
+
+// Where a process runs and where its memory lives decide most of what these
+// benchmarks measure: a handoff between two hyperthreads of one core costs a
+// fraction of a handoff between sockets. Left to the scheduler, a run may land
+// on either, so every program reads two environment variables at startup:
+//
+//   IPC_CPUS=<list>        run only on these CPUs, in the kernel's cpulist
+//                          syntax, e.g. "2", "0-3", or "0,8-11".
+//   IPC_MEMPOLICY=<policy> where to allocate memory:
+//                            bind:<nodes>       only on these nodes
+//                            interleave:<nodes> round-robin across these nodes
+//                            preferred:<node>   on this node if it has room
+//                            local              on the node we are running on
+//                          <nodes> uses the same list syntax as IPC_CPUS.
+//
+// The policy applies to the process's own memory (set_mempolicy) and, in the
+// servers, to the shared region they create (mbind, before anything touches
+// it), so the region's pages end up on the requested nodes no matter which
+// process faults them in first. Everything here uses raw system calls, so
+// there is no dependency on libnuma.
+//
+// At startup each program prints the CPU and node it is actually running on
+// and the CPUs it may use, and the servers print the node holding the region.
+//
+// NOTE: every program must be rebuilt if this file changes.
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define PLACEMENT_MAX_CPUS 1024 // bits in the CPU mask we hand the kernel
+#define PLACEMENT_MAX_NODES 64  // bits in the node mask
+#define PLACEMENT_WORD_BITS (8 * sizeof(unsigned long))
+
+// CPU and node sets are plain bitmasks in the kernel's format, rather than
+// cpu_set_t, so the including program does not need _GNU_SOURCE.
+static inline int placement_isset(const unsigned long *mask, int i)
+{
+    return (mask[i / PLACEMENT_WORD_BITS] >> (i % PLACEMENT_WORD_BITS)) & 1;
+}
+
+// Parse a list like "0-3,8" into mask, which has room for limit bits and must
+// start out zeroed. Returns the number of members, or -1 if the list is malformed.
+static inline int placement_parse_list(const char *s, int limit, unsigned long *mask)
+{
+    int n = 0;
+    while (*s) {
+        char *end;
+        long lo = strtol(s, &end, 10);
+        if (end == s || lo < 0)
+            return -1;
+        long hi = lo;
+        s = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            if (end == s + 1 || hi < lo)
+                return -1;
+            s = end;
+        }
+        if (hi >= limit)
+            return -1;
+        for (long i = lo; i <= hi; i++, n++)
+            mask[i / PLACEMENT_WORD_BITS] |= 1ul << (i % PLACEMENT_WORD_BITS);
+        if (*s == ',')
+            s++;
+        else if (*s)
+            return -1;
+    }
+    return n;
+}
+
+// Format the first limit bits of mask back into list syntax.
+static inline void placement_format_list(const unsigned long *mask, int limit, char *buf, size_t len)
+{
+    size_t used = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < limit && used < len; i++) {
+        if (!placement_isset(mask, i))
+            continue;
+        int j = i;
+        while (j + 1 < limit && placement_isset(mask, j + 1))
+            j++;
+        if (j == i)
+            used += snprintf(buf + used, len - used, "%s%d", used ? "," : "", i);
+        else
+            used += snprintf(buf + used, len - used, "%s%d-%d", used ? "," : "", i, j);
+        i = j;
+    }
+}
+
+// Parse IPC_MEMPOLICY. Returns 0 and fills in mode and nodes, or -1 if the
+// variable is malformed. An unset variable gives MPOL_DEFAULT.
+static inline int placement_mempolicy(int *mode, unsigned long *nodes)
+{
+    const char *env = getenv("IPC_MEMPOLICY");
+    *mode = MPOL_DEFAULT;
+    *nodes = 0;
+    if (env == NULL || !strcmp(env, "default"))
+        return 0;
+    if (!strcmp(env, "local")) {
+        *mode = MPOL_LOCAL;
+        return 0;
+    }
+    const char *list = strchr(env, ':');
+    if (list == NULL)
+        return -1;
+    size_t kind = list - env;
+    if (kind == 4 && !strncmp(env, "bind", 4))
+        *mode = MPOL_BIND;
+    else if (kind == 10 && !strncmp(env, "interleave", 10))
+        *mode = MPOL_INTERLEAVE;
+    else if (kind == 9 && !strncmp(env, "preferred", 9))
+        *mode = MPOL_PREFERRED;
+    else
+        return -1;
+    int n = placement_parse_list(list + 1, PLACEMENT_MAX_NODES, nodes);
+    if (n < 1 || (*mode == MPOL_PREFERRED && n != 1))
+        return -1;
+    return 0;
+}
+
+static inline const char *placement_mempolicy_name(int mode)
+{
+    switch (mode) {
+    case MPOL_BIND: return "bind";
+    case MPOL_INTERLEAVE: return "interleave";
+    case MPOL_PREFERRED: return "preferred";
+    case MPOL_LOCAL: return "local";
+    default: return "default";
+    }
+}
+
+// Apply IPC_CPUS and IPC_MEMPOLICY to the calling process and report where it
+// ended up. "who" names the program in the report. Exits on a bad setting, so
+// a run never silently goes ahead with the wrong placement.
+static inline void placement_init(const char *who)
+{
+    const char *cpus = getenv("IPC_CPUS");
+    if (cpus != NULL) {
+        unsigned long set[PLACEMENT_MAX_CPUS / PLACEMENT_WORD_BITS] = { 0 };
+        if (placement_parse_list(cpus, PLACEMENT_MAX_CPUS, set) < 1) {
+            printf("Bad IPC_CPUS '%s'; expected a CPU list like 0-3,8.\n", cpus);
+            exit(1);
+        }
+        if (syscall(SYS_sched_setaffinity, 0, sizeof(set), set) < 0) {
+            perror("sched_setaffinity");
+            printf("Can't run on CPUs %s.\n", cpus);
+            exit(1);
+        }
+    }
+
+    int mode;
+    unsigned long nodes;
+    if (placement_mempolicy(&mode, &nodes) < 0) {
+        printf("Bad IPC_MEMPOLICY '%s'; expected bind:<nodes>, interleave:<nodes>, preferred:<node>, or local.\n",
+               getenv("IPC_MEMPOLICY"));
+        exit(1);
+    }
+    if (mode != MPOL_DEFAULT &&
+        syscall(SYS_set_mempolicy, mode, mode == MPOL_LOCAL ? NULL : &nodes, PLACEMENT_MAX_NODES + 1) < 0) {
+        perror("set_mempolicy");
+        printf("Can't use memory policy %s.\n", getenv("IPC_MEMPOLICY"));
+        exit(1);
+    }
+
+    unsigned cpu = 0, node = 0;
+    syscall(SYS_getcpu, &cpu, &node, NULL);
+    unsigned long allowed[PLACEMENT_MAX_CPUS / PLACEMENT_WORD_BITS] = { 0 };
+    char list[256] = "?";
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) > 0)
+        placement_format_list(allowed, PLACEMENT_MAX_CPUS, list, sizeof(list));
+    printf("%s: running on CPU %u (node %u), allowed CPUs %s, memory policy %s.\n",
+           who, cpu, node, list, placement_mempolicy_name(mode));
+}
+
+// Apply IPC_MEMPOLICY to a shared region that has just been mapped. Call it
+// before anything writes to the region, so no page is placed before the
+// policy is set. Exits on failure.
+static inline void placement_bind_region(void *addr, size_t len)
+{
+    int mode;
+    unsigned long nodes;
+    if (placement_mempolicy(&mode, &nodes) < 0 || mode == MPOL_DEFAULT)
+        return;
+    if (syscall(SYS_mbind, addr, len, mode, mode == MPOL_LOCAL ? NULL : &nodes,
+                PLACEMENT_MAX_NODES + 1, MPOL_MF_MOVE) < 0) {
+        perror("mbind");
+        printf("Can't apply memory policy %s to the shared region.\n", getenv("IPC_MEMPOLICY"));
+        exit(1);
+    }
+}
+
+// Print the node holding the page at addr (faulting it in if necessary).
+static inline void placement_report_region(const char *what, void *addr)
+{
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) < 0)
+        return;
+    printf("%s is on node %d.\n", what, node);
+}
+
+#endif // PLACEMENT_H
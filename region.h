@@ -0,0 +1,383 @@
+// region.h
+// Create and open a named shared memory region, optionally on huge pages.
+
+// The bounded buffer's ring is 4 MB. On 4 KB pages that is 1024 TLB entries,
+// and as the producer and consumer sweep around the ring they keep missing in
+// the TLB and walking page tables. One 2 MB page needs just two entries.
+//
+// Setting IPC_HUGEPAGES=2M (or 1G) in the server's environment asks for the
+// region to live in a hugetlbfs file of that page size, e.g. /dev/hugepages/<name>,
+// instead of a /dev/shm file. This needs a hugetlbfs mount with that page size
+// and enough free huge pages reserved, e.g.
+//
+//     mount -t hugetlbfs -o pagesize=2M none /dev/hugepages
+//     echo 8 > /proc/sys/vm/nr_hugepages
+//
+// If any of that is missing, the server says so and falls back to an ordinary
+// shm_open() region on small pages, which it asks to be backed by transparent
+// huge pages with madvise(MADV_HUGEPAGE). That only takes effect if
+// /sys/kernel/mm/transparent_hugepage/shmem_enabled allows it, and the server
+// reports when it does not. Clients need no setting: the region's name in
+// /dev/shm is always where to look. A hugetlbfs region leaves a small pointer
+// there holding its path, and region_open() follows it.
+//
+// The server keeps the /dev/shm object open and flock()ed while it runs. A
+// second server given the same name finds it locked and refuses to start. If
+// it is not locked, an earlier server died without cleaning up, and the new
+// one removes the object and the hugetlbfs file it points to, if any. It
+// removes nothing else, and it creates everything with O_EXCL, so it never
+// takes over a file it did not make.
+//
+// Either way, every page is faulted in before any timing starts: the server
+// touches each page once it has applied its NUMA policy (region_prefault), and
+// clients map the region with MAP_POPULATE, so neither side takes first-touch
+// page faults inside a measurement.
+//
+// NOTE: every program using the region must be rebuilt if this file changes.
+
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+// What the /dev/shm object holds instead of the region when the region is on
+// huge pages: this, then the hugetlbfs file's path.
+#define REGION_POINTER "hugetlbfs region at "
+#define REGION_PATH_MAX 512
+#define REGION_HUGETLBFS_MAGIC 0x958458f6 // statfs f_type of a hugetlbfs mount
+
+struct region {
+    void *ptr;        // start of the mapping
+    size_t size;      // bytes asked for
+    size_t mapped;    // bytes mapped (size rounded up to a whole page)
+    long pagesize;    // page size backing the region
+    int hugetlb;      // 1 if the region is a hugetlbfs file
+    const char *name; // region name, as given on the command line
+    char path[REGION_PATH_MAX]; // hugetlbfs file (only if hugetlb)
+    int lock_fd;      // the creator's /dev/shm object, held locked, or -1
+};
+
+// Parse a page size such as "2M", "2MB", "1G", or "2048k". Returns 0 if the
+// string is not a size.
+static inline long region_parse_size(const char *s)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end == s || n <= 0)
+        return 0;
+    switch (*end) {
+    case 'k': case 'K': return n << 10;
+    case 'm': case 'M': return n << 20;
+    case 'g': case 'G': return n << 30;
+    case '\0': return n;
+    default: return 0;
+    }
+}
+
+// The system's default huge page size, from /proc/meminfo.
+static inline long region_default_hugepage(void)
+{
+    long kb = 2048;
+    char line[256];
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f == NULL)
+        return kb << 10;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "Hugepagesize: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb << 10;
+}
+
+// Find the next hugetlbfs mount in /proc/mounts after the one numbered *index,
+// storing its directory in dir and its page size in *pagesize. Returns 0 when
+// there are no more.
+static inline int region_next_hugetlbfs(int *index, char *dir, size_t len, long *pagesize)
+{
+    FILE *f = fopen("/proc/mounts", "r");
+    if (f == NULL)
+        return 0;
+    char dev[256], mnt[256], type[64], opts[512];
+    int i = 0, found = 0;
+    while (fscanf(f, "%255s %255s %63s %511s %*d %*d", dev, mnt, type, opts) == 4) {
+        if (strcmp(type, "hugetlbfs") || i++ < *index)
+            continue;
+        char *ps = strstr(opts, "pagesize=");
+        *pagesize = ps ? region_parse_size(ps + strlen("pagesize=")) : region_default_hugepage();
+        snprintf(dir, len, "%s", mnt);
+        *index = i;
+        found = 1;
+        break;
+    }
+    fclose(f);
+    return found;
+}
+
+static inline const char *region_basename(const char *name)
+{
+    return (name[0] == '/') ? name + 1 : name;
+}
+
+static inline size_t region_round_up(size_t n, long pagesize)
+{
+    return (n + pagesize - 1) & ~(size_t)(pagesize - 1);
+}
+
+// If the /dev/shm object open on fd is a pointer to a hugetlbfs region, copy
+// the region's path (REGION_PATH_MAX bytes) into path and return 1. Otherwise
+// return 0.
+static inline int region_read_pointer(int fd, char *path)
+{
+    char buf[sizeof(REGION_POINTER) - 1 + REGION_PATH_MAX]; // the pointer, then a path and its NUL
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size >= (off_t)sizeof(buf))
+        return 0;
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    buf[n > 0 ? n : 0] = '\0';
+    if (strncmp(buf, REGION_POINTER, strlen(REGION_POINTER)))
+        return 0;
+    memcpy(path, buf + strlen(REGION_POINTER), REGION_PATH_MAX); // buf's NUL ends it in time
+    return 1;
+}
+
+// Hold the creator's lock on the /dev/shm object open on fd, which marks the
+// region live (see region_remove_stale). Returns 0, or -1 with errno set.
+static inline int region_hold(struct region *r, int fd)
+{
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+        return -1;
+    r->lock_fd = fd;
+    return 0;
+}
+
+// Remove the region's name from the system, and its pointer if it has one,
+// and let go of the lock. Only the creator does this.
+static inline int region_remove(struct region *r)
+{
+    if (r->hugetlb && unlink(r->path) < 0)
+        return -1;
+    int status = shm_unlink(r->name);
+    if (r->lock_fd >= 0)
+        close(r->lock_fd);
+    r->lock_fd = -1;
+    return status;
+}
+
+// Remove what an earlier server left under name if it died without cleaning
+// up: the /dev/shm object, and the hugetlbfs file it points to, if any. A live
+// server holds a lock on the object, and then nothing is touched. Returns 0,
+// or prints why and returns -1 if the region is in use.
+static inline int region_remove_stale(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return 0; // nothing there, or nothing of ours; creating it will say
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        printf("Region %s is in use by a running server.\n", name);
+        close(fd);
+        return -1;
+    }
+    char path[REGION_PATH_MAX];
+    struct statfs fs;
+    if (region_read_pointer(fd, path) && statfs(path, &fs) == 0 && fs.f_type == REGION_HUGETLBFS_MAGIC &&
+        unlink(path) == 0)
+        printf("Removed a stale region at %s.\n", path);
+    if (shm_unlink(name) == 0)
+        printf("Removed a stale region at /dev/shm/%s.\n", region_basename(name));
+    close(fd);
+    return 0;
+}
+
+// Tell clients where a hugetlbfs region is: create the /dev/shm object for its
+// name holding REGION_POINTER and the path, and hold it. Returns 0, or -1 with
+// errno set.
+static inline int region_advertise(struct region *r)
+{
+    int fd = shm_open(r->name, O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd < 0)
+        return -1;
+    char buf[sizeof(REGION_POINTER) - 1 + sizeof(r->path)]; // the pointer, then a path and its NUL
+    int n = snprintf(buf, sizeof(buf), "%s%s", REGION_POINTER, r->path);
+    if (region_hold(r, fd) < 0 || write(fd, buf, n) != n) {
+        int e = errno;
+        close(fd);
+        shm_unlink(r->name);
+        r->lock_fd = -1;
+        errno = e;
+        return -1;
+    }
+    return 0;
+}
+
+// Try to create the region as a file in a hugetlbfs mount with the given page
+// size. Returns 0 on success, or -1 with the reason in why.
+static inline int region_create_hugetlb(struct region *r, long pagesize, const char **why)
+{
+    char dir[256];
+    long ps;
+    int index = 0;
+    *why = "no hugetlbfs mount with that page size";
+    while (region_next_hugetlbfs(&index, dir, sizeof(dir), &ps)) {
+        if (ps != pagesize)
+            continue;
+        snprintf(r->path, sizeof(r->path), "%s/%s", dir, region_basename(r->name));
+        int fd = open(r->path, O_CREAT | O_EXCL | O_RDWR, 0660);
+        if (fd < 0) {
+            *why = (errno == EEXIST) ? "a file of that name is already in the hugetlbfs mount" : strerror(errno);
+            return -1;
+        }
+        r->mapped = region_round_up(r->size, pagesize);
+        if (ftruncate(fd, r->mapped) != 0) {
+            *why = strerror(errno);
+            close(fd);
+            unlink(r->path);
+            return -1;
+        }
+        // Huge pages are reserved at mmap time, so this fails cleanly (rather
+        // than with SIGBUS later) if there are not enough free.
+        r->ptr = mmap(0, r->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (r->ptr == MAP_FAILED) {
+            *why = (errno == ENOMEM) ? "not enough free huge pages (see /proc/sys/vm/nr_hugepages)" : strerror(errno);
+            unlink(r->path);
+            return -1;
+        }
+        if (region_advertise(r) < 0) {
+            *why = strerror(errno);
+            munmap(r->ptr, r->mapped);
+            unlink(r->path);
+            return -1;
+        }
+        r->pagesize = pagesize;
+        r->hugetlb = 1;
+        return 0;
+    }
+    return -1;
+}
+
+// Create the region called name, of the given size, honoring IPC_HUGEPAGES.
+// Prints an error and returns -1 on failure. The region is not touched, so a
+// NUMA policy can still be applied to it before region_prefault().
+static inline int region_create(struct region *r, const char *name, size_t size)
+{
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->size = size;
+    r->pagesize = sysconf(_SC_PAGESIZE);
+    r->lock_fd = -1;
+    if (region_remove_stale(name) < 0)
+        return -1;
+
+    const char *env = getenv("IPC_HUGEPAGES");
+    if (env != NULL && strcmp(env, "off") && strcmp(env, "0")) {
+        long want = region_parse_size(env);
+        const char *why = "not a page size";
+        if (want > 0 && region_create_hugetlb(r, want, &why) == 0)
+            return 0;
+        printf("Can't put the region on %s huge pages (%s); falling back to small pages.\n", env, why);
+    }
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd < 0) {
+        perror("shm_open");
+        return -1;
+    }
+    if (region_hold(r, fd) < 0) {
+        perror("flock");
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    r->mapped = region_round_up(size, r->pagesize);
+    if (ftruncate(fd, r->mapped) != 0) {
+        perror("ftruncate");
+        region_remove(r);
+        return -1;
+    }
+    r->ptr = mmap(0, r->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (r->ptr == MAP_FAILED) {
+        perror("mmap");
+        region_remove(r);
+        return -1;
+    }
+    if (env != NULL && strcmp(env, "off") && strcmp(env, "0")) {
+        // Second best: transparent huge pages, if the kernel allows them for shmem.
+        char thp[128] = "";
+        FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+        if (f != NULL) {
+            if (fgets(thp, sizeof(thp), f) == NULL)
+                thp[0] = '\0';
+            fclose(f);
+        }
+        if (madvise(r->ptr, r->mapped, MADV_HUGEPAGE) != 0 || strstr(thp, "[never]") || strstr(thp, "[deny]"))
+            printf("Transparent huge pages are off for shared memory; the region uses %ld KB pages.\n",
+                   r->pagesize >> 10);
+        else
+            printf("Asked for transparent huge pages on the region.\n");
+    }
+    return 0;
+}
+
+// Fault in every page of a newly created region by writing to it, and say how
+// it is backed. Call after any NUMA policy has been applied.
+static inline void region_prefault(struct region *r)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    // The region is freshly created and so all zero; writing zero keeps it that way.
+    for (size_t off = 0; off < r->mapped; off += r->pagesize)
+        ((volatile char *)r->ptr)[off] = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("Region is %zu KB on %ld KB %s pages, prefaulted in %.3f ms.\n",
+           r->mapped >> 10, r->pagesize >> 10, r->hugetlb ? "huge" : "small", ms);
+}
+
+// Open an existing region created by region_create(), following its pointer
+// if it is on huge pages. The mapping is populated up front. Prints an error
+// and returns -1 on failure.
+static inline int region_open(struct region *r, const char *name, size_t size)
+{
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->size = size;
+    r->pagesize = sysconf(_SC_PAGESIZE);
+    r->lock_fd = -1;
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror("shm_open");
+        return -1;
+    }
+    if (region_read_pointer(fd, r->path)) {
+        close(fd);
+        fd = open(r->path, O_RDWR);
+        struct statfs fs;
+        if (fd < 0 || fstatfs(fd, &fs) < 0) {
+            perror(r->path);
+            return -1;
+        }
+        r->hugetlb = 1;
+        r->pagesize = fs.f_bsize; // a hugetlbfs block is one huge page
+    }
+    r->mapped = region_round_up(size, r->pagesize);
+    r->ptr = mmap(0, r->mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (r->ptr == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    return 0;
+}
+
+#endif // REGION_H
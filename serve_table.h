@@ -0,0 +1,326 @@
+// serve_table.h
+// The event table of a one-loop server, shared by server_mux.c and server_sock.c.
+
+// server_mpi spreads its counters over a shard per worker thread, because many
+// threads report at once. A server whose one loop takes every message needs
+// none of that: a single event_table (see event_table.h) that only the loop
+// writes, and that a publisher thread copies out for ./stats. This is that
+// table, with everything a message can do to it: register, report, reset,
+// print, the requests that want a reply (see mpi_proto.h), and objects (see
+// object.h). What is left to each server is where messages come from and how
+// a reply gets back.
+//
+// Everything is printed through the server's async_out, and journaled if the
+// server set journal (see journal.h).
+//
+// NOTE: every server that includes this must be rebuilt if it changes.
+
+#ifndef SERVE_TABLE_H
+#define SERVE_TABLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "checksum.h"
+#include "mpi_proto.h"
+#include "event_table.h"
+#include "stats_segment.h"
+#include "journal.h"
+#include "async_out.h"
+#include "measure.h"
+#include "object.h"
+
+// What serve_message did with a message.
+#define SERVE_DONE 0   // handled
+#define SERVE_REPLY 1  // handled, and the server must send *r to *to
+#define SERVE_OTHER -1 // not one the table handles; up to the server
+
+struct serve_table {
+    struct event_table stats; // info and counters for all possible events
+    // Held by register, which is the only thing that adds slots or changes
+    // names, and by the publisher while it copies them (as in server_shmem.c).
+    pthread_mutex_t lock;
+    struct async_out *out;    // where everything is printed
+    struct journal *journal;  // durable log of table changes, or NULL
+
+    // Reports counted since the server started, and their payload sum. "print"
+    // measures from the first report after the previous print, and a measure
+    // token from the first report after the previous token (see measure.h).
+    int64_t reported;
+    int64_t reported_sum;
+    int64_t t_print_ns, print_reported, print_sum;
+    int64_t t_mark_ns;
+};
+
+// Print stats about all events. This only formats them into the output
+// buffers; they are written out behind the loop's back (see async_out.h).
+static inline void serve_print_stats(struct serve_table *t)
+{
+    out_printf(t->out, "%4s %15s %63s %10s %12s\n", "ID", "Name", "Description", "Count", "Sum");
+    for (uint32_t slot = 0; slot < event_slot_end(&t->stats.index); slot++) {
+        struct event_meta *meta = event_meta_at(&t->stats.meta, slot);
+        if (!event_registered(meta))
+            continue;
+        struct event_counter *c = event_counter_at(&t->stats.counters, slot);
+        out_printf(t->out, "%4lld %15s %63s %10lld %12lld\n", (long long)meta->id, meta->name, meta->description,
+                (long long)event_load_count(c), (long long)event_load_sum(c));
+    }
+}
+
+// Load the table recovered from the journal (see journal.h). Called before
+// the publisher starts.
+static inline void serve_restore(struct serve_table *t, struct journal *j)
+{
+    struct event_table *from_table = &j->shadow;
+    for (uint32_t from = 0; from < event_slot_end(&from_table->index); from++) {
+        struct event_meta *m = event_meta_at(&from_table->meta, from);
+        struct event_counter *c = event_counter_at(&from_table->counters, from);
+        uint32_t slot = event_table_add(&t->stats, event_registered(m) ? m->id : from);
+        if (slot == EVENT_SLOT_NONE)
+            continue;
+        *event_meta_at(&t->stats.meta, slot) = *m;
+        atomic_store(&event_counter_at(&t->stats.counters, slot)->count, event_load_count(c));
+        atomic_store(&event_counter_at(&t->stats.counters, slot)->sum, event_load_sum(c));
+    }
+}
+
+// Publish the table in s every interval, forever. The server runs this in a
+// thread of its own, so readers of the segment never cost the loop anything.
+static inline void serve_publish(struct serve_table *t, struct stats_segment *s)
+{
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        stats_publish_wait(s, &next);
+        pthread_mutex_lock(&t->lock);
+        uint32_t end = event_slot_end(&t->stats.index);
+        struct stats_row *rows = stats_publish_begin(s, end);
+        uint32_t n = 0;
+        for (uint32_t slot = 0; rows != NULL && slot < end; slot++) {
+            struct event_meta *meta = event_meta_at(&t->stats.meta, slot);
+            if (!event_registered(meta))
+                continue;
+            struct event_counter *c = event_counter_at(&t->stats.counters, slot);
+            stats_publish_row(&rows[n++], meta, event_load_count(c), event_load_sum(c));
+        }
+        if (rows != NULL)
+            stats_publish_end(s, n);
+        pthread_mutex_unlock(&t->lock);
+    }
+}
+
+
+// Register a new event type from data, which holds a name and a description
+// separated by a space and terminated with a NUL character. Returns 0, or -1
+// if the event type can't be registered.
+static inline int serve_register(struct serve_table *t, int eventid, int datasize, char *data)
+{
+    if (datasize < 1 || data[datasize-1] != '\0') {
+        out_printf(t->out, "ERROR: can't register event ID %d, data is missing NUL terminator\n", eventid);
+        return -1;
+    }
+    // Parse the data before taking a slot, so bad data can't use one up.
+    struct event_meta parsed = { 0 };
+    if (event_register(&parsed, eventid, data) < 0)
+        return -1;
+    pthread_mutex_lock(&t->lock);
+    uint32_t slot = event_table_add(&t->stats, eventid);
+    struct event_meta *meta = NULL;
+    if (slot != EVENT_SLOT_NONE) {
+        meta = event_meta_at(&t->stats.meta, slot);
+        *meta = parsed;
+    }
+    pthread_mutex_unlock(&t->lock);
+    if (meta == NULL)
+        return -1;
+    if (t->journal != NULL)
+        journal_register(t->journal, eventid, meta);
+    out_printf(t->out, "Registered new event type: ID=%d name='%s' description='%s'\n",
+            eventid, meta->name, meta->description);
+    return 0;
+}
+
+// The counters for eventid, or NULL (after printing an error) if it was never registered.
+static inline struct event_counter *serve_counter(struct serve_table *t, int eventid, const char *what)
+{
+    uint32_t slot = event_slot(&t->stats.index, eventid);
+    if (slot == EVENT_SLOT_NONE) {
+        out_printf(t->out, "ERROR: can't %s event ID %d\n", what, eventid);
+        out_flush(t->out);
+        return NULL;
+    }
+    return event_counter_at(&t->stats.counters, slot);
+}
+
+// Count one report with the given payload sum.
+static inline void serve_report(struct serve_table *t, int eventid, int64_t sum)
+{
+    struct event_counter *c = serve_counter(t, eventid, "report");
+    if (c == NULL)
+        return;
+    if (t->t_print_ns == 0 || t->t_mark_ns == 0) {
+        int64_t now = measure_now_ns();
+        if (t->t_print_ns == 0)
+            t->t_print_ns = now;
+        if (t->t_mark_ns == 0)
+            t->t_mark_ns = now;
+    }
+    event_count(c, sum);
+    t->reported++;
+    t->reported_sum += sum;
+    if (t->journal != NULL)
+        journal_report(t->journal, eventid, sum);
+}
+
+static inline void serve_reset(struct serve_table *t, int eventid)
+{
+    struct event_counter *c = serve_counter(t, eventid, "reset");
+    if (c == NULL)
+        return;
+    atomic_store_explicit(&c->count, 0, memory_order_relaxed);
+    if (t->journal != NULL)
+        journal_reset(t->journal, eventid);
+}
+
+// Print statistics and throughput since the first report after the previous
+// print, then start a new measurement.
+static inline void serve_print_measurement(struct serve_table *t)
+{
+    double secs = (measure_now_ns() - t->t_print_ns) / 1e9;
+    int64_t n = t->reported - t->print_reported;
+    serve_print_stats(t);
+    out_printf(t->out, "Elapsed time: %0.6f seconds\n", t->t_print_ns ? secs : 0.0);
+    out_printf(t->out, "number of report IPC messages received %lld\n", (long long)n);
+    if (t->t_print_ns != 0) {
+        out_printf(t->out, "throughput is %f report IPC messages per second\n", n / secs);
+        out_printf(t->out, "throughput is %f MB/second\n", ((t->reported_sum - t->print_sum) / 1000000.0) / secs);
+    }
+    t->t_print_ns = 0;
+    t->print_reported = t->reported;
+    t->print_sum = t->reported_sum;
+}
+
+// Fill in the event's details and totals, with status -1 if it isn't registered.
+static inline void serve_describe(struct serve_table *t, int eventid, struct ipcreply *r)
+{
+    uint32_t slot = event_slot(&t->stats.index, eventid);
+    r->status = -1;
+    if (slot != EVENT_SLOT_NONE) {
+        struct event_meta *em = event_meta_at(&t->stats.meta, slot);
+        struct event_counter *c = event_counter_at(&t->stats.counters, slot);
+        r->status = event_registered(em) ? 0 : -1;
+        r->count = event_load_count(c);
+        r->sum = event_load_sum(c);
+        memcpy(r->name, em->name, sizeof(r->name));
+        memcpy(r->description, em->description, sizeof(r->description));
+    }
+}
+
+// Count an object (msgtype 11): add up the payload of the memfd fd in place,
+// without copying it (see object.h). Returns 0, or -1 if it can't be read.
+static inline int serve_object(struct serve_table *t, int fd, int eventid)
+{
+    size_t size;
+    const char *p = (fd >= 0) ? object_map(fd, &size) : NULL;
+    if (p == NULL) {
+        out_printf(t->out, "ERROR: can't read object for event ID %d: %s\n", eventid,
+                fd < 0 ? "no descriptor attached" : strerror(errno));
+        return -1;
+    }
+    serve_report(t, eventid, payload_sum(p, size));
+    object_unmap(p, size);
+    return 0;
+}
+
+// Apply the nrecords reports packed into a msgtype 5 message.
+static inline void serve_report_batch(struct serve_table *t, int nrecords, int datasize, char *data)
+{
+    int used = 0;
+    for (int i = 0; i < nrecords; i++) {
+        // Compare against the bytes left, never by adding to used, which
+        // a huge size would overflow.
+        struct batch_record *r = (struct batch_record *)(data + used);
+        int left = datasize - used;
+        if (left < (int)sizeof(struct batch_record) || r->size < 0 ||
+            (size_t)r->size > (size_t)left - sizeof(struct batch_record)) {
+            out_printf(t->out, "ERROR: report batch is truncated after %d of %d records\n", i, nrecords);
+            break;
+        }
+        serve_report(t, r->eventid, payload_sum(r->data, r->size));
+        used += BATCH_RECORD_SIZE(r->size);
+    }
+}
+
+// Answer a request that wants a reply (msgtype 6 to 9, see mpi_proto.h, or an
+// object, whose memfd is fd; see object.h), filling in *to and *r.
+// Everything ahead of it from the same sender has been applied already, since
+// the loop handles each sender's messages in order. Returns SERVE_REPLY, or
+// SERVE_DONE if the request has nowhere to reply to.
+static inline int serve_request(struct serve_table *t, struct ipcmsg *m, int datasize, int fd,
+        struct reply_to *to, struct ipcreply *r)
+{
+    if (datasize < (int)sizeof(*to)) {
+        out_printf(t->out, "ERROR: msgtype %ld request is missing its reply_to header\n", m->msgtype);
+        return SERVE_DONE;
+    }
+    memcpy(to, m->data, sizeof(*to));
+    memset(r, 0, sizeof(*r));
+    if (m->msgtype == 6) {
+        r->status = serve_register(t, m->eventid, datasize - sizeof(*to), m->data + sizeof(*to));
+    } else if (m->msgtype == 11) {
+        r->status = serve_object(t, fd, m->eventid);
+        if (r->status == 0)
+            serve_describe(t, m->eventid, r);
+    } else {
+        if (m->msgtype == 9) {
+            r->done_ns = measure_now_ns();
+            r->first_ns = t->t_mark_ns;
+            t->t_mark_ns = 0;
+        }
+        serve_describe(t, m->eventid, r);
+    }
+    return SERVE_REPLY;
+}
+
+// Handle one message, whose payload (as mailbox_recv counts it, without the
+// msgtype) is msgsize bytes, and whose attached descriptor, if any, is fd.
+// Returns SERVE_REPLY if *r must go back to *to, and SERVE_OTHER, having done
+// nothing, for a msgtype the table doesn't know. Anything else it prints is
+// queued (see async_out.h) before it returns, except after a report.
+static inline int serve_message(struct serve_table *t, struct ipcmsg *m, int msgsize, int fd,
+        struct reply_to *to, struct ipcreply *r)
+{
+    int datasize = msgsize - MSG_PAYLOAD_SIZE(0);
+    int status = SERVE_DONE;
+    if (datasize < 0) {
+        out_printf(t->out, "ERROR: message of %d bytes is too short\n", msgsize);
+        return SERVE_DONE;
+    }
+    if (m->msgtype == 2) {
+        serve_report(t, m->eventid, payload_sum(m->data, datasize)); // report event occurrence
+        return SERVE_DONE;
+    } else if (m->msgtype == 5) {
+        serve_report_batch(t, m->eventid, datasize, m->data); // many reports at once
+        return SERVE_DONE;
+    }
+    if (m->msgtype == 1) {
+        serve_register(t, m->eventid, datasize, m->data); // register event type
+    } else if (m->msgtype == 3) {
+        serve_reset(t, m->eventid); // reset event counter
+    } else if (m->msgtype == 4) {
+        serve_print_measurement(t);
+    } else if ((m->msgtype >= 6 && m->msgtype <= 9) || m->msgtype == 11) {
+        status = serve_request(t, m, datasize, fd, to, r); // register-sync, query, sync, measure, or object
+    } else {
+        return SERVE_OTHER;
+    }
+    out_flush(t->out); // queue whatever that printed, without waiting for it
+    return status;
+}
+
+#endif // SERVE_TABLE_H
@@ -51,32 +51,144 @@ Throughput is 111.688310 MB/second
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/mman.h>
 
-struct shared_stuff 
-{
-    int in;
-    int out;
-    int buffer [1024*1024];
-    int totalValue;
-};
+#include "bb_ring.h"
+#include "shm_wait.h"
+#include "placement.h"
+#include "region.h"
+#include "checksum.h"
+
+// Most slots the server drains before handing them back to the client. Large
+// enough to amortize the release store, small enough that the client never
+// waits long for space when the ring is full.
+#define DRAIN_MAX 16384
 
 // Global variables
-char *name = NULL; // name of the shared memory region
+struct region region; // the shared memory region, once created
+int region_created = 0;
 
 // This function gets invoked whenever the user presses Control-C.
 void cleanup(int s) {
 
     // Remove the shared memory region.
     
-    if (name != NULL)
-        shm_unlink(name);
+    if (region_created)
+        region_remove(&region);
     exit(1); 
 }
 
+// Answer the client's completion token, if everything up to it has been
+// drained (see bb_ring.h). *first_ns is when the first drain since the last
+// token started, and starts over.
+void answer_token(struct bb_consumer *r, int64_t *first_ns, int64_t total, int64_t items)
+{
+    uint32_t token = bb_token_due(r);
+    if (token == 0)
+        return;
+    struct shared_stuff *p = r->p;
+    p->ack.done_ns = measure_now_ns();
+    p->ack.first_ns = *first_ns;
+    p->ack.processed = items;
+    p->ack.sum = total;
+    bb_ack_token(r, token);
+    shm_wake(&p->acked, &p->acked_waiters);
+    *first_ns = 0;
+}
+
+// Drain one int per slot, adding each one to totalValue.
+void consume_ints(struct shared_stuff *p, struct shm_waiter *waiter)
+{
+    struct bb_consumer r;
+    bb_consumer_attach(&r, p);
+    int64_t total = 0;
+    int64_t items = 0;
+    int64_t first_ns = 0;
+    uint32_t got;
+    int *span;
+
+    while (1) 
+    {
+        //wait until buffer is NOT empty, then drain up to DRAIN_MAX items
+        //(stopping at the end of the buffer) before releasing them
+        while((span = bb_peek_n(&r, DRAIN_MAX, &got)) == NULL)
+        {
+            shm_wait_while_equal(waiter, &p->in, r.tail, &p->in_waiters);
+        }
+        if (first_ns == 0)
+            first_ns = measure_now_ns();
+        for (uint32_t i = 0; i < got; i++)
+            total += span[i];
+        bb_advance(&r, got);
+        items += got;
+        //only the consumer writes totalValue, so a relaxed store is enough;
+        //the release store of "out" in bb_release orders it for the client
+        atomic_store_explicit(&p->totalValue, total, memory_order_relaxed);
+        atomic_store_explicit(&p->totalRecords, items, memory_order_relaxed);
+        bb_release(&r);
+        shm_wake(&p->out, &p->out_waiters);
+        answer_token(&r, &first_ns, total, items);
+    }
+}
+
+// Drain variable-length records, adding up every payload byte in place (the
+// same checksum server_mpi.c computes for reports) into totalValue.
+void consume_records(struct shared_stuff *p, struct shm_waiter *waiter)
+{
+    struct bb_consumer r;
+    bb_consumer_attach(&r, p);
+    int64_t total = 0;
+    int64_t records = 0;
+    int64_t first_ns = 0;
+    uint32_t expected_seq = 0;
+    struct bb_record *rec;
+
+    while (1)
+    {
+        //wait until there is a record
+        while((rec = bb_msg_peek(&r)) == NULL)
+        {
+            shm_wait_while_equal(waiter, &p->in, r.tail, &p->in_waiters);
+        }
+        if (first_ns == 0)
+            first_ns = measure_now_ns();
+        //then drain everything that has been published before releasing
+        uint32_t drained = 0;
+        do
+        {
+            //a header the client got wrong can't be followed, so drop what came with it
+            uint32_t size;
+            if (bb_msg_size(&r, rec, &size) < 0)
+            {
+                uint32_t skipped = bb_msg_discard(&r);
+                printf("ERROR: dropped %u bytes of records after a malformed one (type %u, size %u)\n",
+                       skipped, rec->type, size);
+                drained += skipped;
+                continue;
+            }
+            //each new client starts numbering its records from 0
+            if (rec->seq != expected_seq && rec->seq != 0)
+            {
+                printf("ERROR: expected record %u but got record %u\n", expected_seq, rec->seq);
+            }
+            expected_seq = rec->seq + 1;
+            total += payload_sum((const char *)(rec + 1), size);
+            records++;
+            drained += bb_rec_span(size);
+            bb_msg_advance(&r, size);
+        } while (drained < DRAIN_MAX * sizeof(int) && (rec = bb_msg_peek(&r)) != NULL);
+        atomic_store_explicit(&p->totalValue, total, memory_order_relaxed);
+        atomic_store_explicit(&p->totalRecords, records, memory_order_relaxed);
+        bb_release(&r);
+        shm_wake(&p->out, &p->out_waiters);
+        answer_token(&r, &first_ns, total, records);
+    }
+}
+
 int main(int argc, char **argv)
 {
     // This next code registers a signal handler, so that if the user presses
@@ -89,58 +201,54 @@ int main(int argc, char **argv)
     sigIntHandler.sa_flags = 0;
     sigaction(SIGINT, &sigIntHandler, NULL);
 
-    if (argc != 2) {
-        printf("usage: %s <region_name>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        printf("usage: %s <region_name> [ ints | records ]\n", argv[0]);
+        printf("  ints (the default) carries one int per slot, for client_bb <count>.\n");
+        printf("  records carries variable-length records, for client_bb report <count> <size>.\n");
         printf("  You can use any name you like for the region, but\n");
         printf("  by convention the name is usually of the form: \"/something\"\n");
         printf("  and it must be unique to you (if another person has already\n");
         printf("  created that region, you won't be able to).\n");
         exit(1);
     }
-    name = argv[1];
+    char *name = argv[1];
+    uint32_t mode = BB_MODE_INTS;
+    if (argc == 3) {
+        if (!strcmp(argv[2], "records")) {
+            mode = BB_MODE_RECORDS;
+        } else if (strcmp(argv[2], "ints")) {
+            printf("Sorry, I don't know the mode '%s'\n", argv[2]);
+            exit(1);
+        }
+    }
 
-    int fd = shm_open(name, O_CREAT | O_RDWR, 0660);
-    if (fd < 0) 
+    placement_init(argv[0]);
+
+    // Create and map the region, on huge pages if IPC_HUGEPAGES asks for them.
+    if (region_create(&region, name, sizeof(struct shared_stuff)) < 0)
     {
-        perror("shm_open");
         printf("Can't create shared memory region.\n");
         return -1;
     }
+    region_created = 1;
     printf("Created shared memory region \"%s\".\n", name);
 
-    // "Truncate" the region so it is exactly the size we want
-    int err = ftruncate(fd, sizeof(struct shared_stuff));
-    if (err != 0) 
-    {
-        perror("ftruncate");
-        printf("Can't resize shared memory region.\n");
-        return -1;
-    }
+    // Place the pages, then fault them all in before any client starts timing.
+    placement_bind_region(region.ptr, region.mapped);
+    region_prefault(&region);
 
-    // Get a pointer to the start of the region.
-    void *ptr = mmap(0, sizeof(struct shared_stuff), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (ptr == MAP_FAILED) 
-    {
-        perror("mmap");
-        printf("Can't map shared memory region.\n");
-        return -1;
-    }
+    struct shared_stuff *p = (struct shared_stuff *)region.ptr;
+    bb_init(p, mode);
+    placement_report_region("The ring", p->bytes);
 
-    struct shared_stuff * volatile p = (struct shared_stuff *)ptr;
-    size_t size = sizeof(p->buffer) / sizeof(int);
-    
-    while (1) 
-    {
-        //wait until buffer is NOT empty
-        while(p->in == p->out)
-        {
-            //do nothing;
-            //usleep(15);
-        }
-        p->totalValue += p->buffer[p->out];
-        p->buffer[p->out] = 0;
-        p->out = ((p->out+1) % (size-1));
-    }
+    struct shm_waiter waiter;
+    shm_wait_init(&waiter);
+    printf("Using the %s wait strategy.\n", shm_wait_name(waiter.mode));
+
+    if (mode == BB_MODE_RECORDS)
+        consume_records(p, &waiter);
+    else
+        consume_ints(p, &waiter);
 
     cleanup(0);
     return 0;
@@ -9,8 +9,8 @@
 
 // This implements the server half of a toy event-logging system. The server
 // keeps statistics about the frequency and details of various "event"
-// occurrences. Each type of event will have an ID number (EID, a number from 0
-// to 1023), a short one-word name (up to 15 characters), and a longer
+// occurrences. Each type of event will have an ID number (EID, any int; 0 to
+// 1023 are the fast path, see event_table.h), a short one-word name (up to 15 characters), and a longer
 // description (up to 31 characters).
 // 
 // The server maintains a table, indexed by event type ID, containing:
@@ -113,32 +113,16 @@ Can't send IPC message.
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-// Every SystemV IPC message needs to be a struct that starts with a long
-// integer, followed by whatever other data you want. For the toy event-logging
-// system, we will use one field to tell the server what operation to do, a
-// second field to hold the event type ID, and a third field to hold other
-// information (like the name and description when creating a new event type).
-//
-// NOTE: If you change this struct, you need to change it in client_mpi.c too.
-struct ipcmsg {
-    // The first field must be of type "long", as required by SystemV IPC.
-    long msgtype;    // IPC message type (1 = register, 2 = report, 3 = reset, etc.)
-    int eventid;     // the event type ID
-    char data[0];    // other data (zero or more bytes)
-};
-// NOTE: the data array is declared here as an array of length zero. In the code
-// below, the actual size may be zero (if there is no data for the message) but
-// it will often be somze be some larger size.
-
-// A "message" is everything in the above struct.
-// For a message carrying n bytes of "other data", the total message size is:
-#define MSG_SIZE(n) (sizeof(struct ipcmsg) + (n))
-
-// The "payload" is everything in the above struct except the required first
-// long integer.
-// For a message carrying n bytes of "other data", the "payload sizeC" is:
-#define MSG_PAYLOAD_SIZE(n) (sizeof(struct ipcmsg) - sizeof(long) + (n))
+#include "checksum.h"
+#include "mpi_proto.h"
+#include "placement.h"
+#include "event_table.h"
+#include "stats_segment.h"
+#include "journal.h"
+#include "async_out.h"
 
 // The maximum message currently used is for "register" operation, which contains
 // at most 16 bytes for the name (up to 15 characters plus a space at the end),
@@ -147,30 +131,113 @@ struct ipcmsg {
 #define MAX_MSG_SIZE (10000000)
 #define MAX_MSG_PAYLOAD_SIZE (MAX_MSG_SIZE - sizeof(long))
 
+// A message the server sends itself to stop its other workers for a moment
+// (see quiesce). Clients never send it.
+#define MSG_BARRIER 13
 
-// This struct holds information and statistics for one event type.
-struct event_stats {
-    char *name;
-    char *description;
-    int count;
-    int sum;
-};
 
+// Event names and descriptions live in meta (see event_table.h). The
+// counters live in the shards below; what is printed for an event is the sum
+// over all shards minus its entry in base, which a register or reset sets to
+// the current sum (that way a reset never has to write into another thread's
+// shard).
+//
+// Every one of these is indexed by slot. A sparse event ID (outside 0 to
+// EVENT_IDS-1) finds its slot through ids, which register changes while
+// workers are reading it, so sparse lookups take index_lock for reading and
+// register takes it for writing. Dense IDs never touch the lock.
+//
+// Each worker thread counts reports in its own shard, so the report path never
+// writes memory that another thread writes. Shards are cache-line aligned so
+// neighbours in the shards[] array never false-share.
+#define CACHE_LINE 64
+#define MAX_WORKERS 64
+
+struct stats_shard {
+    _Alignas(CACHE_LINE) struct event_counters ev;
+    _Atomic int reported;        // reports received in the current measurement epoch
+    _Atomic long t_start_ns;     // time of the first report in that epoch
+    _Atomic int epoch;           // which epoch reported and t_start_ns belong to
+    _Atomic long t_mark_ns;      // time of the first report since the last measure token
+    _Atomic int mark;            // which token interval t_mark_ns belongs to
+};
 
 // Global variables
-struct event_stats stats[1024]; // table of info about all possible events
-int q = -1; // identifier for the IPC mailbox queue
-int reported = 0;
-int indexof = 0;
+struct event_metas meta;    // names and descriptions of all registered events
+struct event_counters base; // merged counters at each event's last register/reset
+struct event_index ids;     // slots of sparse event IDs
+pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER; // guards ids
+struct stats_shard shards[MAX_WORKERS]; // per-worker counters
+int nworkers = 1;
+_Atomic int epoch = 0; // bumped by every "print", which starts a new measurement
+_Atomic int mark = 0;  // bumped by every measure token (msgtype 9; see measure.h)
+pthread_mutex_t admin_lock = PTHREAD_MUTEX_INITIALIZER; // serializes register/reset/print
+pthread_mutex_t barrier_lock = PTHREAD_MUTEX_INITIALIZER; // guards the barrier state below (see quiesce)
+pthread_cond_t barrier_arrived = PTHREAD_COND_INITIALIZER;  // signalled when a worker stops for a barrier
+pthread_cond_t barrier_released = PTHREAD_COND_INITIALIZER; // broadcast when a barrier ends
+int barrier_running = 0; // a worker is waiting for all the others to stop
+long barrier_epoch = 0;  // bumped by every barrier
+int barrier_parked = 0;  // workers stopped for the barrier, or waiting to run their own
+struct mailbox mb = { .q = -1, .reply_q = -1 }; // the IPC mailbox queue
+int mailbox_created = 0;
+struct stats_segment published; // where the table is published for readers (see stats_segment.h)
+int published_created = 0;
+struct journal journal; // durable log of table changes, if IPC_JOURNAL is set (see journal.h)
+int journaling = 0;
+struct async_out out; // everything printed while serving goes through here (see async_out.h)
+
+
+// Add to a counter that only the calling thread writes.
+static inline void bump(_Atomic int *c, int delta) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+static inline long now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+// Sum of one slot's counters over all shards.
+int64_t merged_count(uint32_t slot) {
+    int64_t total = 0;
+    for (int w = 0; w < nworkers; w++)
+        total += event_load_count(event_counter_at(&shards[w].ev, slot));
+    return total;
+}
+
+int64_t merged_sum(uint32_t slot) {
+    int64_t total = 0;
+    for (int w = 0; w < nworkers; w++)
+        total += event_load_sum(event_counter_at(&shards[w].ev, slot));
+    return total;
+}
+
+// The slot for eventid, or EVENT_SLOT_NONE if it is a sparse ID that was never
+// registered. Dense IDs are looked up without locking.
+static inline uint32_t lookup_slot(int eventid) {
+    if (event_id_dense(eventid))
+        return eventid;
+    pthread_rwlock_rdlock(&index_lock);
+    uint32_t slot = event_slot(&ids, eventid);
+    pthread_rwlock_unlock(&index_lock);
+    return slot;
+}
 
 
-// Print stats about all events
+// Print stats about all events. This only formats them into the output
+// buffers; they are written out behind the receive loop's back (see async_out.h).
 void print_stats() {
-    printf("%4s %15s %31s %10s %10s\n", "ID", "Name", "Description", "Count","Sum");
-    for (int i = 0; i < 1024; i++) {
-        if (stats[i].name == NULL)
+    out_printf(&out, "%4s %15s %31s %10s %12s\n", "ID", "Name", "Description", "Count","Sum");
+    uint32_t end = event_slot_end(&ids); // register is locked out, so this stays put
+    for (uint32_t slot = 0; slot < end; slot++) {
+        struct event_meta *m = event_meta_at(&meta, slot);
+        if (!event_registered(m))
             continue;
-        printf("%4d %15s %31s %10d %10d\n", i, stats[i].name, stats[i].description, stats[i].count, stats[i].sum);
+        struct event_counter *b = event_counter_at(&base, slot);
+        out_printf(&out, "%4lld %15s %31s %10lld %12lld\n", (long long)m->id, m->name, m->description,
+                (long long)(merged_count(slot) - event_load_count(b)),
+                (long long)(merged_sum(slot) - event_load_sum(b)));
     }
 }
 
@@ -178,16 +245,24 @@ void print_stats() {
 // This function gets invoked whenever the user presses Control-C.
 void cleanup(int s) {
 
+    // Let output that is still being written finish first.
+    out_close(&out);
+
     // Remove the IPC mailbox queue.
-    if (q >= 0) {
-        if (msgctl(q, IPC_RMID, NULL) < 0) {
-            perror("msgctl");
+    if (mailbox_created) {
+        if (mailbox_remove(&mb) < 0) {
+            perror("remove");
             printf("Can't remove IPC mailbox queue.\n");
             exit(1);
         }
         printf("Removed IPC mailbox queue.\n");
     }
 
+    if (published_created)
+        stats_segment_remove(&published);
+    if (journaling)
+        journal_close(&journal);
+
     // Print a friendly message then exit.
     printf("Final event statistics...\n");
     print_stats();
@@ -195,30 +270,477 @@ void cleanup(int s) {
 }
 
 
+// Copy the table into the statistics segment. The caller holds admin_lock.
+void publish_stats() {
+    uint32_t end = event_slot_end(&ids);
+    struct stats_row *rows = stats_publish_begin(&published, end);
+    if (rows == NULL)
+        return; // keep the last snapshot
+    uint32_t n = 0;
+    for (uint32_t slot = 0; slot < end; slot++) {
+        struct event_meta *m = event_meta_at(&meta, slot);
+        if (!event_registered(m))
+            continue;
+        struct event_counter *b = event_counter_at(&base, slot);
+        stats_publish_row(&rows[n++], m, merged_count(slot) - event_load_count(b),
+                merged_sum(slot) - event_load_sum(b));
+    }
+    stats_publish_end(&published, n);
+}
+
+// Publish the table every IPC_STATS_MS, forever. Runs in its own thread, so
+// readers of the segment never cost the workers anything but the loads here.
+void *publisher_main(void *arg) {
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        stats_publish_wait(&published, &next);
+        pthread_mutex_lock(&admin_lock);
+        publish_stats();
+        pthread_mutex_unlock(&admin_lock);
+    }
+    return NULL;
+}
+
+
+// The slot for eventid, giving it one if it is a new sparse ID. The caller
+// holds admin_lock. Prints an error and returns EVENT_SLOT_NONE if the table
+// is full.
+uint32_t add_slot(int64_t eventid) {
+    uint32_t slot = lookup_slot(eventid);
+    if (slot != EVENT_SLOT_NONE)
+        return slot;
+    // A new sparse ID: give it storage in every shard, then publish it.
+    // Nobody else inserts (we hold admin_lock), so the next slot stays free.
+    uint32_t next = event_slot_end(&ids);
+    int ok = (event_metas_reserve(&meta, next) == 0 && event_counters_reserve(&base, next) == 0);
+    for (int w = 0; ok && w < nworkers; w++)
+        ok = (event_counters_reserve(&shards[w].ev, next) == 0);
+    if (ok) {
+        pthread_rwlock_wrlock(&index_lock);
+        slot = event_slot_add(&ids, eventid);
+        pthread_rwlock_unlock(&index_lock);
+    }
+    if (slot == EVENT_SLOT_NONE)
+        out_printf(&out, "ERROR: can't register event ID %lld, the event table is full\n", (long long)eventid);
+    return slot;
+}
+
+// Load the table recovered from the journal (see journal.h) into meta and
+// the first shard. Called before any worker starts. The recovered sum goes
+// into base too, as if a print had just taken it, so the first print's Sum
+// and MB/second cover only what arrives after the restart.
+void restore_journal() {
+    struct event_table *t = &journal.shadow;
+    for (uint32_t from = 0; from < event_slot_end(&t->index); from++) {
+        struct event_meta *m = event_meta_at(&t->meta, from);
+        struct event_counter *c = event_counter_at(&t->counters, from);
+        int64_t eventid = event_registered(m) ? m->id : from;
+        uint32_t slot = add_slot(eventid);
+        if (slot == EVENT_SLOT_NONE)
+            continue;
+        *event_meta_at(&meta, slot) = *m;
+        atomic_store(&event_counter_at(&shards[0].ev, slot)->count, event_load_count(c));
+        atomic_store(&event_counter_at(&shards[0].ev, slot)->sum, event_load_sum(c));
+        atomic_store(&event_counter_at(&base, slot)->sum, event_load_sum(c));
+    }
+}
+
+
 // Register a new event type by setting the name and description. The data array
 // should contain a name and a description, separated by a space and terminated
-// with a NUL character.
-void register_event_type(int eventid, int datasize, char *data) {
-    if (eventid < 0 || eventid >= 1024) {
-        printf("ERROR: can't register event ID %d\n", eventid);
+// with a NUL character. Returns 0, or -1 if the event type can't be registered.
+int register_event_type(int eventid, int datasize, char *data) {
+    if (datasize < 1 || data[datasize-1] != '\0') {
+        out_printf(&out, "ERROR: can't register event ID %d, data is missing NUL terminator\n", eventid);
+        return -1;
+    }
+    // Parse the data before taking a slot, so bad data can't use one up.
+    struct event_meta parsed = { 0 };
+    if (event_register(&parsed, eventid, data) < 0)
+        return -1;
+    uint32_t slot = add_slot(eventid);
+    if (slot == EVENT_SLOT_NONE)
+        return -1;
+    struct event_meta *m = event_meta_at(&meta, slot);
+    *m = parsed;
+    atomic_store(&event_counter_at(&base, slot)->count, merged_count(slot));
+    if (journaling) {
+        // Registering restarts the count here, but not in the other servers,
+        // so replaying a register leaves the count alone; say so explicitly.
+        journal_register(&journal, eventid, m);
+        journal_reset(&journal, eventid);
+    }
+    out_printf(&out, "Registered new event type: ID=%d name='%s' description='%s'\n",
+            eventid, m->name, m->description);
+    return 0;
+}
+
+
+// Put a barrier message (see quiesce) on our own queue, without waiting for
+// room. Returns -1 if the queue is full.
+int post_barrier(void) {
+    struct ipcmsg w = { MSG_BARRIER, 0 };
+    if (!mb.posix)
+        return msgsnd(mb.q, &w, MSG_PAYLOAD_SIZE(0), IPC_NOWAIT);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now); // a deadline already passed: fail at once if full
+    return mq_timedsend(mb.mq, (const char *)&w, MSG_SIZE(0), 0, &now);
+}
+
+// A worker took a barrier message: if a barrier is running, stop until it ends.
+// Everything this worker took before has been applied by now.
+void barrier_park(void) {
+    pthread_mutex_lock(&barrier_lock);
+    if (barrier_running) {
+        long e = barrier_epoch;
+        barrier_parked++;
+        pthread_cond_signal(&barrier_arrived);
+        while (barrier_running && barrier_epoch == e)
+            pthread_cond_wait(&barrier_released, &barrier_lock);
+        barrier_parked--;
+    }
+    pthread_mutex_unlock(&barrier_lock);
+}
+
+// Wait until every report taken off the queue before the print, sync, or
+// measure the calling worker is handling has been applied. Workers receive
+// without any lock, so one of them may have taken an earlier report and not
+// yet counted it. But the queue is first in, first out, so every earlier
+// report has at least left the queue, and a worker that has finished what it
+// took and stopped can't be holding one. So we put a barrier message on the
+// queue for each other worker (they may be blocked receiving), and wait until
+// all the others have stopped: on a barrier message, or waiting to run a
+// barrier of their own. Reports themselves never wait. The caller must not
+// hold admin_lock, which a stopping worker may need first.
+void quiesce(void) {
+    if (nworkers == 1)
         return;
+    pthread_mutex_lock(&barrier_lock);
+    barrier_parked++; // we count as stopped for a barrier already running
+    pthread_cond_signal(&barrier_arrived);
+    while (barrier_running)
+        pthread_cond_wait(&barrier_released, &barrier_lock);
+    barrier_parked--;
+    barrier_running = 1;
+    barrier_epoch++;
+    int posted = 0;
+    while (barrier_parked < nworkers - 1) {
+        if (posted < nworkers - 1) {
+            pthread_mutex_unlock(&barrier_lock);
+            while (posted < nworkers - 1 && post_barrier() == 0)
+                posted++;
+            pthread_mutex_lock(&barrier_lock);
+            if (barrier_parked >= nworkers - 1)
+                break;
+        }
+        if (posted < nworkers - 1) {
+            // The queue is full, so no one is blocked receiving; try again
+            // once the others have made some room.
+            struct timespec t;
+            clock_gettime(CLOCK_REALTIME, &t);
+            t.tv_nsec += 1000000;
+            if (t.tv_nsec >= 1000000000) {
+                t.tv_sec++;
+                t.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&barrier_arrived, &barrier_lock, &t);
+        } else {
+            pthread_cond_wait(&barrier_arrived, &barrier_lock);
+        }
+    }
+    barrier_running = 0; // leftover barrier messages are ignored, or stop a worker for a later barrier
+    pthread_cond_broadcast(&barrier_released);
+    pthread_mutex_unlock(&barrier_lock);
+}
+
+
+// Print statistics and throughput for the measurement that started with the
+// first report after the previous print, then start a new one.
+void print_measurement(int eventid) {
+    long t_end_ns = now_ns();
+    int current = atomic_load(&epoch);
+    int reported = 0;
+    long t_start_ns = 0;
+    for (int w = 0; w < nworkers; w++) {
+        if (atomic_load(&shards[w].epoch) != current)
+            continue;
+        reported += atomic_load(&shards[w].reported);
+        long t = atomic_load(&shards[w].t_start_ns);
+        if (t_start_ns == 0 || t < t_start_ns)
+            t_start_ns = t;
+    }
+    double t = (t_end_ns - t_start_ns) / 1e9;
+    print_stats(); // print statics about all events
+    out_printf(&out, "Elapsed time: %0.6f seconds\n", t);
+    out_printf(&out, "number of report IPC messages received %i\n", reported);
+    out_printf(&out, "throughput is %f report IPC messages per second\n", reported/t);
+    uint32_t slot = lookup_slot(eventid);
+    if (slot != EVENT_SLOT_NONE) {
+        struct event_counter *b = event_counter_at(&base, slot);
+        int64_t sum = merged_sum(slot);
+        out_printf(&out, "throughput is %f MB/second\n", ((sum - event_load_sum(b))/1000000.0)/t);
+        atomic_store(&b->sum, sum);
+    }
+    atomic_store(&epoch, current + 1);
+}
+
+
+// Time of the first report since the last measure token, or 0 if there has
+// been none, and start a new interval for the next token.
+long take_mark() {
+    int current = atomic_load(&mark);
+    long t_first_ns = 0;
+    for (int w = 0; w < nworkers; w++) {
+        if (atomic_load(&shards[w].mark) != current)
+            continue;
+        long t = atomic_load(&shards[w].t_mark_ns);
+        if (t_first_ns == 0 || t < t_first_ns)
+            t_first_ns = t;
+    }
+    atomic_store(&mark, current + 1);
+    return t_first_ns;
+}
+
+
+// Fill in the event's details and totals, with status -1 if it isn't registered.
+void describe_event(int eventid, struct ipcreply *r) {
+    uint32_t slot = lookup_slot(eventid);
+    r->status = -1;
+    if (slot != EVENT_SLOT_NONE) {
+        struct event_meta *em = event_meta_at(&meta, slot);
+        struct event_counter *b = event_counter_at(&base, slot);
+        r->status = event_registered(em) ? 0 : -1;
+        r->count = merged_count(slot) - event_load_count(b);
+        r->sum = merged_sum(slot) - event_load_sum(b);
+        memcpy(r->name, em->name, sizeof(r->name));
+        memcpy(r->description, em->description, sizeof(r->description));
     }
-    if (data[datasize-1] != '\0') {
-        printf("ERROR: can't register event ID %d, data is missing NUL terminator\n", eventid);
+}
+
+// Answer a request that wants a reply (msgtype 6 to 9; see mpi_proto.h).
+// The caller holds admin_lock, and for a sync or measure has already waited
+// for everything ahead of it to be applied (quiesce).
+void answer_request(struct ipcmsg *m, int datasize) {
+    struct reply_to to;
+    if (datasize < (int)sizeof(to)) {
+        out_printf(&out, "ERROR: msgtype %ld request is missing its reply_to header\n", m->msgtype);
         return;
     }
-    char *p = strchr(data, ' ');
-    if (p == NULL) {
-        printf("ERROR: can't register event ID %d, data is missing space separator\n", eventid);
+    memcpy(&to, m->data, sizeof(to));
+    struct ipcreply r;
+    memset(&r, 0, sizeof(r));
+    if (m->msgtype == 6) {
+        r.status = register_event_type(m->eventid, datasize - sizeof(to), m->data + sizeof(to));
+    } else {
+        if (m->msgtype == 9) {
+            r.done_ns = now_ns();
+            r.first_ns = take_mark();
+        }
+        describe_event(m->eventid, &r);
+    }
+    if (mailbox_reply(&mb, &to, &r) < 0)
+        out_printf(&out, "Can't reply to process %d: %s\n", to.pid, strerror(errno));
+}
+
+
+// Get shard "self" ready to apply reports: start a new measurement in it if a
+// print has happened since its last report, and note the time if a measure
+// token has.
+static inline void begin_reports(struct stats_shard *self) {
+    int current = atomic_load_explicit(&epoch, memory_order_relaxed);
+    if (atomic_load_explicit(&self->epoch, memory_order_relaxed) != current) {
+        atomic_store_explicit(&self->reported, 0, memory_order_relaxed);
+        atomic_store_explicit(&self->t_start_ns, now_ns(), memory_order_relaxed);
+        atomic_store_explicit(&self->epoch, current, memory_order_relaxed);
+    }
+    current = atomic_load_explicit(&mark, memory_order_relaxed);
+    if (atomic_load_explicit(&self->mark, memory_order_relaxed) != current) {
+        atomic_store_explicit(&self->t_mark_ns, now_ns(), memory_order_relaxed);
+        atomic_store_explicit(&self->mark, current, memory_order_relaxed);
+    }
+}
+
+// Count one occurrence of an event, with datasize bytes of report data, and
+// fill in its journal record. Returns 0, or -1 if the event ID is unknown.
+static inline int count_report(struct stats_shard *self, int eventid, const char *data, int datasize,
+                               struct journal_record *rec) {
+    uint32_t slot = lookup_slot(eventid);
+    if (slot == EVENT_SLOT_NONE) {
+        out_printf(&out, "ERROR: can't report event ID %d\n", eventid);
+        out_flush(&out);
+        return -1;
+    }
+    int64_t sum = payload_sum(data, datasize);
+    event_count(event_counter_at(&self->ev, slot), sum);
+    bump(&self->reported, 1);
+    rec->op = JOURNAL_REPORT;
+    rec->eventid = eventid;
+    rec->sum = sum;
+    return 0;
+}
+
+static inline void apply_report(struct stats_shard *self, int eventid, const char *data, int datasize) {
+    struct journal_record rec;
+    if (count_report(self, eventid, data, datasize, &rec) == 0 && journaling)
+        journal_append(&journal, &rec, sizeof(rec));
+}
+
+// Apply the nrecords reports packed into a msgtype 5 message, in one pass.
+// Their journal records are appended together, taking the journal's lock once.
+void apply_report_batch(struct stats_shard *self, int nrecords, int datasize, char *data) {
+    struct journal_record recs[256];
+    int used = 0, nrecs = 0;
+    for (int i = 0; i < nrecords; i++) {
+        // Compare against the bytes left, never by adding to used, which
+        // a huge size would overflow.
+        struct batch_record *r = (struct batch_record *)(data + used);
+        int left = datasize - used;
+        if (left < (int)sizeof(struct batch_record) || r->size < 0 ||
+            (size_t)r->size > (size_t)left - sizeof(struct batch_record)) {
+            out_printf(&out, "ERROR: report batch is truncated after %d of %d records\n", i, nrecords);
+            out_flush(&out);
+            break;
+        }
+        if (count_report(self, r->eventid, r->data, r->size, &recs[nrecs]) == 0)
+            nrecs++;
+        if (nrecs == 256) {
+            if (journaling)
+                journal_append(&journal, recs, sizeof(recs));
+            nrecs = 0;
+        }
+        used += BATCH_RECORD_SIZE(r->size);
+    }
+    if (nrecs > 0 && journaling)
+        journal_append(&journal, recs, nrecs * sizeof(struct journal_record));
+}
+
+// Apply the reports a bulk message (msgtype 12) describes, reading them out of
+// the client a chunk at a time into scratch (BULK_CHUNK bytes), then reply.
+void apply_bulk(struct stats_shard *self, struct ipcmsg *m, int datasize, char *scratch) {
+    struct reply_to to;
+    struct bulk_desc d;
+    if (datasize < (int)(sizeof(to) + sizeof(d))) {
+        out_printf(&out, "ERROR: bulk message is missing its reply_to header or descriptor\n");
+        out_flush(&out);
         return;
     }
-    *p = '\0';
-    p++;
-    stats[eventid].name = strdup(data);
-    stats[eventid].description = strdup(p);
-    stats[eventid].count = 0;
-    printf("Registered new event type: ID=%d name='%s' description='%s'\n",
-            eventid, stats[eventid].name, stats[eventid].description);
+    memcpy(&to, m->data, sizeof(to));
+    memcpy(&d, m->data + sizeof(to), sizeof(d));
+    struct ipcreply r;
+    memset(&r, 0, sizeof(r));
+    r.status = -1;
+    if (d.size < 0 || d.size > BULK_CHUNK || d.count < 0 || d.count > BULK_MAX_COUNT) {
+        out_printf(&out, "ERROR: bulk message has bad report size %d or count %lld\n", d.size, (long long)d.count);
+    } else if (lookup_slot(m->eventid) == EVENT_SLOT_NONE) {
+        out_printf(&out, "ERROR: can't report event ID %d\n", m->eventid); // once, not once per report
+    } else if (bulk_check(&d) < 0) {
+        out_printf(&out, "ERROR: process %d didn't send that bulk message: %s\n", d.pid, strerror(errno));
+    } else {
+        struct journal_record recs[256];
+        int nrecs = 0;
+        int64_t per_chunk = d.size ? BULK_CHUNK / d.size : d.count;
+        int64_t done = 0;
+        while (done < d.count) {
+            int64_t n = (d.count - done < per_chunk) ? d.count - done : per_chunk;
+            if (bulk_read(d.pid, d.addr + done * d.size, scratch, n * d.size) < 0) {
+                out_printf(&out, "ERROR: can't read bulk reports from process %d: %s\n", d.pid, strerror(errno));
+                break;
+            }
+            for (int64_t i = 0; i < n; i++) {
+                if (count_report(self, m->eventid, scratch + i * d.size, d.size, &recs[nrecs]) == 0)
+                    nrecs++;
+                if (nrecs == 256) {
+                    if (journaling)
+                        journal_append(&journal, recs, sizeof(recs));
+                    nrecs = 0;
+                }
+            }
+            done += n;
+        }
+        if (nrecs > 0 && journaling)
+            journal_append(&journal, recs, nrecs * sizeof(struct journal_record));
+        if (done == d.count) {
+            pthread_mutex_lock(&admin_lock);
+            describe_event(m->eventid, &r);
+            pthread_mutex_unlock(&admin_lock);
+        }
+    }
+    out_flush(&out);
+    if (mailbox_reply(&mb, &to, &r) < 0) {
+        out_printf(&out, "Can't reply to process %d: %s\n", to.pid, strerror(errno));
+        out_flush(&out);
+    }
+}
+
+
+// Handle a message that changes or reads the whole table, under admin_lock.
+void handle_admin(struct ipcmsg *m, int datasize) {
+    pthread_mutex_lock(&admin_lock);
+    if (m->msgtype == 1) {
+        register_event_type(m->eventid, datasize, m->data); // register event type
+    } else if (m->msgtype == 3) {
+        uint32_t slot = lookup_slot(m->eventid); // reset event counter
+        if (slot != EVENT_SLOT_NONE) {
+            atomic_store(&event_counter_at(&base, slot)->count, merged_count(slot));
+            if (journaling)
+                journal_reset(&journal, m->eventid);
+        }
+    } else if(m->msgtype == 4) { 
+        print_measurement(m->eventid);
+    } else if (m->msgtype >= 6 && m->msgtype <= 9) {
+        answer_request(m, datasize); // register-sync, query, sync, or measure
+    } else {
+        out_printf(&out, "Sorry, I don't know what to do for msgtype %ld.\n", m->msgtype);
+    }
+    out_flush(&out); // queue whatever that printed, without waiting for it
+    pthread_mutex_unlock(&admin_lock);
+}
+
+// Receive and handle messages forever, counting reports into shard "self".
+void serve(struct stats_shard *self) {
+    struct ipcmsg *m = (struct ipcmsg *)malloc(MAX_MSG_SIZE);
+    char *scratch = (char *)malloc(BULK_CHUNK); // where bulk reports are read into
+    while(1) {
+        int msgsize = mailbox_recv(&mb, m, MAX_MSG_PAYLOAD_SIZE);
+        if (msgsize < 0) {
+            perror("msgrecv");
+            printf("Can't receive IPC message.\n");
+            exit(1);
+        }
+
+        int datasize = msgsize - MSG_PAYLOAD_SIZE(0);
+
+        // if (datasize > 0)
+        //     printf("Received IPC message: msgsize=%d msgtype=%ld eventid=%d with %d bytes of data\n",
+        //             msgsize, m->msgtype, m->eventid, datasize);
+        // else
+        //     printf("Received IPC message: msgsize=%d msgtype=%ld eventid=%d with no data\n",
+        //             msgsize, m->msgtype, m->eventid);
+
+        if (m->msgtype == 2) {
+            begin_reports(self);
+            apply_report(self, m->eventid, m->data, datasize); // report event occurrence
+        } else if (m->msgtype == 5) {
+            begin_reports(self);
+            apply_report_batch(self, m->eventid, datasize, m->data); // many reports at once
+        } else if (m->msgtype == 12) {
+            begin_reports(self);
+            apply_bulk(self, m, datasize, scratch); // reports read straight from the client
+        } else if (m->msgtype == MSG_BARRIER) {
+            barrier_park(); // another worker's print, sync, or measure is waiting
+        } else {
+            // A print, sync, or measure covers everything sent before it.
+            if (m->msgtype == 4 || m->msgtype == 8 || m->msgtype == 9)
+                quiesce();
+            handle_admin(m, datasize);
+        }
+    }
+}
+
+void *worker_main(void *arg) {
+    serve((struct stats_shard *)arg);
+    return NULL;
 }
 
 
@@ -234,92 +756,92 @@ int main(int argc, char **argv)
     sigemptyset(&sigIntHandler.sa_mask);
     sigIntHandler.sa_flags = 0;
     sigaction(SIGINT, &sigIntHandler, NULL);
-    struct timespec t_end;
-    struct timespec t_start;
 
-    if (argc != 2) {
-        printf("usage: %s <mailbox_num>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        printf("usage: %s <mailbox_num> [threads]\n", argv[0]);
         printf("  You can use any positive number for the mailbox number\n");
         printf("  but it must be unique to you (if another person has already\n");
         printf("  created that mailbox queue, you won't be able to).\n");
+        printf("  A mailbox name of the form \"/something\" creates a POSIX message\n");
+        printf("  queue instead, sized by MQ_MAXMSG and MQ_MSGSIZE. A SystemV mailbox\n");
+        printf("  also takes key -<mailbox_num>, for replies to synchronous requests.\n");
+        printf("  With [threads] > 1, that many workers receive from the queue\n");
+        printf("  at once, each counting reports in its own shard of the table.\n");
+        exit(1);
+    }
+    // Flush every line, so the statistics show up promptly even when the
+    // output goes to a file or a pipe.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    // Placement is set before the worker threads start, so they inherit it.
+    placement_init(argv[0]);
+
+    if (argc == 3)
+        nworkers = atoi(argv[2]);
+    if (nworkers < 1 || nworkers > MAX_WORKERS) {
+        printf("number of threads must be between 1 and %d\n", MAX_WORKERS);
         exit(1);
     }
-    key_t key = atoi(argv[1]);
 
     // Initialize the event table to all zeros
-    for (int i = 0; i < 1024; i++) {
-        stats[i].name = NULL;
-        stats[i].description = NULL;
-        stats[i].count = -1;
-        stats[i].count = -1;
+    memset(&meta, 0, sizeof(meta));
+    memset(&base, 0, sizeof(base));
+    for (int w = 0; w < MAX_WORKERS; w++) {
+        atomic_store(&shards[w].epoch, -1);
+        atomic_store(&shards[w].mark, -1);
+    }
+
+    // Pick up where the last run left off, if journaling.
+    int status = journal_open(&journal);
+    if (status < 0)
+        exit(1);
+    if (status == 0) {
+        restore_journal();
+        if (journal_start_writer(&journal) < 0)
+            exit(1);
+        journaling = 1;
     }
 
     // Create (or open) the mailbox queue.
-    q = msgget(key, IPC_CREAT | 0660);
-    if (q < 0) {
-        perror("msgget");
+    if (mailbox_open(&mb, argv[1], 1) < 0) {
         printf("Can't create IPC mailbox queue.\n");
         exit(1);
     }
-    printf("Created IPC mailbox queue number %d.\n", key);
-
-    printf("Waiting to receive IPC messages.\n");
-    struct ipcmsg *m = (struct ipcmsg *)malloc(MAX_MSG_SIZE);
-    while(1) {
-        int desired_msgtype = 0; // 0 here means "any"
-        int recv_flags = 0;
-        int msgsize = msgrcv(q, m, MAX_MSG_PAYLOAD_SIZE, desired_msgtype, recv_flags);
-        if (msgsize < 0) {
-            perror("msgrecv");
-            printf("Can't receive IPC message.\n");
+    mailbox_created = 1;
+    if (mb.posix)
+        printf("Created POSIX message queue %s (up to %ld bytes per message).\n", argv[1], mb.msgsize);
+    else
+        printf("Created IPC mailbox queue number %s, with replies on queue number %d.\n",
+                argv[1], MAILBOX_REPLY_KEY(atoi(argv[1])));
+
+    long interval_ms = stats_interval_ms();
+    if (interval_ms > 0) {
+        if (stats_segment_create(&published, "mpi", argv[1], interval_ms) < 0)
+            exit(1);
+        published_created = 1;
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, publisher_main, NULL) != 0) {
+            printf("Can't start the statistics publisher thread.\n");
             exit(1);
         }
+        printf("Publishing statistics in %s every %ld ms.\n", published.name, interval_ms);
+    }
 
-        int datasize = msgsize - MSG_PAYLOAD_SIZE(0);
-
-        // if (datasize > 0)
-        //     printf("Received IPC message: msgsize=%d msgtype=%ld eventid=%d with %d bytes of data\n",
-        //             msgsize, m->msgtype, m->eventid, datasize);
-        // else
-        //     printf("Received IPC message: msgsize=%d msgtype=%ld eventid=%d with no data\n",
-        //             msgsize, m->msgtype, m->eventid);
-
-        if (m->msgtype == 1) {
-            register_event_type(m->eventid, datasize, m->data); // register event type
-        } else if (m->msgtype == 2) {
-            if(reported == 0)
-            {
-                clock_gettime(CLOCK_MONOTONIC, &t_start);
-            }
-            while(indexof < datasize)
-            {
-                stats[m->eventid].sum += m->data[indexof];
-                indexof++;
-            }
-            stats[m->eventid].count++; // report event occurrence
-            reported++;
-            indexof = 0;
-        } else if (m->msgtype == 3) {
-            stats[m->eventid].count = 0; // reset event counter
-        } else if(m->msgtype == 4) { 
-            clock_gettime(CLOCK_MONOTONIC, &t_end);
-            print_stats(); // print statics about all events
-            int seconds = t_end.tv_sec - t_start.tv_sec;
-            int nanoseconds = t_end.tv_nsec - t_start.tv_nsec;
-            double t = seconds + nanoseconds / 1e9;
-            printf("Elapsed time: %0.6f seconds\n", t);
-            printf("number of report IPC messages received %i\n", reported);
-            printf("throughput is %f report IPC messages per second\n", reported/t);
-            printf("throughput is %f MB/second\n", (stats[m->eventid].sum/1000000.0)/t);
-            stats[m->eventid].sum = 0;
-            reported = 0;
-        } else {
-            printf("Sorry, I don't know what to do for msgtype %ld.\n", m->msgtype);
+    printf("Using the %s payload checksum.\n", payload_sum_name());
+    if (out_open(&out, STDOUT_FILENO) < 0)
+        exit(1);
+    out_printf(&out, "Waiting to receive IPC messages with %d worker thread(s).\n", nworkers);
+    out_flush(&out);
+    for (int w = 1; w < nworkers; w++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, &shards[w]) != 0) {
+            printf("Can't start worker thread %d.\n", w);
+            exit(1);
         }
     }
+    serve(&shards[0]);
 
     printf("All done!\n");
     cleanup(0);
     return 0;
 }
-
@@ -0,0 +1,590 @@
+// server_mux.c
+// One event-logging server for every transport at once, driven by epoll.
+
+// server_mpi, server_shmem, and server_bb each serve one transport with a loop
+// of their own: a blocking msgrcv, or a spin (then futex sleep) on a word in
+// shared memory. Serving several at once used to take several processes, each
+// with its own table and each holding a core while it spun. This server keeps
+// one event table and takes messages from any mix of:
+//
+//   <mailbox_num>  a SystemV mailbox, as for server_mpi (replies go to
+//                  -mailbox_num). SystemV queues have no descriptor, so
+//                  they are polled with msgrcv(IPC_NOWAIT).
+//   /name          a POSIX message queue, as for server_mpi. On Linux a
+//                  queue is a descriptor, so epoll waits on it directly.
+//   shm:/name      a shared memory region for client_shmem. Its lanes are
+//                  scanned as server_shmem does, and clients wake the server
+//                  through an eventfd doorbell (see shmem_proto.h).
+//   sock:/path     a SOCK_SEQPACKET UNIX socket carrying the same messages as
+//                  a mailbox (see sock_proto.h). It also hands out the
+//                  doorbell eventfd, so a region needs a socket to have one.
+//
+// Every pass of the loop takes up to MUX_BUDGET messages from each source
+// (SOCK_BATCH, in one recvmmsg, from each socket connection), so a flood on
+// one can't starve the others, and then asks epoll what else is ready. While
+// work keeps arriving, epoll_wait is called with no timeout, so the loop never
+// sleeps. Once a pass finds nothing, the loop keeps polling for
+// IPC_MUX_POLL_US more (default 50) in case more is on its way, and only then
+// parks in epoll_wait. A parked server wakes for a POSIX queue or the socket
+// at once, for a region when a client writes the doorbell, and every
+// IPC_MUX_PARK_MS (default 1) regardless, to poll the SystemV mailboxes and
+// any region clients that have no doorbell. An idle server therefore uses
+// almost no CPU, where server_shmem's spin would hold a core.
+//
+// Reports from every source go into the same table, which is published for
+// ./stats as "mux" (named after the first source) and journaled if
+// IPC_JOURNAL is set, as for the other servers. The counters say how the
+// loop spent its time: passes, parks, and what woke it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+#include "checksum.h"
+#include "mpi_proto.h"
+#include "sock_proto.h"
+#include "shmem_proto.h"
+#include "placement.h"
+#include "stats_segment.h"
+#include "journal.h"
+#include "async_out.h"
+#include "serve_table.h"
+
+#define MAX_MSG_SIZE (10000000)
+#define MAX_MSG_PAYLOAD_SIZE (MAX_MSG_SIZE - sizeof(long))
+#define MUX_MAILBOXES 16 // most mailboxes one server takes
+#define MUX_BUDGET 64    // most messages taken from one source per pass
+#define MUX_EVENTS 64    // most epoll events handled per pass
+
+// What an epoll event is for: the kind in the top 32 bits of its data, and a
+// mailbox index or a descriptor in the bottom 32.
+#define MUX_MAILBOX 1
+#define MUX_LISTEN 2
+#define MUX_CONN 3
+#define MUX_DOORBELL 4
+#define MUX_TAG(kind, n) (((uint64_t)(kind) << 32) | (uint32_t)(n))
+
+// Where a message came from, so a reply can go back the same way.
+struct origin {
+    struct mailbox *mb; // the mailbox, or NULL
+    int sock;           // the socket connection, or -1
+    int fd;             // a descriptor passed with the message, or -1
+};
+
+// Global variables
+struct async_out out; // everything printed while serving goes through here (see async_out.h)
+struct serve_table table = { .lock = PTHREAD_MUTEX_INITIALIZER, .out = &out }; // see serve_table.h
+struct mailbox boxes[MUX_MAILBOXES];
+int nboxes = 0;
+int nsysv = 0; // how many of the mailboxes are SystemV, and so need polling
+const char *region_name = NULL; // shared memory region, if any
+struct shared_stuff *region = NULL;
+const char *sock_path = NULL; // listening socket, if any
+int listen_fd = -1;
+struct sock_batch batch; // packets taken from a connection in one call
+int doorbell_fd = -1; // eventfd the region's clients write (see shmem_proto.h)
+int epfd = -1;
+struct stats_segment published; // where the table is published for readers (see stats_segment.h)
+int published_created = 0;
+struct journal journal; // durable log of table changes, if IPC_JOURNAL is set (see journal.h)
+int journaling = 0;
+
+// How the loop spent its time.
+uint64_t passes = 0, parks = 0, doorbell_wakes = 0, timeouts = 0, fd_wakes = 0;
+
+
+// This function gets invoked whenever the user presses Control-C.
+void cleanup(int s) {
+
+    // Let output that is still being written finish first.
+    out_close(&out);
+
+    // Remove everything we created.
+    for (int i = 0; i < nboxes; i++)
+        mailbox_remove(&boxes[i]);
+    if (region_name != NULL)
+        shm_unlink(region_name);
+    if (sock_path != NULL)
+        unlink(sock_path);
+    if (published_created)
+        stats_segment_remove(&published);
+    if (journaling)
+        journal_close(&journal);
+
+    // Print a friendly message then exit.
+    printf("Loop: %llu passes, %llu parks; woken %llu times by a descriptor, %llu by the doorbell, %llu by the timeout.\n",
+            (unsigned long long)passes, (unsigned long long)parks, (unsigned long long)fd_wakes,
+            (unsigned long long)doorbell_wakes, (unsigned long long)timeouts);
+    printf("Final event statistics...\n");
+    serve_print_stats(&table);
+    exit(1);
+}
+
+void *publisher_main(void *arg) {
+    serve_publish(&table, &published);
+    return NULL;
+}
+
+
+// Send reply r to whoever sent the request.
+void reply(struct origin *from, const struct reply_to *to, struct ipcreply *r) {
+    int status;
+    if (from->sock >= 0) {
+        r->msgtype = to->pid;
+        r->token = to->token;
+        r->pid = getpid();
+        status = send(from->sock, r, sizeof(*r), MSG_DONTWAIT) < 0 ? -1 : 0;
+    } else {
+        status = mailbox_reply(from->mb, to, r);
+    }
+    if (status < 0)
+        out_printf(&out, "Can't reply to process %d: %s\n", to->pid, strerror(errno));
+}
+
+// Apply the reports a bulk message (msgtype 12) describes, reading them out of
+// the client a chunk at a time (see mpi_proto.h), then reply.
+void apply_bulk(struct origin *from, struct ipcmsg *m, int datasize) {
+    static char *scratch = NULL;
+    struct reply_to to;
+    struct bulk_desc d;
+    if (datasize < (int)(sizeof(to) + sizeof(d))) {
+        out_printf(&out, "ERROR: bulk message is missing its reply_to header or descriptor\n");
+        return;
+    }
+    memcpy(&to, m->data, sizeof(to));
+    memcpy(&d, m->data + sizeof(to), sizeof(d));
+    if (scratch == NULL)
+        scratch = (char *)malloc(BULK_CHUNK);
+    struct ipcreply r;
+    memset(&r, 0, sizeof(r));
+    r.status = -1;
+    if (d.size < 0 || d.size > BULK_CHUNK || d.count < 0 || d.count > BULK_MAX_COUNT) {
+        out_printf(&out, "ERROR: bulk message has bad report size %d or count %lld\n", d.size, (long long)d.count);
+    } else if ((from->sock >= 0 && sock_peer_pid(from->sock) != d.pid) || bulk_check(&d) < 0) {
+        out_printf(&out, "ERROR: process %d didn't send that bulk message\n", d.pid);
+    } else if (serve_counter(&table, m->eventid, "report") != NULL) {
+        int64_t per_chunk = d.size ? BULK_CHUNK / d.size : d.count;
+        int64_t done = 0;
+        while (done < d.count) {
+            int64_t n = (d.count - done < per_chunk) ? d.count - done : per_chunk;
+            if (bulk_read(d.pid, d.addr + done * d.size, scratch, n * d.size) < 0) {
+                out_printf(&out, "ERROR: can't read bulk reports from process %d: %s\n", d.pid, strerror(errno));
+                break;
+            }
+            for (int64_t i = 0; i < n; i++)
+                serve_report(&table, m->eventid, payload_sum(scratch + i * d.size, d.size));
+            done += n;
+        }
+        if (done == d.count)
+            serve_describe(&table, m->eventid, &r);
+    }
+    reply(from, &to, &r);
+}
+
+// Handle one message from a mailbox or the socket, whose payload (as
+// mailbox_recv counts it) is msgsize bytes.
+void handle_message(struct origin *from, struct ipcmsg *m, int msgsize) {
+    struct reply_to to;
+    struct ipcreply r;
+    int status = serve_message(&table, m, msgsize, from->fd, &to, &r);
+    if (status == SERVE_REPLY) {
+        reply(from, &to, &r);
+        return;
+    } else if (status == SERVE_DONE) {
+        return;
+    }
+    int datasize = msgsize - MSG_PAYLOAD_SIZE(0);
+    if (m->msgtype == 12) {
+        apply_bulk(from, m, datasize); // reports read straight from the client
+    } else if (m->msgtype == 10 && from->sock >= 0) {
+        memset(&r, 0, sizeof(r)); // the doorbell eventfd (see sock_proto.h)
+        r.status = doorbell_fd >= 0 ? 0 : -1;
+        if (sock_send_fd(from->sock, &r, sizeof(r), doorbell_fd, MSG_DONTWAIT) < 0)
+            out_printf(&out, "Can't send the doorbell: %s\n", strerror(errno));
+    } else {
+        out_printf(&out, "Sorry, I don't know what to do for msgtype %ld.\n", m->msgtype);
+    }
+    out_flush(&out); // queue whatever that printed, without waiting for it
+}
+
+
+// The value of each lane's "posted" counter when we last scanned its slots.
+uint32_t scanned[SHMEM_LANES];
+
+// Do every pending request in the region, as server_shmem does. Returns the
+// number done.
+int serve_region() {
+    struct shared_stuff *p = region;
+    uint32_t nlanes = atomic_load_explicit(&p->nlanes, memory_order_acquire);
+    int done = 0;
+    for (uint32_t i = 0; i < nlanes; i++) {
+        struct shmem_lane *lane = &p->lanes[i];
+        uint32_t posted = atomic_load_explicit(&lane->posted, memory_order_acquire);
+        if (posted == scanned[i])
+            continue;
+        scanned[i] = posted;
+        int completed = 0;
+        for (int s = 0; s < SHMEM_SLOTS; s++) {
+            struct shmem_slot *slot = &lane->slots[s];
+            uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if (seq == atomic_load_explicit(&slot->done, memory_order_relaxed))
+                continue;
+            if (slot->operation == 1) {
+                slot->data[99] = '\0'; // the slot's data field is 100 bytes; don't trust the client to end it
+                serve_register(&table, slot->eventid, strlen(slot->data) + 1, slot->data);
+                out_flush(&out);
+            } else if (slot->operation == 2) {
+                serve_report(&table, slot->eventid, 0); // shmem reports carry no data
+            } else if (slot->operation == 3) {
+                serve_print_stats(&table); // also print statistics, as server_shmem does
+                out_flush(&out);
+                serve_reset(&table, slot->eventid);
+            } else if (slot->operation == 4) {
+                // A completion token (see measure.h); totals are for every source.
+                struct measure_ack ack;
+                memcpy(&ack.token, slot->data, sizeof(ack.token));
+                ack.done_ns = measure_now_ns();
+                ack.first_ns = table.t_mark_ns;
+                ack.processed = table.reported;
+                ack.sum = table.reported_sum;
+                memcpy(slot->data, &ack, sizeof(ack));
+                table.t_mark_ns = 0;
+            } else {
+                out_printf(&out, "Sorry, I don't know what to do for operation %u.\n", slot->operation);
+                out_flush(&out);
+            }
+            // mark the slot done, ready for the next transaction
+            atomic_store_explicit(&slot->done, seq, memory_order_release);
+            completed = 1;
+            done++;
+        }
+        if (completed) {
+            atomic_fetch_add_explicit(&lane->completions, 1, memory_order_release);
+            shm_wake(&lane->completions, &lane->completion_waiters);
+        }
+    }
+    return done;
+}
+
+// Take up to MUX_BUDGET messages from every SystemV mailbox, without waiting.
+// Returns the number taken.
+int poll_sysv(struct ipcmsg *m) {
+    int done = 0;
+    for (int i = 0; i < nboxes; i++) {
+        if (boxes[i].posix)
+            continue;
+        struct origin from = { &boxes[i], -1, -1 };
+        for (int n = 0; n < MUX_BUDGET; n++) {
+            int msgsize = msgrcv(boxes[i].q, m, MAX_MSG_PAYLOAD_SIZE, 0, IPC_NOWAIT);
+            if (msgsize < 0)
+                break; // ENOMSG: empty
+            handle_message(&from, m, msgsize);
+            done++;
+        }
+    }
+    return done;
+}
+
+// Take up to MUX_BUDGET messages from a POSIX mailbox that epoll says is ready.
+int drain_posix(struct mailbox *mb, struct ipcmsg *m) {
+    struct origin from = { mb, -1, -1 };
+    int n;
+    for (n = 0; n < MUX_BUDGET; n++) {
+        ssize_t got = mq_receive(mb->mq, (char *)m, MAX_MSG_SIZE, NULL);
+        if (got < 0)
+            break; // EAGAIN: empty
+        handle_message(&from, m, got - sizeof(long));
+    }
+    return n;
+}
+
+// Take up to SOCK_BATCH packets from a socket connection that epoll says is
+// ready, in one recvmmsg, closing it when the client hangs up.
+int drain_conn(int fd) {
+    struct origin from = { NULL, fd, -1 };
+    int got = sock_recv_batch(fd, &batch, MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    int n;
+    for (n = 0; n < got; n++) {
+        int len = sock_batch_len(&batch, n);
+        if (len == 0)
+            break; // the client hung up
+        from.fd = sock_batch_fd(&batch, n);
+        if (len < 0)
+            out_printf(&out, "ERROR: dropped a packet longer than %d bytes\n", SOCK_MSG_MAX);
+        else
+            handle_message(&from, sock_batch_msg(&batch, n), len - (int)sizeof(long));
+        if (from.fd >= 0)
+            close(from.fd);
+    }
+    if (n < got || got < 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        close(fd);
+    }
+    return n;
+}
+
+// Add fd to the epoll set. Prints an error and returns -1 on failure.
+int watch(int fd, uint64_t tag) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+// Create the shared memory region for client_shmem at name.
+int open_region(const char *name) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0660);
+    if (fd < 0) {
+        perror("shm_open");
+        printf("Can't create shared memory region.\n");
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(struct shared_stuff)) != 0) {
+        perror("ftruncate");
+        printf("Can't resize shared memory region.\n");
+        return -1;
+    }
+    void *ptr = mmap(0, sizeof(struct shared_stuff), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        printf("Can't map shared memory region.\n");
+        return -1;
+    }
+    placement_bind_region(ptr, sizeof(struct shared_stuff));
+    region = (struct shared_stuff *)ptr;
+    memset(region, 0, sizeof(struct shared_stuff));
+    region_name = name;
+    printf("Created shared memory region \"%s\".\n", name);
+    return 0;
+}
+
+
+// Open the source named by arg (see the top of this file).
+int open_source(const char *arg) {
+    if (!strncmp(arg, "shm:", 4)) {
+        if (region != NULL) {
+            printf("Only one shared memory region is supported.\n");
+            return -1;
+        }
+        return open_region(arg + 4);
+    }
+    if (!strncmp(arg, "sock:", 5)) {
+        if (listen_fd >= 0) {
+            printf("Only one socket is supported.\n");
+            return -1;
+        }
+        if (sock_batch_init(&batch) < 0)
+            return -1;
+        listen_fd = sock_listen(arg + 5, SOCK_SEQPACKET);
+        if (listen_fd < 0) {
+            printf("Can't create socket %s.\n", arg + 5);
+            return -1;
+        }
+        sock_path = arg + 5;
+        printf("Listening on socket %s.\n", sock_path);
+        return watch(listen_fd, MUX_TAG(MUX_LISTEN, 0));
+    }
+    if (nboxes == MUX_MAILBOXES) {
+        printf("At most %d mailboxes are supported.\n", MUX_MAILBOXES);
+        return -1;
+    }
+    struct mailbox *mb = &boxes[nboxes];
+    if (mailbox_open(mb, arg, 1) < 0) {
+        printf("Can't create IPC mailbox queue %s.\n", arg);
+        return -1;
+    }
+    nboxes++;
+    if (!mb->posix) {
+        nsysv++;
+        printf("Created IPC mailbox queue number %s, with replies on queue number %d.\n", arg,
+                MAILBOX_REPLY_KEY(atoi(arg)));
+        return 0;
+    }
+    struct mq_attr attr = { 0 };
+    attr.mq_flags = O_NONBLOCK; // epoll says when to read; never block in mq_receive
+    mq_setattr(mb->mq, &attr, NULL);
+    printf("Created POSIX message queue %s (up to %ld bytes per message).\n", arg, mb->msgsize);
+    return watch(mb->mq, MUX_TAG(MUX_MAILBOX, nboxes - 1));
+}
+
+// The name the statistics segment goes by: the first source's name, without
+// its prefix or directories.
+const char *segment_label(const char *arg) {
+    const char *colon = strchr(arg, ':');
+    if (colon != NULL)
+        arg = colon + 1;
+    const char *slash = strrchr(arg, '/');
+    return slash != NULL ? slash + 1 : arg;
+}
+
+
+int main(int argc, char **argv)
+{
+    // This next code registers a signal handler, so that if the user presses
+    // Control-C, then we still have the chance to cleanup (i.e. delete the IPC
+    // mailbox queues, region, and socket).
+    struct sigaction sigIntHandler;
+    sigIntHandler.sa_handler = cleanup;
+    sigemptyset(&sigIntHandler.sa_mask);
+    sigIntHandler.sa_flags = 0;
+    sigaction(SIGINT, &sigIntHandler, NULL);
+    signal(SIGPIPE, SIG_IGN); // a client that hangs up before its reply is not our problem
+
+    if (argc < 2) {
+        printf("usage: %s <source> [source ...]\n", argv[0]);
+        printf("  Serves every source from one loop, into one event table. A source is:\n");
+        printf("    <mailbox_num>  a SystemV mailbox, for client_mpi (polled)\n");
+        printf("    /name          a POSIX message queue, for client_mpi\n");
+        printf("    shm:/name      a shared memory region, for client_shmem\n");
+        printf("    sock:/path     a UNIX socket carrying client_mpi's messages; it also\n");
+        printf("                   gives the region's clients their doorbell\n");
+        printf("  IPC_MUX_POLL_US (default 50) is how long to keep polling after the last\n");
+        printf("  message before sleeping; IPC_MUX_PARK_MS (default 1) is the longest sleep.\n");
+        exit(1);
+    }
+    // Flush every line, so the statistics show up promptly even when the
+    // output goes to a file or a pipe.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    placement_init(argv[0]);
+    long poll_ns = env_long("IPC_MUX_POLL_US", 50) * 1000;
+    int park_ms = env_long("IPC_MUX_PARK_MS", 1);
+
+    // Pick up where the last run left off, if journaling.
+    int status = journal_open(&journal);
+    if (status < 0)
+        exit(1);
+    if (status == 0) {
+        serve_restore(&table, &journal);
+        if (journal_start_writer(&journal) < 0)
+            exit(1);
+        journaling = 1;
+        table.journal = &journal;
+    }
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    for (int i = 1; i < argc; i++)
+        if (open_source(argv[i]) < 0)
+            cleanup(0);
+
+    // The region's doorbell: clients write it while we are parked.
+    if (region != NULL) {
+        if (listen_fd >= 0) {
+            doorbell_fd = eventfd(0, EFD_NONBLOCK);
+            if (doorbell_fd < 0 || watch(doorbell_fd, MUX_TAG(MUX_DOORBELL, 0)) < 0) {
+                perror("eventfd");
+                cleanup(0);
+            }
+            snprintf(region->doorbell_socket, sizeof(region->doorbell_socket), "%s", sock_path);
+            printf("Clients of %s get their doorbell from %s.\n", region_name, sock_path);
+        } else {
+            printf("No socket to give out a doorbell; %s is polled every %d ms when idle.\n",
+                    region_name, park_ms);
+        }
+    }
+
+    long interval_ms = stats_interval_ms();
+    if (interval_ms > 0) {
+        if (stats_segment_create(&published, "mux", segment_label(argv[1]), interval_ms) < 0)
+            cleanup(0);
+        published_created = 1;
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, publisher_main, NULL) != 0) {
+            printf("Can't start the statistics publisher thread.\n");
+            cleanup(0);
+        }
+        printf("Publishing statistics in %s every %ld ms.\n", published.name, interval_ms);
+    }
+
+    printf("Using the %s payload checksum.\n", payload_sum_name());
+    if (out_open(&out, STDOUT_FILENO) < 0)
+        cleanup(0);
+    out_printf(&out, "Waiting to receive messages from %d source(s).\n", argc - 1);
+    out_flush(&out);
+
+    struct ipcmsg *m = (struct ipcmsg *)malloc(MAX_MSG_SIZE);
+    struct epoll_event events[MUX_EVENTS];
+    int64_t t_idle_ns = 0; // when the loop last found nothing to do, or 0 if it did
+    while (1) {
+        passes++;
+        // Read the doorbell before scanning, so that any post we miss in this
+        // pass will have changed it by the time we decide to park.
+        uint32_t seen = region ? atomic_load_explicit(&region->doorbell, memory_order_acquire) : 0;
+        int worked = poll_sysv(m);
+        if (region != NULL)
+            worked += serve_region();
+
+        // Nothing this pass: keep polling for poll_ns, then park.
+        int timeout = 0;
+        if (worked)
+            t_idle_ns = 0;
+        else if (t_idle_ns == 0)
+            t_idle_ns = measure_now_ns();
+        else if (measure_now_ns() - t_idle_ns >= poll_ns)
+            timeout = (nsysv > 0 || region != NULL) ? park_ms : -1;
+        if (timeout != 0 && region != NULL) {
+            // Announce that we are parked before the last look at the doorbell,
+            // so a client either sees the flag or we see its ring (shmem_ring).
+            atomic_store_explicit(&region->doorbell_parked, 1, memory_order_seq_cst);
+            if (atomic_load_explicit(&region->doorbell, memory_order_seq_cst) != seen)
+                timeout = 0;
+        }
+        if (timeout != 0)
+            parks++;
+        int n = epoll_wait(epfd, events, MUX_EVENTS, timeout);
+        if (region != NULL)
+            atomic_store_explicit(&region->doorbell_parked, 0, memory_order_relaxed);
+        if (timeout != 0 && n == 0)
+            timeouts++;
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64;
+            int kind = tag >> 32, which = (uint32_t)tag;
+            if (timeout != 0 && kind == MUX_DOORBELL)
+                doorbell_wakes++;
+            else if (timeout != 0)
+                fd_wakes++;
+            if (kind == MUX_MAILBOX) {
+                worked += drain_posix(&boxes[which], m);
+            } else if (kind == MUX_CONN) {
+                worked += drain_conn(which);
+            } else if (kind == MUX_LISTEN) {
+                int fd = accept(listen_fd, NULL, NULL);
+                if (fd >= 0 && watch(fd, MUX_TAG(MUX_CONN, fd)) < 0)
+                    close(fd);
+            } else if (kind == MUX_DOORBELL) {
+                uint64_t count;
+                if (read(doorbell_fd, &count, sizeof(count)) < 0)
+                    continue; // already drained; the lanes are scanned next pass anyway
+            }
+        }
+        if (worked)
+            t_idle_ns = 0;
+    }
+
+    printf("All done!\n");
+    cleanup(0);
+    return 0;
+}
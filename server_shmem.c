@@ -9,8 +9,8 @@
 
 // This implements the server half of a toy event-logging system. The server
 // keeps statistics about the frequency and details of various "event"
-// occurrences. Each type of event will have an ID number (EID, a number from 0
-// to 1023), a short one-word name (up to 15 characters), and a longer
+// occurrences. Each type of event will have an ID number (EID, any int; 0 to
+// 1023 are the fast path, see event_table.h), a short one-word name (up to 15 characters), and a longer
 // description (up to 63 characters).
 // 
 // The server maintains a table, indexed by event type ID, containing:
@@ -77,67 +77,55 @@ Average round trip time is 0.000067
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
-// This struct will contain all the shared data. There is no required format,
-// and we can put anything we like into it. The idea is that a client can put
-// info into the operation, eventid, and data fields. The server will then
-// perform the action and reset the other fields back to zero.
-//
-// Shared memory does not have any built-in synchronization: the server and
-// client are both able to access all the fields, even while the other is busy
-// modifying the fields. The correct way to synchronize involves locks, mutexes,
-// semaphores, etc., to ensure that, for example, the server doesn't start a
-// deposit operation until _after_ the client has finished setting the
-// operation, eventid, and data fields.
-//
-// Since we don't know how to use locks, mutexes, or semaphores, we will use a
-// very simple synchronization protocol, as follows:
-//
-// * The client will not do anything until the operation is zero.
-// * Once the operation is zero, the client will then set the eventid and data,
-//   and finally the operation. The operation is the _last_ thing the client sets.
-//
-// * The server will not do anything until operation is non-zero.
-// * Once the operation is non-zero, the server will perform the operation, and
-//   set the operation back to zero. This indicates that the server is done with
-//   the transaction. 
-//
-// NOTE: If you change this struct, you need to change it in client_shmem.c too.
-struct shared_stuff {
-    int operation;  // requested operation (1 = register, 2 = report, 3 = reset, etc.)
-    int eventid;    // the event type ID
-    char data[100]; // other data (up to 100 bytes)
-};
+#include "shmem_proto.h"
+#include "placement.h"
+#include "event_table.h"
+#include "stats_segment.h"
+#include "journal.h"
+#include "async_out.h"
+#include "measure.h"
 
 // Global variables
-
-// This struct holds information and statistics for one event type.
-struct event_stats {
-    char *name;
-    char *description;
-    int count;
-};
-
-// Global variables
-struct event_stats stats[1024]; // table of info about all possible events
+struct event_table stats; // info and counters for all possible events (see event_table.h)
 char *name = NULL; // name of the shared memory region
+struct stats_segment published; // where the table is published for readers (see stats_segment.h)
+int published_created = 0;
+struct journal journal; // durable log of table changes, if IPC_JOURNAL is set (see journal.h)
+int journaling = 0;
+struct async_out out; // everything printed while serving goes through here (see async_out.h)
+// Held by register, which is the only thing that adds slots or changes names,
+// and by the publisher while it copies them. The receive loop's reports and
+// resets only touch counters, which are safe to read while they change.
+pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// Print stats about all events
+// Print stats about all events. This only formats them into the output
+// buffers; they are written out behind the receive loop's back (see async_out.h).
 void print_stats() {
-    printf("%4s %15s %63s %10s\n", "ID", "Name", "Description", "Count");
-    for (int i = 0; i < 1024; i++) {
-        if (stats[i].name == NULL)
+    out_printf(&out, "%4s %15s %63s %10s\n", "ID", "Name", "Description", "Count");
+    for (uint32_t slot = 0; slot < event_slot_end(&stats.index); slot++) {
+        struct event_meta *meta = event_meta_at(&stats.meta, slot);
+        if (!event_registered(meta))
             continue;
-        printf("%4d %15s %63s %10d\n", i, stats[i].name, stats[i].description, stats[i].count);
+        out_printf(&out, "%4lld %15s %63s %10lld\n", (long long)meta->id, meta->name, meta->description,
+                (long long)event_load_count(event_counter_at(&stats.counters, slot)));
     }
 }
 
 // This function gets invoked whenever the user presses Control-C.
 void cleanup(int s) {
 
+    // Let output that is still being written finish first.
+    out_close(&out);
+
     // Remove the shared memory region.
     if (name != NULL)
         shm_unlink(name);
+    if (published_created)
+        stats_segment_remove(&published);
+    if (journaling)
+        journal_close(&journal);
 
     // Print a friendly message then exit.
     printf("Final event statistics...\n");
@@ -149,21 +137,76 @@ void cleanup(int s) {
 // should contain a name and a description, separated by a space and terminated
 // with a NUL character.
 void register_event_type(int eventid, char *data) {
-    if (eventid < 0 || eventid >= 1024) {
-        printf("ERROR: can't register event ID %d\n", eventid);
+    // Parse the data before taking a slot, so bad data can't use one up.
+    data[99] = '\0'; // the slot's data field is 100 bytes; don't trust the client to end it
+    struct event_meta parsed = { 0 };
+    if (event_register(&parsed, eventid, data) < 0)
         return;
+    pthread_mutex_lock(&table_lock);
+    uint32_t slot = event_table_add(&stats, eventid);
+    struct event_meta *meta = NULL;
+    if (slot != EVENT_SLOT_NONE) {
+        meta = event_meta_at(&stats.meta, slot);
+        *meta = parsed;
     }
-    char *p = strchr(data, ' ');
-    if (p == NULL) {
-        printf("ERROR: can't register event ID %d, data is missing space separator\n", eventid);
-        return;
+    pthread_mutex_unlock(&table_lock);
+    if (meta != NULL && journaling)
+        journal_register(&journal, eventid, meta);
+    if (meta != NULL)
+        out_printf(&out, "Registered new event type: ID=%d name='%s' description='%s'\n",
+                eventid, meta->name, meta->description);
+}
+
+// Load the table recovered from the journal (see journal.h). Called before
+// the publisher starts.
+void restore_journal() {
+    struct event_table *t = &journal.shadow;
+    for (uint32_t from = 0; from < event_slot_end(&t->index); from++) {
+        struct event_meta *m = event_meta_at(&t->meta, from);
+        struct event_counter *c = event_counter_at(&t->counters, from);
+        uint32_t slot = event_table_add(&stats, event_registered(m) ? m->id : from);
+        if (slot == EVENT_SLOT_NONE)
+            continue;
+        *event_meta_at(&stats.meta, slot) = *m;
+        atomic_store(&event_counter_at(&stats.counters, slot)->count, event_load_count(c));
+        atomic_store(&event_counter_at(&stats.counters, slot)->sum, event_load_sum(c));
+    }
+}
+
+// Publish the table every IPC_STATS_MS, forever. Runs in its own thread, so
+// readers of the segment never cost the receive loop anything.
+void *publisher_main(void *arg) {
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        stats_publish_wait(&published, &next);
+        pthread_mutex_lock(&table_lock);
+        uint32_t end = event_slot_end(&stats.index);
+        struct stats_row *rows = stats_publish_begin(&published, end);
+        uint32_t n = 0;
+        for (uint32_t slot = 0; rows != NULL && slot < end; slot++) {
+            struct event_meta *meta = event_meta_at(&stats.meta, slot);
+            if (!event_registered(meta))
+                continue;
+            struct event_counter *c = event_counter_at(&stats.counters, slot);
+            stats_publish_row(&rows[n++], meta, event_load_count(c), event_load_sum(c));
+        }
+        if (rows != NULL)
+            stats_publish_end(&published, n);
+        pthread_mutex_unlock(&table_lock);
     }
-    *p = '\0';
-    p++;
-    stats[eventid].name = strdup(data);
-    stats[eventid].description = strdup(p);
-    printf("Registered new event type: ID=%d name='%s' description='%s'\n",
-            eventid, stats[eventid].name, stats[eventid].description);
+    return NULL;
+}
+
+// The counters for eventid, or NULL (after printing an error) if it was never registered.
+struct event_counter *lookup_counter(int eventid, const char *what) {
+    uint32_t slot = event_slot(&stats.index, eventid);
+    if (slot == EVENT_SLOT_NONE) {
+        out_printf(&out, "ERROR: can't %s event ID %d\n", what, eventid);
+        out_flush(&out);
+        return NULL;
+    }
+    return event_counter_at(&stats.counters, slot);
 }
 
 
@@ -189,6 +232,7 @@ int main(int argc, char **argv)
     }
 
     name = argv[1];
+    placement_init(argv[0]);
 
     int fd = shm_open(name, O_CREAT | O_RDWR, 0660);
     if (fd < 0) {
@@ -213,24 +257,116 @@ int main(int argc, char **argv)
         printf("Can't map shared memory region.\n");
         return -1;
     }
-    struct shared_stuff * volatile p = (struct shared_stuff *)ptr;
+    placement_bind_region(ptr, sizeof(struct shared_stuff));
+    struct shared_stuff *p = (struct shared_stuff *)ptr;
+    memset(p, 0, sizeof(struct shared_stuff));
+    placement_report_region("The shared region", p);
+    struct shm_waiter waiter;
+    shm_wait_init(&waiter);
+    printf("Using the %s wait strategy.\n", shm_wait_name(waiter.mode));
 
-    while (1) {
-        while (p->operation == 0) {
-            // do nothing
+    // Pick up where the last run left off, if journaling.
+    int status = journal_open(&journal);
+    if (status < 0)
+        return -1;
+    if (status == 0) {
+        restore_journal();
+        if (journal_start_writer(&journal) < 0)
+            return -1;
+        journaling = 1;
+    }
+
+    long interval_ms = stats_interval_ms();
+    if (interval_ms > 0) {
+        if (stats_segment_create(&published, "shmem", name, interval_ms) < 0)
+            return -1;
+        published_created = 1;
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, publisher_main, NULL) != 0) {
+            printf("Can't start the statistics publisher thread.\n");
+            return -1;
         }
-        //printf("Shared memory has changed: operation=%d eventid=%d\n", p->operation, p->eventid);
-        if (p->operation == 1) {
-            register_event_type(p->eventid, p->data); // register event type
-        } else if (p->operation == 2) {
-            stats[p->eventid].count++; // report event occurrence
-        } else if (p->operation == 3) {
-            print_stats(); // also print statistics, for debugging purposes.
-            stats[p->eventid].count = 0; // reset event counter
-        } else {
-            printf("Sorry, I don't know what to do for operation %d.\n", p->operation);
+        printf("Publishing statistics in %s every %ld ms.\n", published.name, interval_ms);
+    }
+
+    if (out_open(&out, STDOUT_FILENO) < 0)
+        return -1;
+
+    // The value of each lane's "posted" counter when we last scanned its slots.
+    uint32_t scanned[SHMEM_LANES] = { 0 };
+    // Reports applied since the server started, and when the first one after
+    // the last measure token was applied (0 if none has been yet).
+    int64_t reported = 0;
+    int64_t t_first_ns = 0;
+
+    while (1) {
+        // Read the doorbell before scanning, so that any post we miss in this
+        // pass will have changed it by the time we decide to wait.
+        uint32_t seen = atomic_load_explicit(&p->doorbell, memory_order_acquire);
+        uint32_t nlanes = atomic_load_explicit(&p->nlanes, memory_order_acquire);
+        int worked = 0;
+        for (uint32_t i = 0; i < nlanes; i++) {
+            struct shmem_lane *lane = &p->lanes[i];
+            uint32_t posted = atomic_load_explicit(&lane->posted, memory_order_acquire);
+            if (posted == scanned[i])
+                continue;
+            scanned[i] = posted;
+            int completed = 0;
+            for (int s = 0; s < SHMEM_SLOTS; s++) {
+                struct shmem_slot *slot = &lane->slots[s];
+                uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+                if (seq == atomic_load_explicit(&slot->done, memory_order_relaxed))
+                    continue;
+                //printf("Lane %u slot %d has changed: operation=%d eventid=%d\n", i, s, slot->operation, slot->eventid);
+                if (slot->operation == 1) {
+                    register_event_type(slot->eventid, slot->data); // register event type
+                    out_flush(&out);
+                } else if (slot->operation == 2) {
+                    struct event_counter *c = lookup_counter(slot->eventid, "report"); // report event occurrence
+                    if (c != NULL) {
+                        if (t_first_ns == 0)
+                            t_first_ns = measure_now_ns();
+                        event_count(c, 0);
+                        reported++;
+                        if (journaling)
+                            journal_report(&journal, slot->eventid, 0);
+                    }
+                } else if (slot->operation == 3) {
+                    print_stats(); // also print statistics, for debugging purposes.
+                    out_flush(&out); // queued, not written: the loop goes straight on
+                    struct event_counter *c = lookup_counter(slot->eventid, "reset"); // reset event counter
+                    if (c != NULL) {
+                        atomic_store_explicit(&c->count, 0, memory_order_relaxed);
+                        if (journaling)
+                            journal_reset(&journal, slot->eventid);
+                    }
+                } else if (slot->operation == 4) {
+                    // A completion token (see measure.h): everything the client
+                    // posted before it is done, so answer with our totals.
+                    struct measure_ack ack;
+                    memcpy(&ack.token, slot->data, sizeof(ack.token));
+                    ack.done_ns = measure_now_ns();
+                    ack.first_ns = t_first_ns;
+                    ack.processed = reported;
+                    ack.sum = 0; // reports carry no data here
+                    memcpy(slot->data, &ack, sizeof(ack));
+                    t_first_ns = 0;
+                } else {
+                    out_printf(&out, "Sorry, I don't know what to do for operation %u.\n", slot->operation);
+                    out_flush(&out);
+                }
+                // mark the slot done, ready for the next transaction
+                atomic_store_explicit(&slot->done, seq, memory_order_release);
+                completed = 1;
+            }
+            if (completed) {
+                atomic_fetch_add_explicit(&lane->completions, 1, memory_order_release);
+                shm_wake(&lane->completions, &lane->completion_waiters);
+                worked = 1;
+            }
         }
-        p->operation = 0; // reset the operation to be ready for the next transaction
+        if (!worked)
+            shm_wait_while_equal(&waiter, &p->doorbell, seen, &p->doorbell_waiters);
     }
 
     printf("All done!\n");
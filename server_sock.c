@@ -0,0 +1,295 @@
+// server_sock.c
+// Event-logging server over a UNIX domain socket, taking packets in batches.
+
+// This is server_mpi's event-logging server with a UNIX socket in place of
+// the mailbox (see sock_proto.h for the wire format, which is the mailbox's,
+// plus objects: payloads too big for a packet, passed as a memfd).
+// A message queue costs one system call per message on each side, which is
+// most of what a small report costs; here every recvmmsg takes up to
+// SOCK_BATCH packets, and client_sock sends its reports the same way with
+// sendmmsg.
+//
+// The socket is either:
+//
+//   seqpacket  (the default) connected, one connection per client. The
+//              connections are waited on with epoll, and each ready one is
+//              drained a batch at a time, so a flood on one connection can't
+//              starve the others.
+//   dgram      one socket for every client, so the loop is just a blocking
+//              recvmmsg. Replies go back to the address each packet came from.
+//
+// SOCK_BUF_KB sets SO_RCVBUF (see sock_proto.h). The table is published for
+// ./stats as "sock" and journaled if IPC_JOURNAL is set, as for the other
+// servers. On exit, the server says how many packets each call took.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+
+#include "checksum.h"
+#include "mpi_proto.h"
+#include "sock_proto.h"
+#include "placement.h"
+#include "stats_segment.h"
+#include "journal.h"
+#include "async_out.h"
+#include "serve_table.h"
+
+#define SOCK_EVENTS 64 // most epoll events handled per pass
+
+// Where a packet came from, so a reply can go back the same way.
+struct origin {
+    int sock;                       // the connection, or the datagram socket
+    const struct sockaddr_un *addr; // the sender, for a datagram socket, else NULL
+    socklen_t addrlen;
+    int fd;                         // a descriptor passed with the packet, or -1
+};
+
+// Global variables
+struct async_out out; // everything printed while serving goes through here (see async_out.h)
+struct serve_table table = { .lock = PTHREAD_MUTEX_INITIALIZER, .out = &out }; // see serve_table.h
+const char *sock_path = NULL; // the server's socket, once created
+int sock_type = SOCK_SEQPACKET;
+int server_fd = -1;
+int epfd = -1;
+struct sock_batch batch; // packets taken in one recvmmsg
+struct stats_segment published; // where the table is published for readers (see stats_segment.h)
+int published_created = 0;
+struct journal journal; // durable log of table changes, if IPC_JOURNAL is set (see journal.h)
+int journaling = 0;
+
+// How well the batching worked: packets received, and recvmmsg calls that got any.
+uint64_t packets = 0, calls = 0;
+
+
+// This function gets invoked whenever the user presses Control-C.
+void cleanup(int s) {
+
+    // Let output that is still being written finish first.
+    out_close(&out);
+
+    // Remove everything we created.
+    if (sock_path != NULL)
+        unlink(sock_path);
+    if (published_created)
+        stats_segment_remove(&published);
+    if (journaling)
+        journal_close(&journal);
+
+    // Print a friendly message then exit.
+    printf("Received %llu packets in %llu calls (%.1f per call).\n", (unsigned long long)packets,
+            (unsigned long long)calls, calls ? (double)packets / calls : 0.0);
+    printf("Final event statistics...\n");
+    serve_print_stats(&table);
+    exit(1);
+}
+
+void *publisher_main(void *arg) {
+    serve_publish(&table, &published);
+    return NULL;
+}
+
+// Handle one packet, whose payload (as mailbox_recv counts it, without the
+// msgtype) is msgsize bytes, and send its reply, if it wants one, back on its
+// connection or to its address.
+void handle_message(struct origin *from, struct ipcmsg *m, int msgsize) {
+    struct reply_to to;
+    struct ipcreply r;
+    int status = serve_message(&table, m, msgsize, from->fd, &to, &r);
+    if (status == SERVE_REPLY) {
+        r.msgtype = to.pid;
+        r.token = to.token;
+        r.pid = getpid();
+        if (sendto(from->sock, &r, sizeof(r), MSG_DONTWAIT, (const struct sockaddr *)from->addr, from->addrlen) < 0)
+            out_printf(&out, "Can't reply to process %d: %s\n", to.pid, strerror(errno));
+    } else if (status == SERVE_OTHER) {
+        out_printf(&out, "Sorry, I don't know what to do for msgtype %ld.\n", m->msgtype);
+        out_flush(&out);
+    }
+}
+
+// Handle the got packets just received on fd. Returns how many there were
+// before the first empty one on a connection, which means the peer hung up.
+int handle_batch(int fd, int got) {
+    struct origin from = { fd, NULL, 0, -1 };
+    int n;
+    for (n = 0; n < got; n++) {
+        int len = sock_batch_len(&batch, n);
+        if (len == 0 && sock_type != SOCK_DGRAM)
+            break;
+        if (sock_type == SOCK_DGRAM) {
+            from.addr = &batch.from[n];
+            from.addrlen = batch.hdrs[n].msg_hdr.msg_namelen;
+        }
+        from.fd = sock_batch_fd(&batch, n);
+        if (len < 0)
+            out_printf(&out, "ERROR: dropped a packet longer than %d bytes\n", SOCK_MSG_MAX);
+        else
+            handle_message(&from, sock_batch_msg(&batch, n), len - (int)sizeof(long));
+        if (from.fd >= 0)
+            close(from.fd);
+    }
+    if (n > 0) {
+        packets += n;
+        calls++;
+    }
+    return n;
+}
+
+// Serve the datagram socket: every client's packets arrive on it.
+void serve_dgram() {
+    while (1) {
+        int got = sock_recv_batch(server_fd, &batch, MSG_WAITFORONE);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("recvmmsg");
+            return;
+        }
+        handle_batch(server_fd, got);
+    }
+}
+
+// Take a batch of packets from a connection that epoll says is ready,
+// closing it when the client hangs up.
+void drain_conn(int fd) {
+    int got = sock_recv_batch(fd, &batch, MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (got < 0 || handle_batch(fd, got) < got) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        close(fd);
+    }
+}
+
+// Serve the listening socket and every connection accepted from it.
+void serve_seqpacket() {
+    struct epoll_event ev, events[SOCK_EVENTS];
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = server_fd;
+    epfd = epoll_create1(0);
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll");
+        return;
+    }
+    while (1) {
+        int n = epoll_wait(epfd, events, SOCK_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd != server_fd) {
+                drain_conn(fd);
+                continue;
+            }
+            int conn = accept(server_fd, NULL, NULL);
+            if (conn < 0)
+                continue;
+            ev.data.fd = conn;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn, &ev) < 0) {
+                perror("epoll_ctl");
+                close(conn);
+            }
+        }
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    // This next code registers a signal handler, so that if the user presses
+    // Control-C, then we still have the chance to cleanup (i.e. delete the
+    // socket).
+    struct sigaction sigIntHandler;
+    sigIntHandler.sa_handler = cleanup;
+    sigemptyset(&sigIntHandler.sa_mask);
+    sigIntHandler.sa_flags = 0;
+    sigaction(SIGINT, &sigIntHandler, NULL);
+    signal(SIGPIPE, SIG_IGN); // a client that hangs up before its reply is not our problem
+
+    if (argc != 2 && argc != 3) {
+        printf("usage: %s <socket_path> [ seqpacket | dgram ]\n", argv[0]);
+        printf("  seqpacket (the default) gives each client a connection; dgram shares\n");
+        printf("  one socket between them all. client_sock works with either.\n");
+        printf("  SOCK_BUF_KB sets the socket's receive buffer.\n");
+        printf("  You can use any path you like for the socket, but it must be unique\n");
+        printf("  to you (if another person has already created it, you won't be able to).\n");
+        exit(1);
+    }
+    if (argc == 3) {
+        if (!strcmp(argv[2], "dgram")) {
+            sock_type = SOCK_DGRAM;
+        } else if (strcmp(argv[2], "seqpacket")) {
+            printf("Sorry, I don't know the socket type '%s'\n", argv[2]);
+            exit(1);
+        }
+    }
+    // Flush every line, so the statistics show up promptly even when the
+    // output goes to a file or a pipe.
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    placement_init(argv[0]);
+    if (sock_batch_init(&batch) < 0)
+        exit(1);
+
+    // Pick up where the last run left off, if journaling.
+    int status = journal_open(&journal);
+    if (status < 0)
+        exit(1);
+    if (status == 0) {
+        serve_restore(&table, &journal);
+        if (journal_start_writer(&journal) < 0)
+            exit(1);
+        journaling = 1;
+        table.journal = &journal;
+    }
+
+    server_fd = sock_listen(argv[1], sock_type);
+    if (server_fd < 0) {
+        printf("Can't create socket %s.\n", argv[1]);
+        cleanup(0);
+    }
+    sock_path = argv[1];
+    printf("Created %s socket %s (receive buffer %d KB, up to %d packets per call).\n",
+            sock_type_name(sock_type), sock_path, sock_tune(server_fd, SO_RCVBUF) >> 10, SOCK_BATCH);
+
+    long interval_ms = stats_interval_ms();
+    if (interval_ms > 0) {
+        const char *label = strrchr(sock_path, '/');
+        if (stats_segment_create(&published, "sock", label != NULL ? label + 1 : sock_path, interval_ms) < 0)
+            cleanup(0);
+        published_created = 1;
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, publisher_main, NULL) != 0) {
+            printf("Can't start the statistics publisher thread.\n");
+            cleanup(0);
+        }
+        printf("Publishing statistics in %s every %ld ms.\n", published.name, interval_ms);
+    }
+
+    printf("Using the %s payload checksum.\n", payload_sum_name());
+    if (out_open(&out, STDOUT_FILENO) < 0)
+        cleanup(0);
+    out_printf(&out, "Waiting to receive messages.\n");
+    out_flush(&out);
+
+    if (sock_type == SOCK_DGRAM)
+        serve_dgram();
+    else
+        serve_seqpacket();
+
+    printf("All done!\n");
+    cleanup(0);
+    return 0;
+}
@@ -0,0 +1,180 @@
+// shm_wait.h
+// Wait strategies for the shared-memory transports (bb and shmem).
+
+// Every shared-memory wait in this project has the same shape: one side waits
+// for a 32-bit word in the shared region to change from a value it has already
+// seen (the ring index, or the mailbox "operation"), and the other side changes
+// that word and then tells the waiter about it. How the waiter passes the time
+// is chosen at startup through the IPC_WAIT environment variable:
+//
+//   IPC_WAIT=spin   - re-read the word in a tight loop (the original behavior).
+//   IPC_WAIT=pause  - same, but with a pause instruction in each iteration so
+//                     a sibling hyperthread gets the core's resources.
+//   IPC_WAIT=yield  - spin (with pause) for a bounded number of iterations,
+//                     then call sched_yield() until the word changes.
+//   IPC_WAIT=futex  - spin (with pause) for a bounded number of iterations,
+//                     then sleep in the kernel with futex(FUTEX_WAIT) until the
+//                     other side calls futex(FUTEX_WAKE). This is the default.
+//
+// For yield and futex, the spin bound adapts to the recent handoff latency. A
+// wait that succeeds while spinning feeds the number of iterations it took into
+// a moving average, and the bound tracks twice that average. A wait that had to
+// sleep is timed: if the other side answered within WAIT_SHORT_NS, spinning a
+// little longer would have avoided the syscall, so the bound grows; otherwise
+// the peer is idle, the bound shrinks, and we go to sleep sooner next time.
+// A busy server therefore stays on the spinning path and an idle one sleeps.
+//
+// The futex mode needs a second shared word per wait word: a count of sleeping
+// waiters. The waker checks it after publishing and only makes the FUTEX_WAKE
+// syscall when somebody is actually asleep.
+
+#ifndef SHM_WAIT_H
+#define SHM_WAIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define WAIT_SPIN 0
+#define WAIT_PAUSE 1
+#define WAIT_YIELD 2
+#define WAIT_FUTEX 3
+
+#define WAIT_SPIN_MIN 64           // spin bound never drops below this
+#define WAIT_SPIN_MAX (1 << 18)    // ... or grows above this
+#define WAIT_SHORT_NS 50000        // a sleep shorter than this was not worth it
+
+// Per-process wait state. Lives in private memory, one per waiting loop.
+struct shm_waiter
+{
+    int mode;            // WAIT_SPIN, WAIT_PAUSE, WAIT_YIELD, or WAIT_FUTEX
+    uint32_t spin_limit; // current bound on spin iterations before falling back
+    uint32_t avg_spins;  // moving average of iterations for waits won by spinning
+};
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline const char *shm_wait_name(int mode)
+{
+    static const char *names[] = { "spin", "pause", "yield", "futex" };
+    return names[mode];
+}
+
+// Pick the strategy named by IPC_WAIT (default futex).
+static inline void shm_wait_init(struct shm_waiter *w)
+{
+    const char *env = getenv("IPC_WAIT");
+    w->mode = WAIT_FUTEX;
+    if (env != NULL) {
+        int found = 0;
+        for (int m = WAIT_SPIN; m <= WAIT_FUTEX; m++) {
+            if (!strcmp(env, shm_wait_name(m))) {
+                w->mode = m;
+                found = 1;
+            }
+        }
+        if (!found)
+            printf("Unknown IPC_WAIT '%s', using %s.\n", env, shm_wait_name(w->mode));
+    }
+    w->spin_limit = WAIT_SPIN_MIN * 16;
+    w->avg_spins = WAIT_SPIN_MIN * 8;
+}
+
+static inline long futex(_Atomic uint32_t *word, int op, uint32_t val)
+{
+    // Not FUTEX_PRIVATE_FLAG: the word is shared between processes.
+    return syscall(SYS_futex, (uint32_t *)word, op, val, NULL, NULL, 0);
+}
+
+static inline uint64_t shm_wait_now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static inline void shm_wait_adapt(struct shm_waiter *w, uint32_t spins, int slept, uint64_t slept_ns)
+{
+    if (!slept) {
+        w->avg_spins = (w->avg_spins * 7 + spins) / 8;
+        uint32_t limit = 2 * w->avg_spins;
+        if (limit > w->spin_limit)
+            w->spin_limit = limit;
+        else
+            w->spin_limit = (w->spin_limit * 7 + limit) / 8;
+    } else if (slept_ns < WAIT_SHORT_NS) {
+        w->spin_limit *= 2;
+    } else {
+        w->spin_limit /= 2;
+    }
+    if (w->spin_limit < WAIT_SPIN_MIN)
+        w->spin_limit = WAIT_SPIN_MIN;
+    if (w->spin_limit > WAIT_SPIN_MAX)
+        w->spin_limit = WAIT_SPIN_MAX;
+}
+
+// Wait until *word is no longer equal to old. "waiters" is the sleeping-waiter
+// count that goes with word; it is only touched in futex mode.
+static inline void shm_wait_while_equal(struct shm_waiter *w, _Atomic uint32_t *word,
+                                        uint32_t old, _Atomic uint32_t *waiters)
+{
+    uint32_t spins = 0;
+    int slept = 0;
+    uint64_t slept_ns = 0;
+
+    while (atomic_load_explicit(word, memory_order_acquire) == old) {
+        if (w->mode == WAIT_SPIN)
+            continue;
+        if (w->mode == WAIT_PAUSE || spins < w->spin_limit) {
+            cpu_relax();
+            spins++;
+            continue;
+        }
+        if (w->mode == WAIT_YIELD) {
+            uint64_t t0 = shm_wait_now_ns();
+            sched_yield();
+            slept = 1;
+            slept_ns += shm_wait_now_ns() - t0;
+            continue;
+        }
+        // Announce ourselves before the final check, so the waker either sees
+        // the count or we see its new value (both sides use seq_cst here).
+        uint64_t t0 = shm_wait_now_ns();
+        atomic_fetch_add_explicit(waiters, 1, memory_order_seq_cst);
+        if (atomic_load_explicit(word, memory_order_seq_cst) == old)
+            futex(word, FUTEX_WAIT, old);
+        atomic_fetch_sub_explicit(waiters, 1, memory_order_seq_cst);
+        slept = 1;
+        slept_ns += shm_wait_now_ns() - t0;
+    }
+    if (w->mode >= WAIT_YIELD)
+        shm_wait_adapt(w, spins, slept, slept_ns);
+}
+
+// Call after changing *word (with a release store) to wake anybody sleeping on
+// it. Costs one fence and one load, plus a syscall only if someone is asleep.
+// This is done whatever our own mode is, so a futex-mode peer is never left
+// asleep by a spin-mode one.
+static inline void shm_wake(_Atomic uint32_t *word, _Atomic uint32_t *waiters)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed) != 0)
+        futex(word, FUTEX_WAKE, INT_MAX);
+}
+
+#endif // SHM_WAIT_H
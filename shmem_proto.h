@@ -0,0 +1,193 @@
+// shmem_proto.h
+// Layout of the shared memory region used by server_shmem.c and client_shmem.c.
+
+// This struct will contain all the shared data. The idea is that a client can
+// put info into the operation, eventid, and data fields of a mailbox slot. The
+// server will then perform the action and mark the slot as done.
+//
+// Shared memory does not have any built-in synchronization: the server and
+// client are both able to access all the fields, even while the other is busy
+// modifying the fields. We use a very simple synchronization protocol for each
+// mailbox slot, based on two sequence numbers, "seq" and "done":
+//
+// * The client will not touch a slot until done == seq (the slot is free).
+// * Once the slot is free, the client sets the operation, eventid, and data,
+//   and finally increments seq. Incrementing seq is the _last_ thing the client
+//   does (a release store, so the other fields are visible before it).
+//
+// * The server will not touch a slot until seq != done (a request is pending).
+// * Once a request is pending, the server performs the operation and then sets
+//   done = seq. This indicates that the server is done with the transaction.
+//
+// A client's mailbox ("lane") has SHMEM_SLOTS of these slots, so it can keep
+// up to that many requests in flight instead of waiting a full round trip for
+// each one. The server may complete them in any order. After completing
+// requests on a lane it bumps the lane's "completions" counter, which the
+// client waits on when it has nothing else to do.
+//
+// To let many clients have a request in flight at the same time, the region
+// holds SHMEM_LANES of these mailboxes instead of one. Each client claims a lane
+// of its own when it starts (by writing its PID into the lane's owner field with
+// a compare-and-swap) and gives it back when it exits, so no two clients ever
+// write the same lane. The server polls lanes [0, nlanes) round-robin,
+// skipping any lane whose "posted" counter has not moved since its last look.
+// When a full pass finds nothing to do, it goes to sleep on the doorbell, which
+// every client bumps after posting (see shm_wait.h for how sleeping and waking
+// work).
+//
+// Each slot and each lane header is on its own cache line, so clients don't
+// false-share with each other, and the server's writes to one slot's "done"
+// don't disturb the client filling in the next slot. The doorbell is the one
+// line every client writes.
+//
+// A server that waits in epoll rather than on the futex (server_mux.c) can't
+// be woken by the doorbell word. It sets doorbell_parked while it is asleep,
+// and puts in doorbell_socket the path of a UNIX socket where a client can ask
+// for its eventfd (see sock_proto.h). A client that has the eventfd writes to
+// it after ringing, but only while the server is parked, so a busy server
+// costs clients nothing extra. A client without one still works: the server
+// wakes up every so often and scans the lanes anyway.
+//
+// Operation 4 is a completion token (see measure.h): the client puts a token
+// in the first 8 bytes of data, and the server, finding it, overwrites data
+// with a struct measure_ack. The client posts it only once all its other
+// requests are done, since the server may complete slots in any order.
+//
+// NOTE: both programs must be rebuilt if this file changes.
+
+#ifndef SHMEM_PROTO_H
+#define SHMEM_PROTO_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "shm_wait.h"
+
+#define CACHE_LINE 64
+#define SHMEM_LANES 64
+#define SHMEM_SLOTS 16 // most requests one client can have in flight
+
+struct shmem_slot {
+    _Alignas(CACHE_LINE) _Atomic uint32_t seq; // bumped by the client to post a request
+    _Atomic uint32_t done;       // set to seq by the server when the request is complete
+    uint32_t operation;          // requested operation (1 = register, 2 = report, 3 = reset, 4 = measure)
+    int eventid;                 // the event type ID
+    char data[100];              // other data (up to 100 bytes)
+};
+
+struct shmem_lane {
+    _Alignas(CACHE_LINE) _Atomic uint32_t owner; // PID of the client using this lane, 0 if free
+    _Atomic uint32_t posted;             // bumped by the client after posting to any slot
+    _Atomic uint32_t completions;        // bumped by the server after completing any slots
+    _Atomic uint32_t completion_waiters; // clients asleep waiting for completions to change
+    struct shmem_slot slots[SHMEM_SLOTS];
+};
+
+struct shared_stuff {
+    _Alignas(CACHE_LINE) _Atomic uint32_t doorbell; // bumped by a client after every post
+    _Atomic uint32_t doorbell_waiters;              // servers asleep on the doorbell
+    _Atomic uint32_t nlanes;                        // lanes [0, nlanes) have ever been claimed
+    _Atomic uint32_t doorbell_parked;               // servers asleep in epoll instead
+    char doorbell_socket[108];                      // where to ask for their eventfd, or ""
+    struct shmem_lane lanes[SHMEM_LANES];
+};
+
+// The eventfd this process got from an epoll-driven server, or -1. A process
+// uses at most one region, so it is kept here rather than passed around.
+static int shmem_doorbell_fd = -1;
+
+// Claim a free lane for this process. A lane whose owner has exited without
+// giving it back (e.g. killed with Control-C) counts as free. Returns NULL if
+// every lane is in use. A lane given up with requests still in flight is not
+// reused until the server has completed them.
+static inline struct shmem_lane *shmem_claim_lane(struct shared_stuff *p)
+{
+    uint32_t me = (uint32_t)getpid();
+    for (int i = 0; i < SHMEM_LANES; i++) {
+        struct shmem_lane *lane = &p->lanes[i];
+        uint32_t owner = atomic_load_explicit(&lane->owner, memory_order_relaxed);
+        if (owner != 0 && (kill((pid_t)owner, 0) == 0 || errno != ESRCH))
+            continue;
+        int busy = 0;
+        for (int s = 0; s < SHMEM_SLOTS; s++)
+            if (atomic_load_explicit(&lane->slots[s].seq, memory_order_relaxed) !=
+                atomic_load_explicit(&lane->slots[s].done, memory_order_acquire))
+                busy = 1;
+        if (busy)
+            continue;
+        if (!atomic_compare_exchange_strong(&lane->owner, &owner, me))
+            continue;
+        uint32_t n = atomic_load_explicit(&p->nlanes, memory_order_relaxed);
+        while (n < (uint32_t)i + 1 &&
+               !atomic_compare_exchange_weak(&p->nlanes, &n, (uint32_t)i + 1))
+            ;
+        return lane;
+    }
+    return NULL;
+}
+
+static inline void shmem_release_lane(struct shmem_lane *lane)
+{
+    atomic_store_explicit(&lane->owner, 0, memory_order_release);
+}
+
+// Has the server finished the slot's last request?
+static inline int shmem_slot_done(struct shmem_slot *slot)
+{
+    return atomic_load_explicit(&slot->done, memory_order_acquire) ==
+           atomic_load_explicit(&slot->seq, memory_order_relaxed);
+}
+
+// Hand a request to the server without ringing the doorbell. The slot must be
+// free, and its eventid and data must already be filled in; the release store
+// of seq publishes them. Call shmem_ring() after submitting one or more.
+static inline void shmem_submit(struct shmem_lane *lane, struct shmem_slot *slot, uint32_t operation)
+{
+    slot->operation = operation;
+    atomic_store_explicit(&slot->seq, atomic_load_explicit(&slot->seq, memory_order_relaxed) + 1,
+                          memory_order_release);
+    atomic_fetch_add_explicit(&lane->posted, 1, memory_order_release);
+}
+
+// Tell the server there are new requests. shm_wake's fence also orders the
+// doorbell before the load of doorbell_parked, which the server sets before
+// its last look at the doorbell.
+static inline void shmem_ring(struct shared_stuff *p)
+{
+    atomic_fetch_add_explicit(&p->doorbell, 1, memory_order_release);
+    shm_wake(&p->doorbell, &p->doorbell_waiters);
+    if (shmem_doorbell_fd >= 0 && atomic_load_explicit(&p->doorbell_parked, memory_order_relaxed)) {
+        uint64_t one = 1;
+        ssize_t n = write(shmem_doorbell_fd, &one, sizeof(one));
+        (void)n; // a full counter already wakes the server
+    }
+}
+
+// Submit one request and ring the doorbell.
+static inline void shmem_post(struct shared_stuff *p, struct shmem_lane *lane, struct shmem_slot *slot,
+                              uint32_t operation)
+{
+    shmem_submit(lane, slot, operation);
+    shmem_ring(p);
+}
+
+// Wait until the server completes something on the lane that it had not
+// completed when *seen was read, and update *seen.
+static inline void shmem_wait_completions(struct shmem_lane *lane, struct shm_waiter *waiter, uint32_t *seen)
+{
+    shm_wait_while_equal(waiter, &lane->completions, *seen, &lane->completion_waiters);
+    *seen = atomic_load_explicit(&lane->completions, memory_order_acquire);
+}
+
+// Wait until the server has finished the slot's current request.
+static inline void shmem_wait_until_idle(struct shmem_lane *lane, struct shmem_slot *slot, struct shm_waiter *waiter)
+{
+    uint32_t seen = atomic_load_explicit(&lane->completions, memory_order_acquire);
+    while (!shmem_slot_done(slot))
+        shmem_wait_completions(lane, waiter, &seen);
+}
+
+#endif // SHMEM_PROTO_H
@@ -0,0 +1,304 @@
+// sock_proto.h
+// UNIX domain sockets carrying the mpi message format, for server_sock.c,
+// client_sock.c, and server_mux.c.
+
+// A UNIX socket is the fourth transport, for clients that can't map shared
+// memory, and for comparison with the others. Either kind of socket keeps
+// message boundaries like a message queue, and unlike a SystemV queue it has
+// a descriptor that epoll can wait on:
+//
+// * SOCK_SEQPACKET is connected, so the server answers on the connection.
+// * SOCK_DGRAM has one server socket for every client; each client binds an
+//   autobind address of its own so replies can find it.
+//
+// Each packet is one struct ipcmsg, msgtype included, exactly like a message
+// on a POSIX mailbox (see mpi_proto.h), and means the same thing. Requests
+// that want a reply (msgtype 6 to 9) still start with a reply_to header, and
+// the struct ipcreply comes back on the socket instead of a reply queue.
+//
+// Two more msgtypes are only meaningful here, since they pass a descriptor:
+//
+//   10 = doorbell: asks for the eventfd that a shared-memory client writes
+//        to wake the server (see shmem_proto.h). The reply is an ipcreply
+//        with the descriptor attached as SCM_RIGHTS, or status -1 if the
+//        server has no region. Only server_mux has one.
+//   11 = object: a report whose payload is in the memfd attached as
+//        SCM_RIGHTS rather than in the packet (see object.h), for payloads
+//        too big for a packet. Starts with a reply_to header, and the reply
+//        is as for sync, or status -1 if the object could not be read.
+//
+// A system call per message would cost more than the copy for small reports,
+// so both sides move up to SOCK_BATCH packets per call with sendmmsg and
+// recvmmsg. glibc only declares those (and struct mmsghdr) with _GNU_SOURCE,
+// so, as placement.h does for its calls, they are made through syscall().
+//
+// SOCK_BUF_KB sets the socket buffers: SO_RCVBUF on the server and SO_SNDBUF
+// on the client. Linux charges a queued UNIX packet to the sender's buffer,
+// so it is the client's SO_SNDBUF that decides how big a burst the socket
+// absorbs before the sender blocks; a datagram socket is also limited to
+// /proc/sys/net/unix/max_dgram_qlen packets.
+//
+// NOTE: everything that includes this must be rebuilt if it changes.
+
+#ifndef SOCK_PROTO_H
+#define SOCK_PROTO_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "mpi_proto.h"
+
+#define SOCK_BATCH 64            // most packets moved by one system call
+#define SOCK_MSG_MAX (64 * 1024) // largest packet, msgtype included
+
+// struct ucred, as the kernel lays it out (glibc declares it only with _GNU_SOURCE too).
+struct sock_ucred {
+    int pid;
+    int uid;
+    int gid;
+};
+
+// struct mmsghdr, as the kernel lays it out.
+struct sock_mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len; // bytes sent or received
+};
+
+// Packets received in one recvmmsg, and where each came from.
+struct sock_batch {
+    struct sock_mmsghdr hdrs[SOCK_BATCH];
+    struct iovec iov[SOCK_BATCH];
+    struct sockaddr_un from[SOCK_BATCH];
+    char control[SOCK_BATCH][CMSG_SPACE(sizeof(int))]; // a descriptor passed with each, if any
+    char *bufs; // SOCK_BATCH buffers of SOCK_MSG_MAX bytes
+};
+
+// Fill in addr for the socket at path. Returns its length, or prints an
+// error and returns -1 if the path is too long.
+static inline int sock_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        printf("Socket path %s is too long (at most %d bytes).\n", path, (int)sizeof(addr->sun_path) - 1);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return sizeof(*addr);
+}
+
+static inline int sock_sendmmsg(int fd, struct sock_mmsghdr *v, unsigned n, int flags)
+{
+    return syscall(SYS_sendmmsg, fd, v, n, flags);
+}
+
+static inline int sock_recvmmsg(int fd, struct sock_mmsghdr *v, unsigned n, int flags)
+{
+    return syscall(SYS_recvmmsg, fd, v, n, flags, NULL);
+}
+
+// Set one of the socket's buffers (SO_RCVBUF or SO_SNDBUF) from SOCK_BUF_KB,
+// if it is set. Returns the size the kernel actually gave it.
+static inline int sock_tune(int fd, int which)
+{
+    const char *env = getenv("SOCK_BUF_KB");
+    if (env != NULL) {
+        int bytes = atoi(env) * 1024;
+        if (setsockopt(fd, SOL_SOCKET, which, &bytes, sizeof(bytes)) < 0)
+            perror("setsockopt");
+    }
+    int bytes = 0;
+    socklen_t len = sizeof(bytes);
+    getsockopt(fd, SOL_SOCKET, which, &bytes, &len);
+    return bytes;
+}
+
+static inline const char *sock_type_name(int type)
+{
+    return type == SOCK_DGRAM ? "datagram" : "seqpacket";
+}
+
+// Create the server's socket at path, of the given type, replacing any stale
+// one left by an earlier run. A SOCK_SEQPACKET socket listens and does not
+// block, so its connections can be accepted from an epoll loop. Prints an
+// error and returns -1 on failure.
+static inline int sock_listen(const char *path, int type)
+{
+    struct sockaddr_un addr;
+    if (sock_address(&addr, path) < 0)
+        return -1;
+    int fd = socket(AF_UNIX, type, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || (type == SOCK_SEQPACKET && listen(fd, 64) < 0)) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (type == SOCK_SEQPACKET)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// Connect to the server's socket at path, whichever type it is. A datagram
+// client first binds an autobind address, so replies have somewhere to go.
+// Sets *type, and returns the socket, or prints an error and returns -1.
+static inline int sock_connect(const char *path, int *type)
+{
+    struct sockaddr_un addr;
+    if (sock_address(&addr, path) < 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        *type = SOCK_SEQPACKET;
+        return fd;
+    }
+    if (fd < 0 || errno != EPROTOTYPE) {
+        perror("connect");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    sa_family_t family = AF_UNIX;
+    if (fd < 0 || bind(fd, (struct sockaddr *)&family, sizeof(family)) < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    *type = SOCK_DGRAM;
+    return fd;
+}
+
+// Allocate a batch's buffers. Prints an error and returns -1 on failure.
+static inline int sock_batch_init(struct sock_batch *b)
+{
+    b->bufs = (char *)malloc((size_t)SOCK_BATCH * SOCK_MSG_MAX);
+    if (b->bufs == NULL) {
+        printf("Can't allocate socket buffers.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// The i-th packet of a batch.
+static inline struct ipcmsg *sock_batch_msg(struct sock_batch *b, int i)
+{
+    return (struct ipcmsg *)(b->bufs + (size_t)i * SOCK_MSG_MAX);
+}
+
+// Receive up to SOCK_BATCH packets from fd. Returns how many, or -1 with
+// errno set (EAGAIN if MSG_DONTWAIT was given and there were none). Take each
+// packet's length from sock_batch_len. On a connection, a packet of length 0
+// means the peer closed it; on a datagram socket, an empty datagram is legal
+// and is only too short to be a message.
+static inline int sock_recv_batch(int fd, struct sock_batch *b, int flags)
+{
+    for (int i = 0; i < SOCK_BATCH; i++) {
+        b->iov[i].iov_base = sock_batch_msg(b, i);
+        b->iov[i].iov_len = SOCK_MSG_MAX;
+        memset(&b->hdrs[i].msg_hdr, 0, sizeof(b->hdrs[i].msg_hdr));
+        b->hdrs[i].msg_hdr.msg_iov = &b->iov[i];
+        b->hdrs[i].msg_hdr.msg_iovlen = 1;
+        b->hdrs[i].msg_hdr.msg_name = &b->from[i];
+        b->hdrs[i].msg_hdr.msg_namelen = sizeof(b->from[i]);
+        b->hdrs[i].msg_hdr.msg_control = b->control[i];
+        b->hdrs[i].msg_hdr.msg_controllen = sizeof(b->control[i]);
+    }
+    return sock_recvmmsg(fd, b->hdrs, SOCK_BATCH, flags | MSG_CMSG_CLOEXEC);
+}
+
+// The length of the i-th packet of a batch, or -1 if it was longer than
+// SOCK_MSG_MAX and so was cut short (MSG_TRUNC), in which case it must be
+// dropped rather than handled.
+static inline int sock_batch_len(struct sock_batch *b, int i)
+{
+    if (b->hdrs[i].msg_hdr.msg_flags & MSG_TRUNC)
+        return -1;
+    return b->hdrs[i].msg_len;
+}
+
+// The descriptor passed with the i-th packet of a batch, or -1 if none was.
+// Whoever receives one must close it.
+static inline int sock_batch_fd(struct sock_batch *b, int i)
+{
+    struct msghdr *msg = &b->hdrs[i].msg_hdr;
+    int fd = -1;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(c), sizeof(int));
+    return fd;
+}
+
+// Send n bytes at p as one packet, with descriptor fd attached (or none, if
+// fd is -1). Returns what sendmsg returns.
+static inline ssize_t sock_send_fd(int sock, const void *p, size_t n, int fd, int flags)
+{
+    struct iovec iov = { (void *)p, n };
+    struct msghdr msg;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &msg, flags);
+}
+
+// Receive one packet of up to n bytes into p, and the descriptor attached to
+// it into *fd (-1 if there was none). Returns what recvmsg returns.
+static inline ssize_t sock_recv_fd(int sock, void *p, size_t n, int *fd)
+{
+    struct iovec iov = { p, n };
+    struct msghdr msg;
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    *fd = -1;
+    ssize_t got = recvmsg(sock, &msg, 0);
+    if (got < 0)
+        return got;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(c), sizeof(int));
+    return got;
+}
+
+// The PID of the process at the other end of connection sock, as it was when it
+// connected (SO_PEERCRED), or -1 if the kernel can't say.
+static inline int sock_peer_pid(int sock)
+{
+    struct sock_ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || len < sizeof(cred))
+        return -1;
+    return cred.pid;
+}
+
+#endif // SOCK_PROTO_H
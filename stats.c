@@ -0,0 +1,111 @@
+// stats.c
+// Read a server's event statistics from its published segment.
+
+// The servers publish their statistics table into a read-only shared memory
+// segment (see stats_segment.h). This maps that segment and prints the table,
+// without sending the server a message, so it can run as often as you like
+// against a busy server without slowing it down or resetting anything.
+//
+// usage: ./stats <mpi|shmem> <mailbox_num|region_name> [interval_ms [rounds]]
+//   With no interval, prints the latest snapshot once. With an interval, prints
+//   it every interval_ms milliseconds (forever, or for the given number of
+//   rounds), adding each event's reports/second and MB/second since the
+//   previous snapshot.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats_segment.h"
+
+// Find the row for id in prev, which holds the rows of an earlier snapshot in
+// the same order (event types are only ever added), starting the search at *j.
+static struct stats_row *match_row(struct stats_row *prev, int nprev, int *j, int64_t id)
+{
+    for (int k = *j; k < nprev; k++) {
+        if (prev[k].id == id) {
+            *j = k + 1;
+            return &prev[k];
+        }
+    }
+    return NULL;
+}
+
+static void print_snapshot(struct stats_header *h, struct stats_row *rows, int n,
+                           struct stats_header *ph, struct stats_row *prev, int nprev)
+{
+    double age_ms = (stats_now_ns() - h->published_ns) / 1e6;
+    printf("Snapshot %lld from server pid %d, %.1f ms old (published every %lld ms).\n",
+            (long long)h->snapshots, h->pid, age_ms, (long long)h->interval_ms);
+    double dt = (ph != NULL) ? (h->published_ns - ph->published_ns) / 1e9 : 0;
+    if (dt > 0)
+        printf("%4s %15s %31s %10s %12s %12s %10s\n", "ID", "Name", "Description", "Count", "Sum",
+                "Reports/s", "MB/s");
+    else
+        printf("%4s %15s %31s %10s %12s\n", "ID", "Name", "Description", "Count", "Sum");
+    int j = 0;
+    for (int i = 0; i < n; i++) {
+        struct stats_row *r = &rows[i];
+        printf("%4lld %15s %31s %10lld %12lld", (long long)r->id, r->name, r->description,
+                (long long)r->count, (long long)r->sum);
+        struct stats_row *p = (dt > 0) ? match_row(prev, nprev, &j, r->id) : NULL;
+        if (p != NULL && r->count >= p->count && r->sum >= p->sum)
+            printf(" %12.1f %10.3f", (r->count - p->count) / dt, (r->sum - p->sum) / 1e6 / dt);
+        else if (dt > 0)
+            printf(" %12s %10s", "-", "-"); // new, or reset in between
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || argc > 5 || (strcmp(argv[1], "mpi") && strcmp(argv[1], "shmem") &&
+                                 strcmp(argv[1], "mux") && strcmp(argv[1], "sock"))) {
+        printf("usage: %s <mpi|shmem|mux|sock> <mailbox_num|region_name|socket_name> [interval_ms [rounds]]\n", argv[0]);
+        printf("  Prints the statistics published by a running server_mpi or server_shmem\n");
+        printf("  (see IPC_STATS_MS). With an interval, prints them every interval_ms\n");
+        printf("  milliseconds along with each event's rate since the previous snapshot.\n");
+        exit(1);
+    }
+    long interval_ms = (argc > 3) ? atol(argv[3]) : 0;
+    long rounds = (argc > 4) ? atol(argv[4]) : -1;
+
+    struct stats_segment s;
+    if (stats_segment_open(&s, argv[1], argv[2]) < 0)
+        exit(1);
+
+    struct stats_header h, ph;
+    struct stats_row *rows = NULL, *prev = NULL;
+    uint32_t room = 0, prev_room = 0;
+    int n = stats_read(&s, &h, &rows, &room);
+    if (n < 0) {
+        printf("Can't read statistics segment %s.\n", s.name);
+        exit(1);
+    }
+    print_snapshot(&h, rows, n, NULL, NULL, 0);
+
+    for (long round = 1; interval_ms > 0 && round != rounds; round++) {
+        struct stats_row *swap = prev;
+        uint32_t swap_room = prev_room;
+        prev = rows;
+        prev_room = room;
+        rows = swap;
+        room = swap_room;
+        ph = h;
+        int nprev = n;
+
+        struct timespec ts = { interval_ms / 1000, (interval_ms % 1000) * 1000000 };
+        nanosleep(&ts, NULL);
+        n = stats_read(&s, &h, &rows, &room);
+        if (n < 0) {
+            printf("Can't read statistics segment %s.\n", s.name);
+            exit(1);
+        }
+        printf("\n");
+        print_snapshot(&h, rows, n, &ph, prev, nprev);
+    }
+    free(rows);
+    free(prev);
+    return 0;
+}
@@ -0,0 +1,263 @@
+// stats_segment.h
+// A read-only shared memory segment where the servers publish their event
+// statistics, and the code to read it back (see stats.c).
+
+// Asking a server for its statistics used to mean sending it a message (msgtype
+// 4, or shmem operation 3), which prints the whole table from inside its
+// receive loop. Instead, each server now copies its table into this segment
+// every IPC_STATS_MS milliseconds (default 100; 0 turns publishing off) from a
+// separate thread, and any number of readers can map the segment and look at
+// the latest copy as often as they like without the server noticing.
+//
+// The segment is named after the server's transport and mailbox or region,
+// e.g. /mpi-4242.stats or /shmem-myregion.stats (see stats_segment_name), and
+// holds a header followed by one row per registered event type. Rows are
+// copied from the counters with relaxed loads, which the counters were made
+// atomic for (see event_table.h), so the server's receive loop never waits for
+// the publisher.
+//
+// A snapshot is guarded by a sequence lock. The publisher makes seq odd before
+// it starts writing rows and even again when it is done. A reader notes seq,
+// copies the header and rows, and checks that seq was even and has not changed;
+// if it has, the copy may be torn and the reader tries again. Readers never
+// write to the segment, so a slow or stuck reader cannot hold up the server.
+//
+// The segment starts with room for STATS_MIN_ROWS rows and the publisher
+// doubles it (with ftruncate) when more event types are registered. Readers
+// compare the header's capacity with what they have mapped and remap.
+//
+// NOTE: the servers and stats must be rebuilt if this file changes.
+
+#ifndef STATS_SEGMENT_H
+#define STATS_SEGMENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "event_table.h"
+
+#define STATS_MAGIC 0x53544154u // "STAT"
+#define STATS_LAYOUT 1          // bumped whenever the structs below change
+#define STATS_MIN_ROWS 1024
+#define STATS_DEFAULT_MS 100
+
+struct stats_row {
+    int64_t id;
+    char name[EVENT_NAME_LEN];
+    char description[EVENT_DESC_LEN];
+    int64_t count; // as the server would print it (since the last reset)
+    int64_t sum;   // payload bytes, since the last reset or measurement
+};
+
+struct stats_header {
+    uint32_t magic;
+    uint32_t layout;
+    _Atomic uint32_t seq;  // odd while a snapshot is being written
+    uint32_t capacity;     // rows the segment has room for
+    uint32_t nrows;        // rows in the current snapshot
+    int32_t pid;           // the publishing server
+    int64_t published_ns;  // CLOCK_MONOTONIC time of the current snapshot
+    int64_t snapshots;     // how many have been published
+    int64_t interval_ms;   // how often they are published
+    struct stats_row rows[];
+};
+
+struct stats_segment {
+    char name[256];
+    int fd;
+    struct stats_header *h;
+    size_t mapped; // bytes mapped at h
+};
+
+// Publish interval from IPC_STATS_MS, in milliseconds. 0 means don't publish.
+static inline long stats_interval_ms(void)
+{
+    const char *env = getenv("IPC_STATS_MS");
+    return env ? atol(env) : STATS_DEFAULT_MS;
+}
+
+// The segment name for a server on the given transport ("mpi" or "shmem")
+// with the given mailbox number or region name.
+static inline void stats_segment_name(char *buf, size_t len, const char *transport, const char *name)
+{
+    snprintf(buf, len, "/%s-%s.stats", transport, name[0] == '/' ? name + 1 : name);
+}
+
+static inline size_t stats_segment_size(uint32_t capacity)
+{
+    return sizeof(struct stats_header) + (size_t)capacity * sizeof(struct stats_row);
+}
+
+static inline int64_t stats_now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// Create the segment for a server. Prints an error and returns -1 on failure.
+static inline int stats_segment_create(struct stats_segment *s, const char *transport, const char *name,
+                                       long interval_ms)
+{
+    stats_segment_name(s->name, sizeof(s->name), transport, name);
+    s->fd = shm_open(s->name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (s->fd < 0) {
+        perror("shm_open");
+        printf("Can't create statistics segment %s.\n", s->name);
+        return -1;
+    }
+    s->mapped = stats_segment_size(STATS_MIN_ROWS);
+    if (ftruncate(s->fd, s->mapped) != 0) {
+        perror("ftruncate");
+        printf("Can't resize statistics segment %s.\n", s->name);
+        return -1;
+    }
+    s->h = mmap(0, s->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->h == MAP_FAILED) {
+        perror("mmap");
+        printf("Can't map statistics segment %s.\n", s->name);
+        return -1;
+    }
+    s->h->layout = STATS_LAYOUT;
+    s->h->capacity = STATS_MIN_ROWS;
+    s->h->pid = getpid();
+    s->h->interval_ms = interval_ms;
+    // The magic number goes in last, so a reader never trusts a half-made header.
+    atomic_thread_fence(memory_order_release);
+    s->h->magic = STATS_MAGIC;
+    return 0;
+}
+
+// Start a snapshot of up to maxrows rows, growing the segment first if they
+// might not fit. Returns the rows to fill in, or NULL if the segment can't grow.
+static inline struct stats_row *stats_publish_begin(struct stats_segment *s, uint32_t maxrows)
+{
+    if (maxrows > s->h->capacity) {
+        uint32_t capacity = s->h->capacity;
+        while (capacity < maxrows)
+            capacity *= 2;
+        size_t size = stats_segment_size(capacity);
+        if (ftruncate(s->fd, size) != 0)
+            return NULL;
+        void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        munmap(s->h, s->mapped);
+        s->h = p;
+        s->mapped = size;
+        s->h->capacity = capacity; // outside the snapshot: readers only remap on it
+    }
+    uint32_t seq = atomic_load_explicit(&s->h->seq, memory_order_relaxed);
+    atomic_store_explicit(&s->h->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return s->h->rows;
+}
+
+static inline void stats_publish_row(struct stats_row *row, const struct event_meta *meta,
+                                     int64_t count, int64_t sum)
+{
+    row->id = meta->id;
+    memcpy(row->name, meta->name, EVENT_NAME_LEN);
+    memcpy(row->description, meta->description, EVENT_DESC_LEN);
+    row->count = count;
+    row->sum = sum;
+}
+
+// Finish the snapshot started by stats_publish_begin, which filled in nrows rows.
+static inline void stats_publish_end(struct stats_segment *s, uint32_t nrows)
+{
+    s->h->nrows = nrows;
+    s->h->published_ns = stats_now_ns();
+    s->h->snapshots++;
+    atomic_store_explicit(&s->h->seq, atomic_load_explicit(&s->h->seq, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+// Sleep until the next publish time after *next, and make that the new *next.
+// Start *next at the current CLOCK_MONOTONIC time.
+static inline void stats_publish_wait(struct stats_segment *s, struct timespec *next)
+{
+    next->tv_nsec += (s->h->interval_ms % 1000) * 1000000;
+    next->tv_sec += s->h->interval_ms / 1000 + next->tv_nsec / 1000000000;
+    next->tv_nsec %= 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+}
+
+static inline void stats_segment_remove(struct stats_segment *s)
+{
+    shm_unlink(s->name);
+}
+
+// Open an existing segment read-only. Prints an error and returns -1 on failure.
+static inline int stats_segment_open(struct stats_segment *s, const char *transport, const char *name)
+{
+    stats_segment_name(s->name, sizeof(s->name), transport, name);
+    s->fd = shm_open(s->name, O_RDONLY, 0);
+    if (s->fd < 0) {
+        perror("shm_open");
+        printf("Can't open statistics segment %s. Is the server running, with IPC_STATS_MS > 0?\n", s->name);
+        return -1;
+    }
+    s->mapped = stats_segment_size(0);
+    s->h = mmap(0, s->mapped, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (s->h == MAP_FAILED) {
+        perror("mmap");
+        printf("Can't map statistics segment %s.\n", s->name);
+        return -1;
+    }
+    if (s->h->magic != STATS_MAGIC || s->h->layout != STATS_LAYOUT) {
+        printf("%s is not a statistics segment this program understands (was stats rebuilt?).\n", s->name);
+        return -1;
+    }
+    return 0;
+}
+
+// Copy a consistent snapshot into hdr and *rows, which is (re)allocated to
+// fit. Returns the number of rows, or -1 if the segment can't be remapped.
+static inline int stats_read(struct stats_segment *s, struct stats_header *hdr, struct stats_row **rows,
+                             uint32_t *room)
+{
+    while (1) {
+        uint32_t seq = atomic_load_explicit(&s->h->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        uint32_t capacity = s->h->capacity;
+        if (stats_segment_size(capacity) > s->mapped) {
+            void *p = mmap(0, stats_segment_size(capacity), PROT_READ, MAP_SHARED, s->fd, 0);
+            if (p == MAP_FAILED)
+                return -1;
+            munmap(s->h, s->mapped);
+            s->h = p;
+            s->mapped = stats_segment_size(capacity);
+            continue;
+        }
+        memcpy(hdr, s->h, sizeof(*hdr));
+        uint32_t n = hdr->nrows;
+        if (n > capacity)
+            continue; // torn; the check below would catch it, but don't overrun first
+        if (n > *room) {
+            struct stats_row *grown = realloc(*rows, n * sizeof(struct stats_row));
+            if (grown == NULL)
+                return -1;
+            *rows = grown;
+            *room = n;
+        }
+        memcpy(*rows, s->h->rows, n * sizeof(struct stats_row));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->h->seq, memory_order_relaxed) == seq)
+            return n;
+    }
+}
+
+#endif // STATS_SEGMENT_H
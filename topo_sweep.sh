@@ -0,0 +1,158 @@
+#!/bin/sh
+# topo_sweep.sh
+# Measure shared-memory IPC cost between pairs of CPUs, classified by how
+# close they are in the machine's topology.
+#
+# usage: ./topo_sweep.sh [ classes | matrix ]
+#   classes (the default) runs one pair of CPUs per topology class:
+#     same-cpu      server and client on the same hardware thread
+#     smt-sibling   two hyperthreads of one core
+#     same-l3       different cores that share a last-level cache
+#     same-socket   different L3s (e.g. chiplets) in one package
+#     remote-socket different packages
+#   matrix runs every ordered pair of CPUs and prints a core-to-core matrix of
+#   round-trip latency and of bounded-buffer throughput.
+#
+# For each pair, the server is pinned to the first CPU and the client to the
+# second (with IPC_CPUS, see placement.h), and two tests are run:
+#   - shmem ping-pong: "ipc_bench shmem", the client_shmem experiment loop,
+#     reporting the median and p99 round trip.
+#   - bb throughput: "client_bb <BB_COUNT> <BB_BATCH>" against server_bb.
+#
+# The topology comes from /sys/devices/system/cpu. Environment variables:
+#   CPUS      CPUs to include (default: all online CPUs), e.g. "0-7,64-71"
+#   TRIPS     round trips per ping-pong test (default 20000)
+#   BB_COUNT  ints per throughput test (default 4000000)
+#   BB_BATCH  ints per publish in the throughput test (default 256)
+#   IPC_WAIT  wait strategy for both sides (see shm_wait.h); spinning gives
+#             the truest handoff cost when server and client are on different CPUs
+
+MODE=${1:-classes}
+SYS=/sys/devices/system/cpu
+CPUS=${CPUS:-$(cat $SYS/online)}
+TRIPS=${TRIPS:-20000}
+BB_COUNT=${BB_COUNT:-4000000}
+BB_BATCH=${BB_BATCH:-256}
+REGION=/topo-sweep-$$
+LOG=$(mktemp)
+
+# Expand a cpulist such as "0-3,8" into one number per line.
+expand() {
+    echo "$1" | tr ',' '\n' | while IFS=- read lo hi; do
+        seq "$lo" "${hi:-$lo}"
+    done
+}
+
+# Is CPU $1 in the cpulist $2?
+in_list() {
+    expand "$2" | grep -qx "$1"
+}
+
+# The cpulist of CPUs sharing CPU $1's level-3 cache (empty if there is none).
+l3_list() {
+    for idx in $SYS/cpu$1/cache/index*; do
+        if [ "$(cat "$idx/level")" = 3 ]; then
+            cat "$idx/shared_cpu_list"
+            return
+        fi
+    done
+}
+
+classify() {
+    a=$1
+    b=$2
+    if [ "$a" = "$b" ]; then
+        echo same-cpu
+    elif in_list "$b" "$(cat $SYS/cpu$a/topology/thread_siblings_list)"; then
+        echo smt-sibling
+    elif [ -n "$(l3_list "$a")" ] && in_list "$b" "$(l3_list "$a")"; then
+        echo same-l3
+    elif [ "$(cat $SYS/cpu$a/topology/physical_package_id)" = \
+           "$(cat $SYS/cpu$b/topology/physical_package_id)" ]; then
+        echo same-socket
+    else
+        echo remote-socket
+    fi
+}
+
+# Start a server pinned to CPU $1, run $2 (a command line) pinned to CPU $3,
+# and stop the server again. The client's output is left in $LOG.
+with_server() {
+    server_cpu=$1
+    client=$2
+    client_cpu=$3
+    shift 3
+    IPC_CPUS=$server_cpu "$@" > /dev/null 2>&1 &
+    server=$!
+    sleep 0.2
+    IPC_CPUS=$client_cpu $client > "$LOG" 2>&1
+    kill -INT $server
+    wait $server 2> /dev/null
+}
+
+# Print "<p50_us> <p99_us> <MB/s>" for server on CPU $1, client on CPU $2.
+measure() {
+    with_server "$1" "./ipc_bench shmem $REGION -n $TRIPS -t 1 -f csv" "$2" ./server_shmem "$REGION"
+    # The summary row is: label,mean,,ops,MB/s,mean_ns,p50_ns,p99_ns,...
+    lat=$(awk -F, '$2 == "mean" { printf "%.2f %.2f", $7 / 1000, $8 / 1000 }' "$LOG")
+    with_server "$1" "./client_bb $REGION $BB_COUNT $BB_BATCH" "$2" ./server_bb "$REGION"
+    mbs=$(awk '/Throughput/ { printf "%.1f", $3 }' "$LOG")
+    echo "${lat:-? ?} ${mbs:-?}"
+}
+
+cpus=$(expand "$CPUS")
+
+if [ "$MODE" = classes ]; then
+    printf "%-14s %6s %6s %12s %12s %12s\n" "Class" "Server" "Client" "p50(us)" "p99(us)" "MB/second"
+    first=$(echo "$cpus" | head -n 1)
+    for class in same-cpu smt-sibling same-l3 same-socket remote-socket; do
+        pair=
+        for b in $cpus; do
+            if [ "$(classify "$first" "$b")" = $class ]; then
+                pair=$b
+                break
+            fi
+        done
+        if [ -z "$pair" ]; then
+            printf "%-14s %6s %6s %12s %12s %12s\n" $class - - "n/a" "n/a" "n/a"
+            continue
+        fi
+        set -- $(measure "$first" "$pair")
+        printf "%-14s %6s %6s %12s %12s %12s\n" $class "$first" "$pair" "$1" "$2" "$3"
+    done
+elif [ "$MODE" = matrix ]; then
+    LAT=$(mktemp)
+    BW=$(mktemp)
+    printf "%6s %6s %-14s %12s %12s %12s\n" "Server" "Client" "Class" "p50(us)" "p99(us)" "MB/second"
+    for a in $cpus; do
+        for b in $cpus; do
+            set -- $(measure "$a" "$b")
+            printf "%6s %6s %-14s %12s %12s %12s\n" "$a" "$b" "$(classify "$a" "$b")" "$1" "$2" "$3"
+            echo "$a $b $1" >> "$LAT"
+            echo "$a $b $3" >> "$BW"
+        done
+    done
+    # Rows are the server's CPU, columns the client's.
+    for table in "$LAT:Median round trip (us)" "$BW:Bounded-buffer throughput (MB/second)"; do
+        echo
+        echo "${table#*:}, server CPU down, client CPU across:"
+        awk -v cpus="$(echo $cpus)" '
+            { v[$1 " " $2] = $3 }
+            END {
+                n = split(cpus, c, " ")
+                printf "%6s", ""
+                for (j = 1; j <= n; j++) printf " %8s", c[j]
+                printf "\n"
+                for (i = 1; i <= n; i++) {
+                    printf "%6s", c[i]
+                    for (j = 1; j <= n; j++) printf " %8s", v[c[i] " " c[j]]
+                    printf "\n"
+                }
+            }' "${table%%:*}"
+    done
+    rm -f "$LAT" "$BW"
+else
+    echo "usage: $0 [ classes | matrix ]"
+    exit 1
+fi
+rm -f "$LOG"
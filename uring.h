@@ -0,0 +1,195 @@
+// uring.h
+// A minimal io_uring, set up with the raw system calls.
+
+// io_uring lets a program hand the kernel a batch of I/O requests through a
+// submission ring shared with the kernel, and pick up the results later from
+// a completion ring, without waiting for the I/O in between. The servers use
+// it to write their output (see async_out.h) and their journal (see
+// journal.h) without blocking on the terminal, pipe, or disk behind them.
+//
+// liburing is not installed everywhere, so this sets up the rings itself with
+// io_uring_setup() and mmap() and talks to the kernel with io_uring_enter(),
+// using only the definitions in <linux/io_uring.h>. It does just what the
+// servers need: queue a few requests, submit them, and reap completions.
+//
+// A ring is not thread safe; each user keeps its own, or locks around it.
+// uring_init fails (returns -1) on kernels without io_uring, or where a
+// seccomp filter forbids it, and callers fall back to plain write().
+//
+// NOTE: the servers must be rebuilt if this file changes.
+
+#ifndef URING_H
+#define URING_H
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned queued;                 // SQEs filled in but not yet submitted
+    _Atomic unsigned *sq_head;       // advanced by the kernel
+    _Atomic unsigned *sq_tail;       // advanced by us
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *cq_head;       // advanced by us
+    _Atomic unsigned *cq_tail;       // advanced by the kernel
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+// Set up a ring with room for entries requests. Returns 0, or -1 with errno set.
+static inline int uring_init(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(u, 0, sizeof(*u));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+    u->entries = p.sq_entries;
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(0, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                      IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+    u->cq_ring = u->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->cq_ring = mmap(0, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                          IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(0, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                   IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_head = (_Atomic unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (_Atomic unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (_Atomic unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (_Atomic unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        close(u->fd);
+        u->fd = -1;
+        errno = saved;
+    }
+    return -1;
+}
+
+// The next free SQE, cleared, or NULL if the submission ring is full. It is
+// handed to the kernel by the next uring_submit.
+static inline struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+    unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed) + u->queued;
+    if (tail - atomic_load_explicit(u->sq_head, memory_order_acquire) >= u->entries)
+        return NULL;
+    unsigned i = tail & *u->sq_mask;
+    u->sq_array[i] = i;
+    u->queued++;
+    memset(&u->sqes[i], 0, sizeof(u->sqes[i]));
+    return &u->sqes[i];
+}
+
+// Queue a write of n bytes at p to fd, at the file's current position (or
+// just "next", for a pipe or terminal).
+static inline struct io_uring_sqe *uring_prep_write(struct uring *u, int fd, const void *p, unsigned n,
+                                                    uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)p;
+        sqe->len = n;
+        sqe->off = (uint64_t)-1;
+        sqe->user_data = user_data;
+    }
+    return sqe;
+}
+
+// Hand every queued SQE to the kernel, and wait until at least wait_nr
+// completions are ready (0 means don't wait). Returns 0, or -1 with errno set.
+static inline int uring_submit(struct uring *u, unsigned wait_nr)
+{
+    unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed) + u->queued;
+    atomic_store_explicit(u->sq_tail, tail, memory_order_release);
+    u->queued = 0;
+    while (1) {
+        // The kernel moves sq_head past whatever it has taken, so anything
+        // it did not take this time is still there for the next call.
+        unsigned pending = tail - atomic_load_explicit(u->sq_head, memory_order_acquire);
+        unsigned ready = atomic_load_explicit(u->cq_tail, memory_order_acquire) -
+                         atomic_load_explicit(u->cq_head, memory_order_relaxed);
+        if (pending == 0 && ready >= wait_nr)
+            return 0;
+        if (syscall(__NR_io_uring_enter, u->fd, pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0,
+                    NULL, 0) < 0 && errno != EINTR)
+            return -1;
+    }
+}
+
+// Wait until at least wait_nr completions are ready, without submitting
+// anything, so one thread can wait here while another submits under a lock.
+// Returns 0, or -1 with errno set.
+static inline int uring_wait(struct uring *u, unsigned wait_nr)
+{
+    while (atomic_load_explicit(u->cq_tail, memory_order_acquire) -
+           atomic_load_explicit(u->cq_head, memory_order_relaxed) < wait_nr) {
+        if (syscall(__NR_io_uring_enter, u->fd, 0, wait_nr, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+// Take the next completion, if there is one, without a system call.
+// Returns 1 and fills in *cqe, or returns 0.
+static inline int uring_peek(struct uring *u, struct io_uring_cqe *cqe)
+{
+    unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(u->cq_tail, memory_order_acquire))
+        return 0;
+    *cqe = u->cqes[head & *u->cq_mask];
+    atomic_store_explicit(u->cq_head, head + 1, memory_order_release);
+    return 1;
+}
+
+static inline void uring_close(struct uring *u)
+{
+    if (u->fd < 0)
+        return;
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+    u->fd = -1;
+}
+
+#endif // URING_H